@@ -0,0 +1,73 @@
+#!/bin/sh
+#-----------------------------------------------------------------
+# File: bench.sh
+# Description: End-to-end benchmark of fat2minix (make bench).
+#
+#     bench.sh [fat2minix] > bench.json
+#
+#     Generates a set of FAT16 images (mkfatimg), then converts each
+#     of them with each set of fat2minix options into a new empty
+#     Minix image (mkminiximg), measuring every run with benchrun.
+#     The result is a JSON array with one object per run (see
+#     benchrun.c), labelled IMAGE/OPTIONS.  The exit status is not 0
+#     if an image could not be made (the output then stops there) or
+#     if a conversion failed (its run has an "exit" other than 0).
+#
+#     BENCHDIR    where the images are made (default /tmp/fat2minix-bench)
+#     BENCHMODES  fat2minix options to compare, separated by commas
+#     BENCHRUNS   number of runs of each image and options (default 1)
+#-----------------------------------------------------------------
+FAT2MINIX=${1:-./fat2minix}
+BENCH=$(dirname "$0")
+DIR=${BENCHDIR:-/tmp/fat2minix-bench}
+MODES=${BENCHMODES:-",-j 4,-p 8,-u 32,-t,-c,-m -M"}
+RUNS=${BENCHRUNS:-1}
+
+# name: mkfatimg options
+IMAGES="small:-n 2000 -s 1-16 -D 20 -d 3 -c 4
+medium:-n 300 -s 16-256 -D 10 -d 3 -c 4
+fragmented:-n 300 -s 16-256 -D 10 -d 3 -c 4 -f 30
+bigclusters:-n 150 -s 64-512 -D 5 -d 2 -c 32
+sparse:-n 150 -s 64-512 -D 5 -d 2 -c 8 -z 50"
+
+# Stops with an error (the loops read here-documents, not pipes, so
+# that exit leaves the script and not a subshell)
+fail() {
+   echo "bench.sh: $1" >&2
+   rm -f "$DIR"/*.img
+   exit 1
+}
+
+mkdir -p "$DIR" || exit 1
+echo "["
+sep=""
+status=0
+while IFS=: read -r name args; do
+   # summary: files N dirs N bytes N clusters N image N
+   summary=$("$BENCH/mkfatimg" $args "$DIR/$name.img" </dev/null) || fail "could not make image $name"
+   set -- $summary
+   files=$2
+   bytes=$6
+   while read -r mode; do
+      run=0
+      while [ $run -lt "$RUNS" ]; do
+         "$BENCH/mkminiximg" "$DIR/minix.img" </dev/null || fail "could not make the Minix image"
+         printf '%s' "$sep"
+         result=$("$BENCH/benchrun" -l "$name/$mode" -b "$bytes" -f "$files" \
+            "$FAT2MINIX" $mode "$DIR/$name.img" "$DIR/minix.img" </dev/null) || status=1
+         printf '%s' "$result" | tr -d '\n'
+         sep=",
+"
+         run=$((run+1))
+      done
+   done <<EOF
+$(echo "$MODES" | tr ',' '\n')
+EOF
+done <<EOF
+$IMAGES
+EOF
+echo
+echo "]"
+rm -f "$DIR"/*.img
+[ $status -eq 0 ] || echo "bench.sh: some conversions failed (see \"exit\")" >&2
+exit $status
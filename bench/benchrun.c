@@ -0,0 +1,133 @@
+/*-----------------------------------------------------------------
+File: benchrun.c
+Description: Runs a command (fat2minix) once and reports what it
+             cost as a JSON object on one line, for the benchmark
+	     (see bench.sh).
+
+	     Synopsis:
+
+	     benchrun [-l LABEL] [-b BYTES] [-f FILES] command [args...]
+
+	     -l LABEL  name of the run, copied to the report.
+	     -b BYTES  bytes of file contents converted, for MB/s.
+	     -f FILES  number of files converted, for files/s.
+
+	     The output of the command is discarded.  The report holds
+	     the wall clock, user and system times, the peak resident
+	     size (getrusage), the number of read and write system calls
+	     and the bytes they moved (/proc/PID/io, read while the
+	     command is a zombie), and the exit status.  Reads and
+	     writes done by io_uring are not counted as system calls.
+------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define OK 0
+#define ERR1 -1
+
+// Prototypes
+long long readProcIo(pid_t, char *);
+double seconds(struct timeval *);
+
+/*-----------------------------------------------------------------
+Function: main
+------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+   char *label = "";
+   double bytes = 0, files = 0;
+   struct timespec start, end;
+   struct rusage ru;
+   siginfo_t info;
+   double wall;
+   long long syscr, syscw, rchar, wchar;
+   int opt, fd, status;
+   pid_t pid;
+
+   while((opt = getopt(argc, argv, "+l:b:f:")) != -1)
+   {
+      if(opt == 'l') label = optarg;
+      else if(opt == 'b') bytes = atof(optarg);
+      else if(opt == 'f') files = atof(optarg);
+      else argc = 0;
+   }
+   if(argc - optind < 1)
+   {
+      fprintf(stderr,"Usage: benchrun [-l LABEL] [-b BYTES] [-f FILES] command [args...]\n");
+      return(ERR1);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   pid = fork();
+   if(pid == -1) { perror("benchrun"); return(ERR1); }
+   if(pid == 0)
+   {
+      fd = open("/dev/null", O_WRONLY);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      execvp(argv[optind], argv+optind);
+      _exit(127);
+   }
+   // wait without reaping, so that /proc/PID/io can still be read
+   if(waitid(P_PID, pid, &info, WEXITED|WNOWAIT) == -1) { perror("benchrun"); return(ERR1); }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   syscr = readProcIo(pid, "syscr");
+   syscw = readProcIo(pid, "syscw");
+   rchar = readProcIo(pid, "rchar");
+   wchar = readProcIo(pid, "wchar");
+   if(wait4(pid, &status, 0, &ru) == -1) { perror("benchrun"); return(ERR1); }
+   wall = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+
+   printf("{\"label\": \"%s\", \"seconds\": %.6f, \"user_seconds\": %.6f, \"sys_seconds\": %.6f, "
+          "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"read_syscalls\": %lld, \"write_syscalls\": %lld, "
+          "\"read_bytes\": %lld, \"write_bytes\": %lld, \"peak_rss_kb\": %ld, \"exit\": %d}\n",
+          label, wall, seconds(&ru.ru_utime), seconds(&ru.ru_stime),
+          wall > 0 ? bytes/(1024*1024)/wall : 0, wall > 0 ? files/wall : 0,
+          syscr, syscw, rchar, wchar, ru.ru_maxrss,
+          WIFEXITED(status) ? WEXITSTATUS(status) : 128+WTERMSIG(status));
+   return(WIFEXITED(status) && WEXITSTATUS(status) == 0 ? OK : ERR1);
+}
+
+/*-----------------------------------------------------------------
+Function: readProcIo
+
+Parameters: pid_t pid - process
+            char *name - counter of /proc/PID/io
+
+Returns: value of the counter, or -1 if it cannot be read.
+------------------------------------------------------------------*/
+long long readProcIo(pid_t pid, char *name)
+{
+   char path[64], line[128];
+   long long value = -1;
+   int len = strlen(name);
+   FILE *f;
+
+   sprintf(path, "/proc/%d/io", (int)pid);
+   f = fopen(path, "r");
+   if(f == NULL) return(-1);
+   while(fgets(line, sizeof(line), f) != NULL)
+      if(strncmp(line, name, len) == 0 && line[len] == ':')
+         value = atoll(line+len+1);
+   fclose(f);
+   return(value);
+}
+
+/*-----------------------------------------------------------------
+Function: seconds
+
+Parameters: struct timeval *tv - time
+
+Returns: the time in seconds
+------------------------------------------------------------------*/
+double seconds(struct timeval *tv)
+{
+   return(tv->tv_sec + tv->tv_usec/1e6);
+}
@@ -0,0 +1,465 @@
+/*-----------------------------------------------------------------
+File: microbench.c
+Description: Times the primitives of fat2minix one at a time, so
+             that a change to one of them can be measured directly
+	     instead of through a whole conversion.
+
+	     Synopsis:
+
+	     microbench [fat2minix]
+
+	     The images are generated with mkfatimg and mkminiximg
+	     (found next to microbench) in BENCHDIR (default
+	     /tmp/fat2minix-bench) and mapped in memory (as with -m
+	     and -M), so that no read or write reaches the disk.
+	     fat2minix (default ./fat2minix) converts the images
+	     used for findInodeFromPath.
+
+	     Each case runs for at least MIN_TIME and one line is
+	     printed per case: function, case, ns/op and ops/s.
+
+	     findFreeDataBlock, findFreeInode  zone map and inode map
+	         filled at random to 0, 50, 90 and 99 percent; the
+		 bits allocated are cleared again between batches, so
+		 that the fill level stays the same.
+	     getFatDataBlock  random blocks of a file of 4, 64 and
+	         512 clusters, contiguous and fragmented.
+	     seekToDataBlock  direct and indirect blocks of a file
+	         of 519 blocks.
+	     findInodeFromPath  random files of directories of 16, 64
+	         and 200 entries.
+	     getFatName, getMinixTimeFromFat  the entries of a
+	         directory of 200 files.
+------------------------------------------------------------------*/
+#include "../fat2minix.h"
+#include "../fat.h"
+#include "../minix.h"
+#include <libgen.h>
+
+#define MIN_TIME 200e6  /* ns spent in each case at least */
+#define BATCH 1000  /* allocations between clearing the bits again */
+#define NUM_RANDOM 4096  /* random arguments, used in turn */
+
+// In minix.c, not in minix.h
+extern struct minix_super_block minixSB;
+extern unsigned char *imap, *zmap;
+extern struct minixBitmap inodeBitmap, zoneBitmap;
+void initBitmap(struct minixBitmap *, unsigned char *, int);
+void clearBit(struct minixBitmap *, int);
+// In fat2minix.c (built with -DNO_MAIN)
+char *getFatDataBlock(int, FATEXTENTS *, char *);
+unsigned getMinixTimeFromFat(struct msdos_dir_entry *);
+
+// Prototypes
+int makeImage(char *, char *, char *);
+int openMinix(char *);
+void closeMinix(void);
+int openFat(char *);
+void quiet(int);
+double now(void);
+unsigned nextRandom(void);
+void runCase(char *, char *, double (*)(long));
+void fillBitmap(struct minixBitmap *, unsigned char *, unsigned char *, int);
+double opFindFreeDataBlock(long);
+double opFindFreeInode(long);
+double opGetFatDataBlock(long);
+double opSeekToDataBlock(long);
+double opFindInodeFromPath(long);
+double opGetFatName(long);
+double opGetMinixTimeFromFat(long);
+
+// Global data
+char *benchDir;  // where the images are made
+char *toolDir;  // where mkfatimg and mkminiximg are
+char *fat2minix;  // converts the images for findInodeFromPath
+int fatImage = -1, minixImage = -1;  // open images
+unsigned randomState = 1;  // xorshift
+int args[NUM_RANDOM];  // random arguments of the case
+FATEXTENTS *ext;  // getFatDataBlock: file read
+struct minix_inode fileIno;  // seekToDataBlock: file of 519 blocks
+char paths[NUM_RANDOM][32];  // findInodeFromPath: files looked up
+struct msdos_dir_entry *entries;  // getFatName, getMinixTimeFromFat
+int numEntries;
+volatile long sink;  // keeps the results of the calls
+
+/*-----------------------------------------------------------------
+Function: main
+------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+   static int fills[] = {0, 50, 90, 99};
+   static int chains[] = {4, 64, 512};
+   static int dirSizes[] = {16, 64, 200};
+   unsigned char *zmapCopy, *imapCopy;
+   char img[BUFSIZ], opts[BUFSIZ], name[64];
+   struct msdos_dir_entry *root;
+   unsigned short index[BLOCK_SIZE/2];
+   int i, j, frag, n;
+
+   if(argc > 2)
+   {
+      fprintf(stderr,"Usage: microbench [fat2minix]\n");
+      return(ERR1);
+   }
+   fat2minix = argc == 2 ? argv[1] : "./fat2minix";
+   benchDir = getenv("BENCHDIR") != NULL ? getenv("BENCHDIR") : "/tmp/fat2minix-bench";
+   toolDir = dirname(strdup(argv[0]));
+   mkdir(benchDir, 0755);
+   printf("%-20s %-24s %12s %14s\n", "function", "case", "ns/op", "ops/s");
+
+   // Minix file system: a file of 519 blocks, then the maps at each fill level
+   if(makeImage("mkminiximg", "-i 16384", "minix.img") == ERR1 || openMinix("minix.img") == ERR1)
+      return(ERR1);
+   memset(&fileIno, 0, sizeof(fileIno));
+   n = allocFileBlocks(7+BLOCK_SIZE/2, &fileIno, index);
+   writeDataBlock(fileIno.i_zone[7], (char *)index);
+   for(i=0 ; i<NUM_RANDOM ; i++) args[i] = nextRandom()%7;
+   runCase("seekToDataBlock", "direct", opSeekToDataBlock);
+   for(i=0 ; i<NUM_RANDOM ; i++) args[i] = 7+nextRandom()%(n-7);
+   runCase("seekToDataBlock", "indirect", opSeekToDataBlock);
+
+   zmapCopy = malloc(minixSB.s_zmap_blocks*BLOCK_SIZE);
+   imapCopy = malloc(minixSB.s_imap_blocks*BLOCK_SIZE);
+   memcpy(zmapCopy, zmap, minixSB.s_zmap_blocks*BLOCK_SIZE);
+   memcpy(imapCopy, imap, minixSB.s_imap_blocks*BLOCK_SIZE);
+   for(i=0 ; i<sizeof(fills)/sizeof(int) ; i++)
+   {
+      sprintf(name, "fill %d%% (%d zones)", fills[i], zoneBitmap.numBits-1);
+      fillBitmap(&zoneBitmap, zmap, zmapCopy, fills[i]);
+      runCase("findFreeDataBlock", name, opFindFreeDataBlock);
+   }
+   for(i=0 ; i<sizeof(fills)/sizeof(int) ; i++)
+   {
+      sprintf(name, "fill %d%% (%d inodes)", fills[i], inodeBitmap.numBits-1);
+      fillBitmap(&inodeBitmap, imap, imapCopy, fills[i]);
+      runCase("findFreeInode", name, opFindFreeInode);
+   }
+   free(zmapCopy);
+   free(imapCopy);
+
+   // FAT file system: one file, clusters of 1K
+   for(frag=0 ; frag<=50 ; frag+=50)
+      for(i=0 ; i<sizeof(chains)/sizeof(int) ; i++)
+      {
+         sprintf(opts, "-n 1 -D 0 -s %d-%d -c 2 -f %d", chains[i], chains[i], frag);
+         if(makeImage("mkfatimg", opts, "fat.img") == ERR1 || openFat("fat.img") == ERR1)
+            return(ERR1);
+         root = (struct msdos_dir_entry *)readFatRegion(ROOTDIR_POS, CLUSTER_SIZE, NULL);
+         for(j=0 ; root[j].start == 0 ; j++);  // the entries . and .. are not in the root
+         ext = getFatExtents(root[j].start);
+         n = root[j].size/BLOCK_SIZE;
+         for(j=0 ; j<NUM_RANDOM ; j++) args[j] = nextRandom()%n;
+         sprintf(name, "%d clusters, %d runs", chains[i], ext->numExtents);
+         runCase("getFatDataBlock", name, opGetFatDataBlock);
+         freeFatExtents(ext);
+      }
+
+   // Directories of each size, converted by fat2minix
+   for(i=0 ; i<sizeof(dirSizes)/sizeof(int) ; i++)
+   {
+      closeMinix();  // before its image is made again
+      sprintf(opts, "-n %d -D 0 -s 1-1", dirSizes[i]);
+      if(makeImage("mkfatimg", opts, "fat.img") == ERR1 ||
+         makeImage("mkminiximg", "", "minix.img") == ERR1)
+         return(ERR1);
+      sprintf(img, "%s %s/fat.img %s/minix.img > /dev/null", fat2minix, benchDir, benchDir);
+      if(system(img) != 0)
+      {
+         fprintf(stderr,"microbench: %s failed\n", fat2minix);
+         return(ERR1);
+      }
+      if(openMinix("minix.img") == ERR1) return(ERR1);
+      for(j=0 ; j<NUM_RANDOM ; j++) sprintf(paths[j], "/f%u.dat", 1+nextRandom()%dirSizes[i]);
+      sprintf(name, "%d entries", dirSizes[i]);
+      runCase("findInodeFromPath", name, opFindInodeFromPath);
+   }
+   // the last FAT image: entries of a directory of 200 files
+   if(openFat("fat.img") == ERR1) return(ERR1);
+   entries = (struct msdos_dir_entry *)readFatRegion(ROOTDIR_POS, DATA_POS-ROOTDIR_POS, NULL);
+   for(numEntries=0 ; numEntries<*(short *)fbs.dir_entries && entries[numEntries].name[0] != 0 ; numEntries++);
+   sprintf(name, "%d entries", numEntries);
+   runCase("getFatName", name, opGetFatName);
+   runCase("getMinixTimeFromFat", name, opGetMinixTimeFromFat);
+
+   closeMinix();
+   unmapFatImage();
+   close(fatImage);
+   unlink(strcat(strcat(strcpy(img, benchDir), "/"), "fat.img"));
+   unlink(strcat(strcat(strcpy(img, benchDir), "/"), "minix.img"));
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: makeImage
+
+Parameters: char *tool - mkfatimg or mkminiximg
+            char *opts - options of the tool
+	    char *image - file name of the image in benchDir
+
+Returns: OK or ERR1 if the tool failed.
+------------------------------------------------------------------*/
+int makeImage(char *tool, char *opts, char *image)
+{
+   char cmd[BUFSIZ];
+   sprintf(cmd, "%s/%s %s %s/%s > /dev/null", toolDir, tool, opts, benchDir, image);
+   if(system(cmd) != 0)
+   {
+      fprintf(stderr,"microbench: %s failed\n", cmd);
+      return(ERR1);
+   }
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: openMinix   openFat
+
+Parameters: char *image - file name of the image in benchDir
+
+Returns: OK or ERR1.
+
+Description: Opens and maps the image and reads its super block /
+             boot sector, quietly.  openFat closes the FAT image
+	     open before.  Regions of the mapped FAT image are read
+	     in place (readFatRegion with no buffer).
+------------------------------------------------------------------*/
+int openMinix(char *image)
+{
+   char path[BUFSIZ];
+   int retcd = ERR1;
+   quiet(TRUE);
+   sprintf(path, "%s/%s", benchDir, image);
+   minixImage = open(path, O_RDWR);
+   if(minixImage != -1 && mapMinixImage(minixImage) == OK && initMinixFS(minixImage) == OK)
+      retcd = OK;
+   quiet(FALSE);
+   if(retcd == ERR1) fprintf(stderr,"microbench: cannot open %s\n", path);
+   return(retcd);
+}
+
+int openFat(char *image)
+{
+   char path[BUFSIZ];
+   int retcd = ERR1;
+   quiet(TRUE);
+   if(fatImage != -1)
+   {
+      unmapFatImage();
+      close(fatImage);
+   }
+   sprintf(path, "%s/%s", benchDir, image);
+   fatImage = open(path, O_RDONLY);
+   if(fatImage != -1 && mapFatImage(fatImage) == OK && readFatBoot(fatImage) == OK)
+      retcd = OK;
+   quiet(FALSE);
+   if(retcd == ERR1) fprintf(stderr,"microbench: cannot open %s\n", path);
+   return(retcd);
+}
+
+/*-----------------------------------------------------------------
+Function: closeMinix
+
+Description: Closes the Minix image, if open, so that it can be made
+             again (the mapping is flushed when it is closed).
+------------------------------------------------------------------*/
+void closeMinix()
+{
+   if(minixImage != -1)
+   {
+      quiet(TRUE);
+      closeMinixFS();
+      quiet(FALSE);
+      minixImage = -1;
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: quiet
+
+Parameters: int on - TRUE to discard the standard output, FALSE to
+                     restore it
+
+Description: The file systems print their super block and boot sector
+             when they are opened.
+------------------------------------------------------------------*/
+void quiet(int on)
+{
+   static int saved = -1;
+   int fd;
+   fflush(stdout);
+   if(on)
+   {
+      saved = dup(STDOUT_FILENO);
+      fd = open("/dev/null", O_WRONLY);
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+   }
+   else
+   {
+      dup2(saved, STDOUT_FILENO);
+      close(saved);
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: now
+
+Returns: the monotonic clock in ns.
+------------------------------------------------------------------*/
+double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec*1e9 + ts.tv_nsec);
+}
+
+/*-----------------------------------------------------------------
+Function: nextRandom
+
+Returns: next random number (xorshift, the same on every run).
+------------------------------------------------------------------*/
+unsigned nextRandom()
+{
+   randomState ^= randomState << 13;
+   randomState ^= randomState >> 17;
+   randomState ^= randomState << 5;
+   return(randomState);
+}
+
+/*-----------------------------------------------------------------
+Function: runCase
+
+Parameters: char *function - function timed
+            char *name - case
+	    double (*op)(long) - calls the function n times and
+	                         returns the ns spent in the calls
+
+Description: Doubles the number of calls until they take MIN_TIME,
+             then prints ns/op and ops/s.
+------------------------------------------------------------------*/
+void runCase(char *function, char *name, double (*op)(long))
+{
+   long n = 1000;
+   double ns;
+   op(n);  // warm up
+   while((ns = op(n)) < MIN_TIME) n *= ns < MIN_TIME/16 ? 8 : 2;
+   printf("%-20s %-24s %12.1f %14.0f\n", function, name, ns/n, n/ns*1e9);
+   fflush(stdout);
+}
+
+/*-----------------------------------------------------------------
+Function: fillBitmap
+
+Parameters: struct minixBitmap *bm - allocator over the map
+            unsigned char *map - imap or zmap
+	    unsigned char *empty - the map as it was in the new image
+	    int fill - percentage of the bits to set
+
+Description: Sets bits at random (bit 0 and the bits of the new
+             image stay set) and counts the free bits again.
+------------------------------------------------------------------*/
+void fillBitmap(struct minixBitmap *bm, unsigned char *map, unsigned char *empty, int fill)
+{
+   int i;
+   memcpy(map, empty, (bm->numBits+7)/8);
+   for(i=1 ; i<bm->numBits ; i++)
+      if(nextRandom()%100 < fill) map[i/8] |= 1 << (i%8);
+   initBitmap(bm, map, bm->numBits);
+}
+
+/*-----------------------------------------------------------------
+Function: opFindFreeDataBlock   opFindFreeInode
+
+Parameters: long n - number of calls
+
+Returns: ns spent in the calls.
+
+Description: Allocates in batches and clears the bits of each batch
+             (not timed), so that the fill level stays the same while
+	     the cursor of the allocator moves on through the map.
+------------------------------------------------------------------*/
+double opFindFreeDataBlock(long n)
+{
+   int blocks[BATCH];
+   int batch = zoneBitmap.numFree/2 < BATCH ? zoneBitmap.numFree/2 : BATCH;
+   int firstZone = FIRSTZONE;
+   double start, ns = 0;
+   int i;
+   for( ; n > 0 ; n -= batch)
+   {
+      start = now();
+      for(i=0 ; i<batch ; i++) blocks[i] = findFreeDataBlock();
+      ns += now()-start;
+      for(i=0 ; i<batch ; i++) clearBit(&zoneBitmap, blocks[i]-firstZone+1);
+   }
+   return(ns);
+}
+
+double opFindFreeInode(long n)
+{
+   int inodes[BATCH];
+   int batch = inodeBitmap.numFree/2 < BATCH ? inodeBitmap.numFree/2 : BATCH;
+   double start, ns = 0;
+   int i;
+   for( ; n > 0 ; n -= batch)
+   {
+      start = now();
+      for(i=0 ; i<batch ; i++) inodes[i] = findFreeInode();
+      ns += now()-start;
+      for(i=0 ; i<batch ; i++) clearBit(&inodeBitmap, inodes[i]);
+   }
+   return(ns);
+}
+
+/*-----------------------------------------------------------------
+Function: opGetFatDataBlock   opSeekToDataBlock   opFindInodeFromPath
+          opGetFatName   opGetMinixTimeFromFat
+
+Parameters: long n - number of calls
+
+Returns: ns spent in the calls.
+
+Description: Calls the function with the random arguments in turn.
+------------------------------------------------------------------*/
+double opGetFatDataBlock(long n)
+{
+   char block[BLOCK_SIZE];
+   double start = now();
+   long i;
+   for(i=0 ; i<n ; i++) sink += *getFatDataBlock(args[i%NUM_RANDOM], ext, block);
+   return(now()-start);
+}
+
+double opSeekToDataBlock(long n)
+{
+   double start = now();
+   long i;
+   for(i=0 ; i<n ; i++) sink += seekToDataBlock(args[i%NUM_RANDOM], &fileIno);
+   return(now()-start);
+}
+
+double opFindInodeFromPath(long n)
+{
+   struct minix_inode ino;
+   int parent;
+   double start = now();
+   long i;
+   for(i=0 ; i<n ; i++) sink += findInodeFromPath(paths[i%NUM_RANDOM], &ino, &parent);
+   return(now()-start);
+}
+
+double opGetFatName(long n)
+{
+   char name[16];
+   double start = now();
+   long i;
+   for(i=0 ; i<n ; i++) sink += *getFatName(&entries[i%numEntries], name);
+   return(now()-start);
+}
+
+double opGetMinixTimeFromFat(long n)
+{
+   double start = now();
+   long i;
+   for(i=0 ; i<n ; i++) sink += getMinixTimeFromFat(&entries[i%numEntries]);
+   return(now()-start);
+}
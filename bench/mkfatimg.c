@@ -0,0 +1,384 @@
+/*-----------------------------------------------------------------
+File: mkfatimg.c
+Description: Generates a FAT16 file system image filled with
+             directories and files, for measuring fat2minix.
+
+	     Synopsis:
+
+	     mkfatimg [-n FILES] [-s MINKB-MAXKB] [-D DIRS] [-d DEPTH]
+	              [-c SECTORS] [-f PCT] [-z PCT] [-r SEED] <image>
+
+	     -n FILES  number of files (default 200).
+	     -s MINKB-MAXKB  range of the file sizes in Kbytes (default
+	         1-256); sizes are spread evenly on a log scale, so
+		 there are as many files of 1-2K as of 128-256K.  Minix
+		 v1 files are limited to 519K.
+	     -D DIRS  number of subdirectories (default 10).
+	     -d DEPTH  largest depth of a subdirectory (default 3).
+	     -c SECTORS  sectors (of 512 bytes) per cluster (default 4, at least
+	         2: fat2minix copies 1 Kbyte blocks from within a cluster).
+	     -f PCT  fragmentation: chance in percent that the next
+	         cluster of a file or directory is taken anywhere in the
+		 free space instead of after the previous one (default 0).
+	     -z PCT  percentage of the files that hold only zeros
+	         (default 0).
+	     -r SEED  seed of the random numbers (default 1).
+
+	     The layout is the one read by fat2minix (see fatDefn.h):
+	     one reserved sector, two FATs and 512 root directory
+	     entries.  The image is just large enough for the data
+	     (and at least the 4085 clusters of a FAT16).  A summary
+	     is printed on the standard output:
+	         files N dirs N bytes N clusters N image N
+------------------------------------------------------------------*/
+#include "../fatDefn.h"
+#include <fcntl.h>
+#include <math.h>
+
+#define SECTORSIZE 512
+#define NUMFATS 2
+#define ROOTENTRIES 512
+#define MAXDIRFILES 200  /* entries of a directory (Minix: 224 at most) */
+#define MAXFILEKB 519  /* largest Minix v1 file */
+#define MINCLUSTERS 4085  /* fewer clusters make a FAT12 */
+#define MAXCLUSTERS 65524
+
+/* A directory or a file of the image */
+struct node
+{
+   int parent;  // directory (index in nodes, -1 for the root)
+   int isDir;
+   int depth;  // of a directory: 0 for the root
+   int numEntries;  // of a directory: entries used in its table
+   unsigned size;  // of a file: size in bytes
+   int zero;  // of a file: TRUE if it holds only zeros
+   int numClusters;
+   int *clusters;  // the chain of clusters
+};
+
+// Global data
+struct node *nodes;  // the root, the directories, then the files
+int numNodes;
+unsigned short *fat;  // the FAT table
+unsigned char *used;  // clusters allocated
+int numClusters;  // data clusters of the image
+int nextCluster = 2;  // next cluster taken when not fragmenting
+int fragPct = 0;
+unsigned long long rnd;  // state of the random numbers
+
+// Prototypes
+unsigned long long nextRandom(void);
+int allocCluster(void);
+int allocChain(struct node *, int);
+void makeEntry(struct msdos_dir_entry *, char *, int, struct node *);
+void fillContents(char *, struct node *, int, int);
+
+/*-----------------------------------------------------------------
+Function: main
+
+Description: Builds the tree (directories placed at random under
+             directories not deeper than DEPTH-1, files under any
+	     directory with room), sizes the image, allocates the
+	     clusters (directories first, then the files in random
+	     order), then fills and writes the image.
+------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+   int numFiles = 200, numDirs = 10, maxDepth = 3, spc = 4, zeroPct = 0;
+   double minKB = 1, maxKB = 256;
+   struct fat_boot_sector *fbs;
+   struct msdos_dir_entry *table;
+   struct node *n, tmp;
+   char *image, *data;
+   off_t rootPos, dataPos, imageSize;
+   int clusterSize, fatLength, totalSectors;
+   long long totalBytes = 0;
+   int totalClusters = 0;
+   int opt, i, j, c, fd, p, tries;
+   char name[16];
+
+   rnd = 1;
+   while((opt = getopt(argc, argv, "n:s:D:d:c:f:z:r:")) != -1)
+   {
+      if(opt == 'n') numFiles = atoi(optarg);
+      else if(opt == 's')
+      {
+         if(sscanf(optarg, "%lf-%lf", &minKB, &maxKB) != 2) argc = 0;
+      }
+      else if(opt == 'D') numDirs = atoi(optarg);
+      else if(opt == 'd') maxDepth = atoi(optarg);
+      else if(opt == 'c') spc = atoi(optarg);
+      else if(opt == 'f') fragPct = atoi(optarg);
+      else if(opt == 'z') zeroPct = atoi(optarg);
+      else if(opt == 'r') rnd = strtoull(optarg, NULL, 10) | 1;
+      else argc = 0;
+   }
+   if(argc - optind != 1 || numFiles < 0 || numDirs < 0 || maxDepth < 1 ||
+      spc < 2 || spc > 128 || (spc & (spc-1)) != 0 || minKB <= 0 || maxKB < minKB)
+   {
+      fprintf(stderr,"Usage: mkfatimg [-n FILES] [-s MINKB-MAXKB] [-D DIRS] [-d DEPTH]\n"
+                     "                [-c SECTORS] [-f PCT] [-z PCT] [-r SEED] <image>\n");
+      return(ERR1);
+   }
+   if(maxKB > MAXFILEKB) maxKB = MAXFILEKB;
+   if(minKB > maxKB) minKB = maxKB;
+   clusterSize = spc*SECTORSIZE;
+
+   // the tree: root, directories, files
+   numNodes = 1+numDirs+numFiles;
+   nodes = calloc(numNodes, sizeof(struct node));
+   if(nodes == NULL) { perror("mkfatimg"); return(ERR1); }
+   nodes[0].parent = -1;
+   nodes[0].isDir = TRUE;
+   for(i=1 ; i<=numDirs+numFiles ; i++)
+   {
+      n = nodes+i;
+      n->isDir = i <= numDirs;
+      for(tries=0 ; tries < 1000 ; tries++)  // a directory with room
+      {
+         p = nextRandom() % (i <= numDirs ? i : numDirs+1);
+         if(nodes[p].numEntries < (p == 0 ? ROOTENTRIES : MAXDIRFILES) &&
+            (!n->isDir || nodes[p].depth < maxDepth)) break;
+      }
+      if(tries == 1000)
+      {
+         fprintf(stderr,"mkfatimg: no room for %d entries - use more directories\n",
+                 numDirs+numFiles);
+         return(ERR1);
+      }
+      n->parent = p;
+      nodes[p].numEntries++;
+      if(n->isDir)
+      {
+         n->depth = nodes[p].depth+1;
+         n->numEntries = 2;  // . and ..
+      }
+      else
+      {
+         n->size = exp(log(minKB) + (log(maxKB)-log(minKB))*(nextRandom()%10000)/10000.0)*1024;
+         n->zero = (int)(nextRandom()%100) < zeroPct;
+         totalBytes += n->size;
+      }
+   }
+   // sizes in clusters (directories keep room for all their entries)
+   for(i=1 ; i<numNodes ; i++)
+   {
+      n = nodes+i;
+      if(n->isDir) n->numClusters = (n->numEntries*sizeof(struct msdos_dir_entry)+clusterSize-1)/clusterSize;
+      else n->numClusters = (n->size+clusterSize-1)/clusterSize;
+      totalClusters += n->numClusters;
+   }
+
+   // the image: boot sector, FATs, root directory, data area
+   numClusters = totalClusters + totalClusters/8 + 16;  // some free space
+   if(numClusters < MINCLUSTERS) numClusters = MINCLUSTERS;
+   if(numClusters > MAXCLUSTERS)
+   {
+      fprintf(stderr,"mkfatimg: %d clusters needed, a FAT16 has at most %d\n",
+              totalClusters, MAXCLUSTERS);
+      return(ERR1);
+   }
+   fatLength = ((numClusters+2)*2+SECTORSIZE-1)/SECTORSIZE;
+   rootPos = SECTORSIZE*(1+NUMFATS*fatLength);
+   dataPos = rootPos + ROOTENTRIES*sizeof(struct msdos_dir_entry);
+   imageSize = dataPos + (off_t)numClusters*clusterSize;
+   totalSectors = imageSize/SECTORSIZE;
+   image = calloc(1, imageSize);
+   fat = calloc(fatLength*SECTORSIZE, 1);
+   used = calloc(numClusters+2, 1);
+   if(image == NULL || fat == NULL || used == NULL) { perror("mkfatimg"); return(ERR1); }
+   fat[0] = 0xFFF8;
+   fat[1] = 0xFFFF;
+
+   // clusters: directories first, then the files in random order
+   for(i=1 ; i<=numDirs ; i++)
+      if(allocChain(nodes+i, nodes[i].numClusters) == ERR1) return(ERR1);
+   for(i=numDirs+1 ; i<numNodes ; i++)  // shuffle the files
+   {
+      j = numDirs+1 + nextRandom()%(numNodes-numDirs-1);
+      tmp = nodes[i];
+      nodes[i] = nodes[j];
+      nodes[j] = tmp;
+   }
+   for(i=numDirs+1 ; i<numNodes ; i++)
+      if(allocChain(nodes+i, nodes[i].numClusters) == ERR1) return(ERR1);
+
+   // boot sector
+   fbs = (struct fat_boot_sector *)image;
+   memcpy(fbs->ignored, "\xeb\x3c\x90", 3);
+   memcpy(fbs->system_id, "MKFATIMG", 8);
+   fbs->sector_size[0] = SECTORSIZE & 0xFF;
+   fbs->sector_size[1] = SECTORSIZE >> 8;
+   fbs->cluster_size = spc;
+   fbs->reserved = 1;
+   fbs->fats = NUMFATS;
+   fbs->dir_entries[0] = ROOTENTRIES & 0xFF;
+   fbs->dir_entries[1] = ROOTENTRIES >> 8;
+   if(totalSectors < 65536)
+   {
+      fbs->sectors[0] = totalSectors & 0xFF;
+      fbs->sectors[1] = totalSectors >> 8;
+   }
+   else fbs->total_sect = totalSectors;
+   fbs->media = 0xF8;
+   fbs->fat_length = fatLength;
+   fbs->secs_track = 32;
+   fbs->heads = 64;
+   image[510] = 0x55;
+   image[511] = 0xAA;
+   for(i=0 ; i<NUMFATS ; i++)
+      memcpy(image+SECTORSIZE*(1+i*fatLength), fat, fatLength*SECTORSIZE);
+
+   // directory tables and contents
+   for(i=0 ; i<numNodes ; i++) nodes[i].numEntries = 0;
+   for(i=1 ; i<=numDirs ; i++)  // . and ..
+   {
+      n = nodes+i;
+      table = (struct msdos_dir_entry *)(image + dataPos + (off_t)(n->clusters[0]-2)*clusterSize);
+      makeEntry(table, ".", ATTR_DIR, n);
+      makeEntry(table+1, "..", ATTR_DIR, n->parent == 0 ? nodes : nodes+n->parent);
+      n->numEntries = 2;
+   }
+   for(i=1 ; i<numNodes ; i++)
+   {
+      n = nodes+i;
+      if(n->isDir) sprintf(name, "DIR%d", i);
+      else sprintf(name, "F%d.DAT", i);
+      if(n->parent == 0) table = (struct msdos_dir_entry *)(image+rootPos);
+      else
+      {
+         // the entry is in the cluster of the directory that holds it
+         c = nodes[n->parent].numEntries*sizeof(struct msdos_dir_entry)/clusterSize;
+         table = (struct msdos_dir_entry *)(image + dataPos +
+                 (off_t)(nodes[n->parent].clusters[c]-2)*clusterSize) +
+                 nodes[n->parent].numEntries%(clusterSize/sizeof(struct msdos_dir_entry));
+      }
+      if(n->parent == 0) table += nodes[0].numEntries;
+      makeEntry(table, name, n->isDir ? ATTR_DIR : ATTR_ARCH, n);
+      nodes[n->parent].numEntries++;
+      if(!n->isDir && !n->zero)
+         for(c=0 ; c<n->numClusters ; c++)
+         {
+            data = image + dataPos + (off_t)(n->clusters[c]-2)*clusterSize;
+            fillContents(data, n, c, clusterSize);
+         }
+   }
+
+   fd = open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd == -1 || write(fd, image, imageSize) != imageSize || close(fd) == -1)
+   {
+      perror(argv[optind]);
+      return(ERR1);
+   }
+   printf("files %d dirs %d bytes %lld clusters %d image %lld\n",
+          numFiles, numDirs, totalBytes, totalClusters, (long long)imageSize);
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: nextRandom
+
+Returns: the next random number (xorshift64, repeatable with -r)
+------------------------------------------------------------------*/
+unsigned long long nextRandom()
+{
+   rnd ^= rnd << 13;
+   rnd ^= rnd >> 7;
+   rnd ^= rnd << 17;
+   return(rnd);
+}
+
+/*-----------------------------------------------------------------
+Function: allocCluster / allocChain
+
+Parameters: struct node *n - directory or file
+            int count - number of clusters of its chain
+
+Returns: allocCluster - a free cluster (0 if none)
+         allocChain - OK, or ERR1 if the image is full
+
+Description: Clusters are taken one after the other, except that
+             with -f PCT a cluster is taken at a random free place
+	     PCT percent of the time.  allocChain links the chain
+	     in the FAT.
+------------------------------------------------------------------*/
+int allocCluster()
+{
+   int c, tries;
+   if(fragPct > 0 && (int)(nextRandom()%100) < fragPct)
+      for(tries=0 ; tries<64 ; tries++)
+      {
+         c = 2 + nextRandom()%numClusters;
+         if(!used[c]) { used[c] = TRUE; return(c); }
+      }
+   for( ; nextCluster < numClusters+2 && used[nextCluster] ; nextCluster++) ;
+   if(nextCluster == numClusters+2)  // take the first free one
+      for(nextCluster=2 ; nextCluster < numClusters+2 && used[nextCluster] ; nextCluster++) ;
+   if(nextCluster == numClusters+2) return(0);
+   used[nextCluster] = TRUE;
+   return(nextCluster++);
+}
+
+int allocChain(struct node *n, int count)
+{
+   int i;
+   n->clusters = malloc((count > 0 ? count : 1)*sizeof(int));
+   if(n->clusters == NULL) { perror("mkfatimg"); return(ERR1); }
+   for(i=0 ; i<count ; i++)
+   {
+      n->clusters[i] = allocCluster();
+      if(n->clusters[i] == 0) { fprintf(stderr,"mkfatimg: image full\n"); return(ERR1); }
+      if(i > 0) fat[n->clusters[i-1]] = n->clusters[i];
+   }
+   if(count > 0) fat[n->clusters[count-1]] = 0xFFFF;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: makeEntry
+
+Parameters: struct msdos_dir_entry *de - entry to fill
+            char *name - name (NAME.EXT)
+	    int attr - attributes
+	    struct node *n - the directory or file (the root for a ..
+	                     entry to the root)
+
+Description: Fills a directory entry with a fixed time and date.
+------------------------------------------------------------------*/
+void makeEntry(struct msdos_dir_entry *de, char *name, int attr, struct node *n)
+{
+   char *dot = name[0] == '.' ? NULL : strchr(name, '.');  // . and .. have no extension
+   int len = dot == NULL ? strlen(name) : dot-name;
+   memset(de->name, ' ', 8);
+   memset(de->ext, ' ', 3);
+   memcpy(de->name, name, len > 8 ? 8 : len);
+   if(dot != NULL) memcpy(de->ext, dot+1, strlen(dot+1) > 3 ? 3 : strlen(dot+1));
+   de->attr = attr;
+   de->time = de->ctime = 0x6000;  // 12:00:00
+   de->date = de->cdate = de->adate = 0x4a21;  // 2017-01-01
+   de->start = n == nodes || n->numClusters == 0 ? 0 : n->clusters[0];
+   de->size = n->isDir ? 0 : n->size;
+}
+
+/*-----------------------------------------------------------------
+Function: fillContents
+
+Parameters: char *data - cluster to fill
+            struct node *n - file
+	    int c - cluster number in the file
+	    int clusterSize - size of a cluster
+
+Description: Fills a cluster of a file with random bytes (zeros after
+             the end of the file).
+------------------------------------------------------------------*/
+void fillContents(char *data, struct node *n, int c, int clusterSize)
+{
+   unsigned long long r;
+   int i, len = n->size - c*clusterSize;
+   if(len > clusterSize) len = clusterSize;
+   for(i=0 ; i<len ; i+=8)
+   {
+      r = nextRandom();
+      memcpy(data+i, &r, len-i < 8 ? len-i : 8);
+   }
+}
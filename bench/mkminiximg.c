@@ -0,0 +1,133 @@
+/*-----------------------------------------------------------------
+File: mkminiximg.c
+Description: Generates an empty Minix v1 file system image (30
+             character names), the target of fat2minix, as
+	     mkfs.minix -1 -n 30 would.
+
+	     Synopsis:
+
+	     mkminiximg [-i INODES] <image> [BLOCKS]
+
+	     -i INODES  number of inodes (default 4096, rounded up to
+	         fill the blocks of the inode table).
+	     BLOCKS  size of the file system in blocks of 1K (default
+	         and largest 65535).
+
+	     The image is created sparse: only the boot block, the
+	     super block, the maps, the inode table and the root
+	     directory are written.
+------------------------------------------------------------------*/
+#include "../minix.h"
+
+#define INODES_PER_BLOCK (BLOCK_SIZE/INODE_SIZE)
+#define BITS_PER_BLOCK (8*BLOCK_SIZE)
+
+// Prototypes
+void setBit(unsigned char *, int);
+
+/*-----------------------------------------------------------------
+Function: main
+
+Description: Lays out the file system (boot block, super block, inode
+             map, zone map, inode table, data zones), marks the
+	     reserved bits and the bits past the end of the maps as
+	     used, and creates the root directory (inode 1 and the
+	     first data zone, with . and ..).
+------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+   int numInodes = 4096, numBlocks = TOTALBLOCKS;
+   struct minix_super_block *sb;
+   struct minix_inode *root;
+   struct dentry *table;
+   unsigned char *image, *imap, *zmap;
+   int imapBlocks, zmapBlocks, itableBlocks, firstZone, numZones;
+   int metaBlocks;  // blocks written: up to the root directory
+   int opt, i, fd;
+
+   while((opt = getopt(argc, argv, "i:")) != -1)
+   {
+      if(opt == 'i') numInodes = atoi(optarg);
+      else argc = 0;
+   }
+   if(argc - optind == 2) numBlocks = atoi(argv[optind+1]);
+   if((argc - optind != 1 && argc - optind != 2) || numInodes < 1 ||
+      numBlocks < 64 || numBlocks > TOTALBLOCKS)
+   {
+      fprintf(stderr,"Usage: mkminiximg [-i INODES] <image> [BLOCKS]\n");
+      return(ERR1);
+   }
+   // layout
+   numInodes = (numInodes+INODES_PER_BLOCK-1)/INODES_PER_BLOCK*INODES_PER_BLOCK;
+   if(numInodes > 65535-INODES_PER_BLOCK+1) numInodes = 65535-INODES_PER_BLOCK+1;
+   itableBlocks = numInodes/INODES_PER_BLOCK;
+   imapBlocks = (numInodes+1+BITS_PER_BLOCK-1)/BITS_PER_BLOCK;
+   zmapBlocks = (numBlocks+BITS_PER_BLOCK-1)/BITS_PER_BLOCK;
+   firstZone = 2+imapBlocks+zmapBlocks+itableBlocks;
+   numZones = numBlocks-firstZone;
+   if(numZones < 1)
+   {
+      fprintf(stderr,"mkminiximg: too many inodes for %d blocks\n", numBlocks);
+      return(ERR1);
+   }
+   metaBlocks = firstZone+1;
+   image = calloc(metaBlocks, BLOCK_SIZE);
+   if(image == NULL) { perror("mkminiximg"); return(ERR1); }
+
+   // super block
+   sb = (struct minix_super_block *)(image+BLOCK_SIZE);
+   sb->s_ninodes = numInodes;
+   sb->s_nzones = numBlocks;
+   sb->s_imap_blocks = imapBlocks;
+   sb->s_zmap_blocks = zmapBlocks;
+   sb->s_firstdatazone = firstZone;
+   sb->s_log_zone_size = 0;
+   sb->s_max_size = (7+512+512*512)*BLOCK_SIZE;
+   sb->s_magic = MINIX_SUPER_MAGIC2;  // 30 character names
+   sb->s_state = MINIX_VALID_FS;
+
+   // maps: bit 0 is reserved, bit n of the zone map is zone firstZone+n-1
+   imap = image+2*BLOCK_SIZE;
+   zmap = imap+imapBlocks*BLOCK_SIZE;
+   for(i=numInodes+1 ; i<imapBlocks*BITS_PER_BLOCK ; i++) setBit(imap, i);
+   for(i=numZones+1 ; i<zmapBlocks*BITS_PER_BLOCK ; i++) setBit(zmap, i);
+   setBit(imap, 0);
+   setBit(imap, MINIX_ROOT_INO);
+   setBit(zmap, 0);
+   setBit(zmap, 1);  // root directory table
+
+   // root directory
+   root = (struct minix_inode *)(zmap+zmapBlocks*BLOCK_SIZE);
+   root->i_mode = S_IFDIR|0755;
+   root->i_uid = getuid();
+   root->i_gid = getgid();
+   root->i_size = 2*sizeof(struct dentry);
+   root->i_time = time(NULL);
+   root->i_nlinks = 2;
+   root->i_zone[0] = firstZone;
+   table = (struct dentry *)(image+firstZone*BLOCK_SIZE);
+   table[0].ino = MINIX_ROOT_INO;
+   strcpy(table[0].name, ".");
+   table[1].ino = MINIX_ROOT_INO;
+   strcpy(table[1].name, "..");
+
+   fd = open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd == -1 || write(fd, image, metaBlocks*BLOCK_SIZE) != metaBlocks*BLOCK_SIZE ||
+      ftruncate(fd, (off_t)numBlocks*BLOCK_SIZE) == -1 || close(fd) == -1)
+   {
+      perror(argv[optind]);
+      return(ERR1);
+   }
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: setBit
+
+Parameters: unsigned char *map - bit map
+            int n - bit to set
+------------------------------------------------------------------*/
+void setBit(unsigned char *map, int n)
+{
+   map[n/8] |= 1 << (n%8);
+}
@@ -0,0 +1,1251 @@
+/*-----------------------------------------------------------------
+File: copy.c
+Description: This file contains code for copying the contents of
+             files from the FAT file system to the Minix file system.
+
+	     The directory walk (fat2minix.c) creates the inodes and
+	     allocates the data blocks of each file, then submits a copy
+	     job with submitCopyJob.  Without workers the job is done
+	     at once.  With workers (fat2minix -j N) the jobs are queued
+	     and N threads read the clusters and write the data blocks
+	     with positional I/O, so the walk goes on while the data is
+	     copied.  All allocation is done by the walk, in the same
+	     order for any number of workers, so the Minix file system
+	     produced does not depend on the number of workers.
+
+	     With the pipeline (fat2minix -p DEPTH) the jobs are done
+	     by two threads instead: a reader that reads the clusters of
+	     the files into a pool of DEPTH buffers, and a writer that
+	     writes them to the data blocks.  The buffers go from the
+	     reader to the writer and back through two lock-free
+	     single-producer/single-consumer rings, so the reads of a
+	     file overlap the writes of the previous one.
+
+	     With io_uring (fat2minix -u DEPTH) the jobs are done by the
+	     walk itself, without waiting: the reads of the clusters into
+	     DEPTH registered buffers and the writes of the data blocks
+	     are queued as linked operations, so many reads and writes
+	     are in flight at once from a single thread.  If io_uring is
+	     not available, the jobs are done synchronously as without
+	     workers.
+
+	     With the two-phase copy (fat2minix -t) nothing is copied
+	     during the walk: the jobs are kept, and when the walk is
+	     done (finishCopyJobs) each run of contiguous clusters of
+	     each file becomes a piece, and the pieces are copied in the
+	     order of their clusters, in any of the above ways, so that
+	     the FAT file system is read once from start to end.
+
+	     With fat2minix -c, the files copied synchronously or by the
+	     workers are copied by the kernel (copy_file_range), each
+	     run of clusters stored in consecutive data blocks with a
+	     single call, so the data does not go through the buffers.
+------------------------------------------------------------------*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // copy_file_range
+#endif
+#include "copy.h"
+#include "dio.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Global data - initialised by startCopyWorkers
+struct copyOptions copyOpts;  // how the files are copied
+int copyBufferClusters;  // size of a read buffer in clusters
+char *copyBuffer = NULL;  // read buffer used without workers
+int numWorkers = 0;  // number of worker threads (0 - no workers)
+pthread_t *workers;  // the worker threads
+// The queue of jobs waiting for a worker
+COPYJOB *queueHead = NULL;
+COPYJOB *queueTail = NULL;
+int queueLength = 0;
+int queueClosed = FALSE;  // set by finishCopyJobs - no more jobs
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queueNotFull = PTHREAD_COND_INITIALIZER;
+// The pipeline (ringDepth is 0 without the pipeline)
+int ringDepth = 0;  // number of buffers in the pipeline
+struct copyBuffer *ringBuffers;  // the pool of buffers
+struct copyRing fullRing;  // buffers with data, reader to writer
+struct copyRing freeRing;  // empty buffers, writer to reader
+long readerStalls = 0;  // times the reader waited for an empty buffer
+long writerStalls = 0;  // times the writer waited for data
+// The io_uring backend (uringDepth is 0 when not used)
+int uringDepth = 0;  // number of registered buffers
+struct uring copyUring;
+struct uringBuffer *uringBuffers;
+int *uringFree;  // indexes of the free buffers
+int numUringFree;
+long uringReads = 0, uringWrites = 0, uringWaits = 0;  // counters
+// The two-phase copy
+struct copyPiece *pieces;  // pieces of the files to copy
+int numPieces = 0, maxPieces = 0;
+int numPlanned = 0;  // number of files to copy
+pthread_mutex_t pieceLock = PTHREAD_MUTEX_INITIALIZER;  // pieces ended by workers
+_Atomic long zeroBlocks = 0;  // blocks of zeros left as holes
+_Atomic int copyErrors = 0;  // files not copied completely
+// copy_file_range
+_Atomic int copyRange = FALSE;  // TRUE while the kernel copies the files (cleared by any worker)
+_Atomic long rangeBlocks = 0;  // blocks copied by the kernel
+
+//*************** Prototypes of local functions **********************
+void *copyWorker(void *);
+void dispatchCopyJob(COPYJOB *);
+COPYJOB *nextCopyJob(void);
+void endCopyJob(COPYJOB *, int);
+void freeCopyJob(COPYJOB *);
+int writeFileBlocks(int, int, unsigned short *, char *);
+int isZeroBlock(char *);
+int copyBlockRange(int, int, int, unsigned short *);
+// Functions for the pipeline
+int startCopyPipeline(int);
+void *pipelineReader(void *);
+void *pipelineWriter(void *);
+void readCopyJob(COPYJOB *);
+void ringPut(struct copyRing *, struct copyBuffer *);
+struct copyBuffer *ringTake(struct copyRing *, long *);
+// Functions for io_uring
+int startCopyUring(int);
+void finishCopyUring(void);
+void uringCopyJob(COPYJOB *);
+struct uringBuffer *getUringBuffer(void);
+void reapUring(int);
+// Functions for the two-phase copy
+void planCopyJob(COPYJOB *);
+void runCopyPlan(void);
+int comparePieces(const void *, const void *);
+COPYJOB *newCopyPiece(COPYJOB *, int);
+void endCopyPiece(COPYJOB *, int, int, int);
+
+/*-----------------------------------------------------------------
+Function: startCopyWorkers
+
+Parameters: struct copyOptions *opts - how to copy:
+              numThreads - number of worker threads (0 to copy the files
+                           during the directory walk)
+              ringDepth - number of buffers of the pipeline (0 for no
+	                  pipeline, otherwise the workers are not used)
+              uringDepth - number of buffers for io_uring (0 for no
+	                   io_uring, otherwise the pipeline and the
+			   workers are not used)
+              bufferSize - size of a read buffer in bytes (0 for
+	                   MAX_READ_SIZE), rounded to whole clusters
+              twoPhase - TRUE to copy once the walk is done
+              copyRange - TRUE to copy with copy_file_range
+
+Returns: OK - workers started
+         ERR1 - no buffer or no thread could be created.
+
+Description: Sizes the read buffers from the cluster size (the FAT
+             boot sector must have been read) and starts io_uring, the
+	     workers or the pipeline.  If only some workers could be
+	     created, the others are not used.  If io_uring cannot be
+	     used, the files are copied without workers.
+	     copy_file_range is not used with io_uring or the pipeline,
+	     with a mapped or streamed file system, or with O_DIRECT.
+-----------------------------------------------------------------*/
+int startCopyWorkers(struct copyOptions *opts)
+{
+   int i;
+   int n = opts->numThreads;
+   copyOpts = *opts;
+   if(copyOpts.copyRange)
+   {
+      if(copyOpts.uringDepth > 0 || copyOpts.ringDepth > 0 || fatMap != NULL ||
+         minixMap != NULL || fatStream || ioAlign != 0)
+         logPrintf(LOG_INFO, "copy_file_range not used with these options\n");
+      else copyRange = TRUE;
+   }
+   if(copyOpts.bufferSize <= 0) copyOpts.bufferSize = MAX_READ_SIZE;
+   copyBufferClusters = copyOpts.bufferSize/CLUSTER_SIZE;
+   if(copyBufferClusters == 0) copyBufferClusters = 1;
+   if(copyOpts.uringDepth > 0)
+   {
+      if(startCopyUring(copyOpts.uringDepth) == OK) return(OK);
+      logPrintf(LOG_INFO, "io_uring not used - copying files synchronously\n");
+      n = 0;
+   }
+   else if(copyOpts.ringDepth > 0) return(startCopyPipeline(copyOpts.ringDepth));
+   if(n <= 0)
+   {
+      copyBuffer = allocIOBuffer(copyBufferClusters*CLUSTER_SIZE);
+      if(copyBuffer == NULL) { perror("startCopyWorkers"); return(ERR1); }
+      return(OK);
+   }
+   workers = malloc(n*sizeof(pthread_t));
+   if(workers == NULL) { perror("startCopyWorkers"); return(ERR1); }
+   for(i=0 ; i<n ; i++)
+   {
+      errno = pthread_create(workers+i, NULL, copyWorker, NULL);
+      if(errno != 0) { perror("startCopyWorkers"); break; }
+   }
+   numWorkers = i;
+   if(numWorkers == 0) { free(workers); return(ERR1); }
+   logPrintf(LOG_INFO, "Copying files with %d worker threads\n", numWorkers);
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: submitCopyJob
+
+Parameters: COPYJOB *job - file to copy (freed when done)
+
+Description: Keeps the job for the two-phase copy, otherwise passes
+             it on (dispatchCopyJob).
+-----------------------------------------------------------------*/
+void submitCopyJob(COPYJOB *job)
+{
+   job->parent = NULL;
+   job->offset = 0;
+   if(copyOpts.twoPhase) planCopyJob(job);
+   else dispatchCopyJob(job);
+}
+
+/*-----------------------------------------------------------------
+Function: dispatchCopyJob
+
+Parameters: COPYJOB *job - file (or piece of file) to copy
+
+Description: Copies the file at once when there are no workers,
+             otherwise adds the job to the queue, waiting while
+	     the queue is full.  With io_uring the operations of the
+	     job are queued (see uringCopyJob).
+-----------------------------------------------------------------*/
+void dispatchCopyJob(COPYJOB *job)
+{
+   if(uringDepth > 0)
+   {
+      uringCopyJob(job);
+      return;
+   }
+   if(numWorkers == 0)
+   {
+      endCopyJob(job, copyFileBlocks(job, copyBuffer));
+      return;
+   }
+   job->next = NULL;
+   pthread_mutex_lock(&queueLock);
+   while(queueLength >= COPYQUEUESIZE) pthread_cond_wait(&queueNotFull, &queueLock);
+   if(queueTail == NULL) queueHead = job;
+   else queueTail->next = job;
+   queueTail = job;
+   queueLength++;
+   pthread_cond_signal(&queueNotEmpty);
+   pthread_mutex_unlock(&queueLock);
+}
+
+/*-----------------------------------------------------------------
+Function: finishCopyJobs
+
+Returns: OK - all files copied
+         ERR1 - some files could not be copied completely.
+
+Description: Copies the files kept for the two-phase copy, waits until
+             all submitted files are copied and stops the workers.
+	     Must be called before the Minix file system is closed.
+-----------------------------------------------------------------*/
+int finishCopyJobs()
+{
+   int i;
+   if(copyOpts.twoPhase) runCopyPlan();
+   if(uringDepth > 0) finishCopyUring();
+   else if(numWorkers == 0)  // no threads
+   {
+      free(copyBuffer);
+      copyBuffer = NULL;
+   }
+   else
+   {
+      pthread_mutex_lock(&queueLock);
+      queueClosed = TRUE;
+      pthread_cond_broadcast(&queueNotEmpty);
+      pthread_mutex_unlock(&queueLock);
+      for(i=0 ; i<numWorkers ; i++) pthread_join(workers[i], NULL);
+      free(workers);
+      numWorkers = 0;
+   }
+   if(ringDepth > 0)
+   {
+      logPrintf(LOG_INFO, "Pipeline: ring depth %d, buffer size %d bytes, reader stalls %ld (%ld blocked), writer stalls %ld (%ld blocked)\n",
+             ringDepth, copyBufferClusters*CLUSTER_SIZE, readerStalls, freeRing.blocked,
+             writerStalls, fullRing.blocked);
+      for(i=0 ; i<ringDepth ; i++) free(ringBuffers[i].buffer);
+      free(ringBuffers);
+      free(fullRing.slots);
+      free(freeRing.slots);
+      pthread_mutex_destroy(&fullRing.lock);
+      pthread_mutex_destroy(&freeRing.lock);
+      pthread_cond_destroy(&fullRing.notEmpty);
+      pthread_cond_destroy(&freeRing.notEmpty);
+      ringDepth = 0;
+   }
+   if(zeroBlocks > 0)
+      logPrintf(LOG_INFO, "%ld blocks of zeros not written (holes in the Minix file system)\n", (long)zeroBlocks);
+   if(rangeBlocks > 0)
+      logPrintf(LOG_INFO, "%ld blocks copied by the kernel (copy_file_range)\n", (long)rangeBlocks);
+   if(copyErrors > 0)
+   {
+      logPrintf(LOG_ERROR, "%d files not copied completely\n", (int)copyErrors);
+      return(ERR1);
+   }
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: copyWorker
+
+Parameters: void *arg - not used
+
+Description: Worker thread: takes jobs from the queue and copies them
+             with its own read buffer until the queue is closed and
+	     empty.
+-----------------------------------------------------------------*/
+void *copyWorker(void *arg)
+{
+   COPYJOB *job;
+   char *buffer = allocIOBuffer(copyBufferClusters*CLUSTER_SIZE);
+   if(buffer == NULL) perror("copyWorker");  // the other workers do the jobs
+   else while((job = nextCopyJob()) != NULL)
+      endCopyJob(job, copyFileBlocks(job, buffer));
+   free(buffer);
+   flushDataBlocks();  // blocks held by this thread
+   return(NULL);
+}
+
+/*-----------------------------------------------------------------
+Function: nextCopyJob
+
+Returns: the next job of the queue, or NULL when the queue is closed
+         and empty.
+
+Description: Takes a job from the queue, waiting while the queue is
+             empty.
+-----------------------------------------------------------------*/
+COPYJOB *nextCopyJob()
+{
+   COPYJOB *job;
+   pthread_mutex_lock(&queueLock);
+   while(queueHead == NULL && !queueClosed) pthread_cond_wait(&queueNotEmpty, &queueLock);
+   job = queueHead;
+   if(job != NULL)
+   {
+      queueHead = job->next;
+      if(queueHead == NULL) queueTail = NULL;
+      queueLength--;
+      pthread_cond_signal(&queueNotFull);
+   }
+   pthread_mutex_unlock(&queueLock);
+   return(job);
+}
+
+/*-----------------------------------------------------------------
+Function: copyFileBlocks
+
+Parameters: COPYJOB *job - file to copy
+            char *buffer - read buffer of copyBufferClusters clusters
+
+Returns: number of blocks copied
+
+Description: Copies the contents of a file.  Each run of contiguous
+             clusters is read with readFatClusters (up to MAX_READ_SIZE
+	     at a time), and the blocks are then stored with
+	     writeFileBlocks.  When the FAT image is mapped, the blocks
+	     are taken directly from the mapping and buffer is not used.
+	     With copy_file_range, each run is copied at once by
+	     copyBlockRange; if the kernel cannot copy between the
+	     file systems, the run is copied again through buffer, and
+	     so are the following ones.
+-----------------------------------------------------------------*/
+int copyFileBlocks(COPYJOB *job, char *buffer)
+{
+   FATEXTENTS *ext = job->ext;
+   int numBlocks = job->numBlocks;
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   struct fatExtent *run;  // current run of clusters
+   char *data;  // contents of the clusters read
+   int i = 0;  // number of blocks stored
+   int e, c;  // for counting runs and clusters
+   int n;  // number of clusters to read
+   int b;  // number of blocks to store
+
+   TRACE_BEGIN("copyFileBlocks", NULL);
+   for(e=0 ; e<ext->numExtents && i<numBlocks ; e++)
+   {
+      run = ext->extents+e;
+      for(c=0 ; c<run->length && i<numBlocks ; c+=n)
+      {
+         // read no more than the buffer, the run and the rest of the file
+         n = run->length - c;
+         if(n > copyBufferClusters && !copyRange) n = copyBufferClusters;
+         if(n > (numBlocks-i+mult-1)/mult) n = (numBlocks-i+mult-1)/mult;
+         b = n*mult;
+         if(b > numBlocks-i) b = numBlocks-i;
+         if(copyRange)
+         {
+            if(copyBlockRange(run->start+c, i, b, job->zones) == OK) { i += b; continue; }
+            if(copyRange)  // error in copying
+            {
+               e = ext->numExtents;  // to break the loops
+               break;
+            }
+            n = 0;  // not supported: the run is read into the buffer
+            continue;
+         }
+         data = readFatClusters(run->start+c, n, buffer);
+         if(data == NULL)
+         {
+            fprintf(stderr,"Could not read clusters %d-%d from FAT file\n",
+	            run->start+c, run->start+c+n-1);
+            e = ext->numExtents;  // to break the loops
+            break;
+         }
+         if(writeFileBlocks(i, b, job->zones, data) == ERR1)
+         {
+            e = ext->numExtents;  // to break the loops
+            break;
+         }
+         i += b;
+      }
+   }
+   TRACE_END("copyFileBlocks");
+   return(i);
+}
+
+/*-----------------------------------------------------------------
+Function: writeFileBlocks
+
+Parameters:  int i - logical block number in the file of the first block
+             int n - number of blocks
+             unsigned short *zones - data block of each block of the file
+	     char *data - contents of the n blocks
+
+Returns:  OK - blocks stored
+          ERR1 - error in writing
+
+Description: Writes blocks i to i+n-1 of a file into the data blocks
+             allocated by allocFileBlocks.  Blocks stored in
+	     consecutive data blocks are written with a single call to
+	     writeDataBlocks.  Blocks of zeros are not written: their
+	     data blocks are made holes (zeroDataBlocks), so that mostly
+	     empty files cost neither writes nor space in the image.
+-----------------------------------------------------------------*/
+int writeFileBlocks(int i, int n, unsigned short *zones, char *data)
+{
+   int len;  // run of consecutive data blocks
+   int b = 0;  // blocks written
+   int zero;  // TRUE for a run of blocks of zeros
+   int retcd = OK;
+   TRACE_BEGIN("writeFileBlocks", NULL);
+   while(b < n && retcd == OK)
+   {
+      zero = isZeroBlock(data+b*BLOCK_SIZE);
+      for(len=1 ; b+len < n ; len++)
+         if(zones[i+b+len] != zones[i+b]+len ||
+            isZeroBlock(data+(b+len)*BLOCK_SIZE) != zero) break;
+      if(zero)
+      {
+         retcd = zeroDataBlocks(zones[i+b], len);
+         zeroBlocks += len;
+      }
+      else retcd = writeDataBlocks(zones[i+b], data+b*BLOCK_SIZE, len);
+      b += len;
+   }
+   TRACE_END("writeFileBlocks");
+   return(retcd);
+}
+
+/*-----------------------------------------------------------------
+Function: copyBlockRange
+
+Parameters:  int clusterNum - first cluster of a run of contiguous clusters
+             int i - logical block number in the file of its first block
+             int n - number of blocks of the run to copy
+             unsigned short *zones - data block of each block of the file
+
+Returns:  OK - blocks copied
+          ERR1 - error in copying, or copy_file_range cannot copy
+	         between the file systems (copyRange is then FALSE)
+
+Description: Copies the blocks of the run with copy_file_range, a call
+             for each run of consecutive data blocks: the data is
+	     copied by the kernel (or shared, when the file systems
+	     can share extents) without going through user space.
+	     Blocks of zeros are copied like the others.
+-----------------------------------------------------------------*/
+int copyBlockRange(int clusterNum, int i, int n, unsigned short *zones)
+{
+   loff_t in = DATA_POS + (off_t)(clusterNum-2)*CLUSTER_SIZE;  // FAT position
+   loff_t out;  // Minix position
+   int len;  // run of consecutive data blocks
+   int b = 0;  // blocks copied
+   size_t left;  // bytes of the run still to copy
+   ssize_t done;
+   while(b < n)
+   {
+      for(len=1 ; b+len < n ; len++)
+         if(zones[i+b+len] != zones[i+b]+len) break;
+      out = (off_t)zones[i+b]*BLOCK_SIZE;
+      for(left=len*BLOCK_SIZE ; left > 0 ; left -= done)
+      {
+         TRACE_BEGIN("copy_file_range", NULL);
+         done = copy_file_range(fatfd, &in, minixfd, &out, left, 0);
+         TRACE_END("copy_file_range");
+         countIO(&stats.minix, 1, 0, done > 0 ? done : 0);
+         countIO(&stats.fat, 0, done > 0 ? done : 0, 0);
+         if(done > 0) continue;
+         if(done == 0) errno = EIO;  // end of the FAT file system
+         else if(b == 0 && left == len*BLOCK_SIZE &&
+                 (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP ||
+                  errno == ENOSYS || errno == EBADF))
+         {
+            if(atomic_exchange(&copyRange, FALSE))  // the first worker to find out
+               logPrintf(LOG_INFO, "copy_file_range not supported - copying through buffers\n");
+            return(ERR1);
+         }
+         perror("copyBlockRange");
+         return(ERR1);
+      }
+      rangeBlocks += len;
+      b += len;
+   }
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: isZeroBlock
+
+Parameters:  char *block - contents of a block (any alignment)
+
+Returns:  TRUE if the block holds only zeros
+
+Description: Checks 64 bytes per step, with SSE2 when the compiler
+             targets it, otherwise 8 bytes at a time.  A block that is
+	     not empty is usually rejected by the first step.
+-----------------------------------------------------------------*/
+int isZeroBlock(char *block)
+{
+   int i;
+#ifdef __SSE2__
+   __m128i acc;
+   for(i=0 ; i<BLOCK_SIZE ; i+=64)
+   {
+      acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((__m128i *)(block+i)),
+                                      _mm_loadu_si128((__m128i *)(block+i+16))),
+                         _mm_or_si128(_mm_loadu_si128((__m128i *)(block+i+32)),
+                                      _mm_loadu_si128((__m128i *)(block+i+48))));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+         return(FALSE);
+   }
+#else
+   uint64_t w[8];
+   for(i=0 ; i<BLOCK_SIZE ; i+=64)
+   {
+      memcpy(w, block+i, 64);  // no alignment needed
+      if((w[0]|w[1]|w[2]|w[3]|w[4]|w[5]|w[6]|w[7]) != 0) return(FALSE);
+   }
+#endif
+   return(TRUE);
+}
+
+/*-----------------------------------------------------------------
+Function: endCopyJob
+
+Parameters: COPYJOB *job - job done
+            int copied - number of blocks copied
+
+Description: If the file could not be copied completely, its size is
+             reduced to the blocks copied and the error is counted
+	     (see finishCopyJobs).  The job is freed.
+	     For a piece of a file, the blocks copied are counted for
+	     the file, which is ended with its last piece.
+-----------------------------------------------------------------*/
+void endCopyJob(COPYJOB *job, int copied)
+{
+   struct minix_inode ino;
+   if(job->parent != NULL)
+   {
+      endCopyPiece(job->parent, job->offset, job->numBlocks, copied);
+      freeCopyJob(job);
+      return;
+   }
+   if(copied < job->numBlocks) copyErrors++;
+   if(copied < job->numBlocks && readInode(job->inodeNum, &ino) == OK &&
+      copied*BLOCK_SIZE < ino.i_size)
+   {
+      ino.i_size = copied*BLOCK_SIZE;  // only part of the file copied
+      saveInode(job->inodeNum, &ino);
+   }
+   freeCopyJob(job);
+}
+
+/*-----------------------------------------------------------------
+Function: freeCopyJob
+
+Parameters: COPYJOB *job - job done
+
+Description: Frees a job and the extent index of its file.
+-----------------------------------------------------------------*/
+void freeCopyJob(COPYJOB *job)
+{
+   freeFatExtents(job->ext);
+   free(job);
+}
+
+//************************************************************
+// The reader/writer pipeline
+//************************************************************
+
+/*-----------------------------------------------------------------
+Function: startCopyPipeline
+
+Parameters: int depth - number of buffers (rounded up to a power of 2)
+
+Returns: OK - pipeline started
+         ERR1 - no memory or the threads could not be created.
+
+Description: Allocates the pool of buffers, puts them all in the ring
+             of empty buffers and starts the reader and the writer.
+	     Both threads are kept in workers, so that finishCopyJobs
+	     closes the queue and waits for them.
+-----------------------------------------------------------------*/
+int startCopyPipeline(int depth)
+{
+   int i;
+   if(depth > MAXRINGDEPTH) depth = MAXRINGDEPTH;
+   for(ringDepth=1 ; ringDepth<depth ; ringDepth*=2) ;
+   ringBuffers = calloc(ringDepth, sizeof(struct copyBuffer));
+   fullRing.slots = malloc(ringDepth*sizeof(struct copyBuffer *));
+   freeRing.slots = malloc(ringDepth*sizeof(struct copyBuffer *));
+   workers = malloc(2*sizeof(pthread_t));
+   if(ringBuffers == NULL || fullRing.slots == NULL || freeRing.slots == NULL ||
+      workers == NULL)
+   {
+      perror("startCopyPipeline");
+      return(ERR1);
+   }
+   fullRing.size = freeRing.size = ringDepth;
+   pthread_mutex_init(&fullRing.lock, NULL);
+   pthread_mutex_init(&freeRing.lock, NULL);
+   pthread_cond_init(&fullRing.notEmpty, NULL);
+   pthread_cond_init(&freeRing.notEmpty, NULL);
+   for(i=0 ; i<ringDepth ; i++)
+   {
+      ringBuffers[i].buffer = allocIOBuffer(copyBufferClusters*CLUSTER_SIZE);
+      if(ringBuffers[i].buffer == NULL) { perror("startCopyPipeline"); return(ERR1); }
+      ringPut(&freeRing, ringBuffers+i);
+   }
+   errno = pthread_create(workers, NULL, pipelineWriter, NULL);
+   if(errno == 0)
+   {
+      errno = pthread_create(workers+1, NULL, pipelineReader, NULL);
+      if(errno != 0)  // stop the writer
+      {
+         ringPut(&fullRing, ringTake(&freeRing, &readerStalls));  // no job: end
+         pthread_join(workers[0], NULL);
+      }
+   }
+   if(errno != 0) { perror("startCopyPipeline"); return(ERR1); }
+   numWorkers = 2;
+   logPrintf(LOG_INFO, "Copying files with a pipeline of %d buffers of %d bytes\n",
+          ringDepth, copyBufferClusters*CLUSTER_SIZE);
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: pipelineReader
+
+Parameters: void *arg - not used
+
+Description: Reader thread: reads the files of the queue into empty
+             buffers and passes them to the writer.  A buffer without
+	     job tells the writer that all files are read.
+-----------------------------------------------------------------*/
+void *pipelineReader(void *arg)
+{
+   struct copyBuffer *buf;
+   COPYJOB *job;
+   while((job = nextCopyJob()) != NULL) readCopyJob(job);
+   buf = ringTake(&freeRing, &readerStalls);
+   buf->job = NULL;  // the end
+   ringPut(&fullRing, buf);
+   return(NULL);
+}
+
+/*-----------------------------------------------------------------
+Function: readCopyJob
+
+Parameters: COPYJOB *job - file to read
+
+Description: Reads the clusters of a file in runs of contiguous
+             clusters (as copyFileBlocks), one buffer at a time.  The
+	     last buffer of the file is marked; if the file could not be
+	     read completely, an empty last buffer is sent after the
+	     blocks read.
+-----------------------------------------------------------------*/
+void readCopyJob(COPYJOB *job)
+{
+   FATEXTENTS *ext = job->ext;
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   struct fatExtent *run;  // current run of clusters
+   struct copyBuffer *buf = NULL;  // last buffer sent
+   int i = 0;  // number of blocks read
+   int e, c;  // for counting runs and clusters
+   int n;  // number of clusters to read
+
+   job->blocksCopied = 0;
+   for(e=0 ; e<ext->numExtents && i<job->numBlocks ; e++)
+   {
+      run = ext->extents+e;
+      for(c=0 ; c<run->length && i<job->numBlocks ; c+=n)
+      {
+         n = run->length - c;
+         if(n > copyBufferClusters) n = copyBufferClusters;
+         if(n > (job->numBlocks-i+mult-1)/mult) n = (job->numBlocks-i+mult-1)/mult;
+         buf = ringTake(&freeRing, &readerStalls);
+         buf->job = job;
+         buf->block = i;
+         buf->data = readFatClusters(run->start+c, n, buf->buffer);
+         if(buf->data == NULL)
+         {
+            fprintf(stderr,"Could not read clusters %d-%d from FAT file\n",
+	            run->start+c, run->start+c+n-1);
+            buf->numBlocks = 0;
+            buf->lastOfJob = TRUE;
+            ringPut(&fullRing, buf);
+            return;
+         }
+         buf->numBlocks = n*mult;
+         if(buf->numBlocks > job->numBlocks-i) buf->numBlocks = job->numBlocks-i;
+         i += buf->numBlocks;
+         buf->lastOfJob = (i == job->numBlocks);
+         ringPut(&fullRing, buf);
+      }
+   }
+   if(i < job->numBlocks || buf == NULL)  // clusters missing or nothing to copy
+   {
+      buf = ringTake(&freeRing, &readerStalls);
+      buf->job = job;
+      buf->block = i;
+      buf->numBlocks = 0;
+      buf->lastOfJob = TRUE;
+      ringPut(&fullRing, buf);
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: pipelineWriter
+
+Parameters: void *arg - not used
+
+Description: Writer thread: writes the buffers passed by the reader
+             and gives them back empty.  The blocks of a file arrive
+	     in order, so the blocks copied are counted until the first
+	     error.  The job is ended with its last buffer.
+-----------------------------------------------------------------*/
+void *pipelineWriter(void *arg)
+{
+   struct copyBuffer *buf;
+   COPYJOB *job;
+   while((job = (buf = ringTake(&fullRing, &writerStalls))->job) != NULL)
+   {
+      if(buf->numBlocks > 0 && job->blocksCopied == buf->block &&
+         writeFileBlocks(buf->block, buf->numBlocks, job->zones, buf->data) == OK)
+         job->blocksCopied += buf->numBlocks;
+      if(buf->lastOfJob) endCopyJob(job, job->blocksCopied);
+      ringPut(&freeRing, buf);
+   }
+   flushDataBlocks();  // blocks held by this thread
+   return(NULL);
+}
+
+/*-----------------------------------------------------------------
+Function: ringPut
+
+Parameters: struct copyRing *ring - ring (this thread is its producer)
+            struct copyBuffer *buf - buffer to add
+
+Description: Adds a buffer to a ring.  A ring has a slot for every
+             buffer of the pool, so it is never full.  If the consumer
+	     blocks on the ring, it is woken up.
+-----------------------------------------------------------------*/
+void ringPut(struct copyRing *ring, struct copyBuffer *buf)
+{
+   unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   ring->slots[tail&(ring->size-1)] = buf;
+   atomic_store(&ring->tail, tail+1);  // publish the slot (ordered before sleeping is read)
+   if(atomic_load(&ring->sleeping))
+   {
+      pthread_mutex_lock(&ring->lock);
+      pthread_cond_signal(&ring->notEmpty);
+      pthread_mutex_unlock(&ring->lock);
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: ringTake
+
+Parameters: struct copyRing *ring - ring (this thread is its consumer)
+            long *stalls - counter of the times the ring was empty
+
+Returns: the oldest buffer of the ring
+
+Description: Takes a buffer from a ring.  While the ring is empty, the
+             processor is yielded RINGSPINS times, then the thread
+	     blocks until ringPut wakes it (counted in ring->blocked),
+	     so that a thread with nothing to do does not use a core
+	     (the writer waits for the whole walk with fat2minix -t).
+-----------------------------------------------------------------*/
+struct copyBuffer *ringTake(struct copyRing *ring, long *stalls)
+{
+   struct copyBuffer *buf;
+   unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   int spins;
+   if(head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+   {
+      (*stalls)++;
+      for(spins=0 ; spins<RINGSPINS && head == atomic_load_explicit(&ring->tail, memory_order_acquire) ; spins++)
+         sched_yield();
+      if(head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+      {
+         ring->blocked++;
+         pthread_mutex_lock(&ring->lock);
+         atomic_store(&ring->sleeping, TRUE);  // ordered before tail is read again
+         while(head == atomic_load(&ring->tail)) pthread_cond_wait(&ring->notEmpty, &ring->lock);
+         atomic_store(&ring->sleeping, FALSE);
+         pthread_mutex_unlock(&ring->lock);
+      }
+   }
+   buf = ring->slots[head&(ring->size-1)];
+   atomic_store_explicit(&ring->head, head+1, memory_order_release);  // free the slot
+   return(buf);
+}
+
+//************************************************************
+// The io_uring backend
+//************************************************************
+
+/*-----------------------------------------------------------------
+Function: startCopyUring
+
+Parameters: int depth - number of buffers
+
+Returns: OK - io_uring ready
+         ERR1 - io_uring not available or not usable.
+
+Description: Sets up io_uring with both file systems registered (the
+             FAT file system is file 0 and the Minix file system file
+	     1) and the pool of buffers registered.  Mapped file
+	     systems are copied to and from the mapping instead.
+-----------------------------------------------------------------*/
+int startCopyUring(int depth)
+{
+   struct iovec *iov;
+   int fds[2];
+   unsigned entries;
+   int i;
+
+   if(fatMap != NULL || minixMap != NULL)
+   {
+      logPrintf(LOG_INFO, "io_uring is not used with mapped file systems\n");
+      return(ERR1);
+   }
+   if(fatStream)
+   {
+      logPrintf(LOG_INFO, "io_uring is not used when the FAT file system is streamed\n");
+      return(ERR1);
+   }
+   if(ioAlign != 0 && ((DATA_POS | CLUSTER_SIZE | BLOCK_SIZE) & (ioAlign-1)) != 0)
+   {
+      logPrintf(LOG_INFO, "io_uring is not used: clusters or blocks not aligned for O_DIRECT\n");
+      return(ERR1);
+   }
+   if(depth > MAXRINGDEPTH) depth = MAXRINGDEPTH;
+   // room for the read and the writes of every buffer of a file
+   for(entries=8 ; entries < 2*depth || entries < 2+7+BLOCK_SIZE/2 ; entries*=2) ;
+   if(uringInit(&copyUring, entries) == ERR1) { perror("io_uring"); return(ERR1); }
+   fds[0] = fatfd;
+   fds[1] = minixfd;
+   uringBuffers = calloc(depth, sizeof(struct uringBuffer));
+   uringFree = malloc(depth*sizeof(int));
+   iov = malloc(depth*sizeof(struct iovec));
+   if(uringBuffers == NULL || uringFree == NULL || iov == NULL)
+   {
+      perror("startCopyUring");
+      uringExit(&copyUring);
+      return(ERR1);
+   }
+   for(i=0 ; i<depth ; i++)
+   {
+      iov[i].iov_len = copyBufferClusters*CLUSTER_SIZE;
+      iov[i].iov_base = uringBuffers[i].buffer = allocIOBuffer(iov[i].iov_len);
+      if(iov[i].iov_base == NULL) break;
+      uringFree[i] = i;
+   }
+   if(i < depth || uringRegisterFiles(&copyUring, fds, 2) == ERR1 ||
+      uringRegisterBuffers(&copyUring, iov, depth) == ERR1)
+   {
+      perror("io_uring");
+      while(--i >= 0) free(uringBuffers[i].buffer);
+      free(uringBuffers);
+      free(uringFree);
+      free(iov);
+      uringExit(&copyUring);
+      return(ERR1);
+   }
+   free(iov);  // the kernel keeps its own copy
+   uringDepth = numUringFree = depth;
+   logPrintf(LOG_INFO, "Copying files with io_uring, %d buffers of %d bytes\n",
+          uringDepth, copyBufferClusters*CLUSTER_SIZE);
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: finishCopyUring
+
+Description: Waits for all operations in flight and closes io_uring.
+-----------------------------------------------------------------*/
+void finishCopyUring()
+{
+   int i;
+   while(numUringFree < uringDepth) reapUring(TRUE);
+   logPrintf(LOG_INFO, "io_uring: %d buffers of %d bytes, %ld reads, %ld writes, %ld waits\n",
+          uringDepth, copyBufferClusters*CLUSTER_SIZE, uringReads, uringWrites, uringWaits);
+   uringExit(&copyUring);
+   for(i=0 ; i<uringDepth ; i++) free(uringBuffers[i].buffer);
+   free(uringBuffers);
+   free(uringFree);
+   uringDepth = 0;
+}
+
+/*-----------------------------------------------------------------
+Function: uringCopyJob
+
+Parameters: COPYJOB *job - file to copy
+
+Description: Queues the copy of a file.  For each run of contiguous
+             clusters (as copyFileBlocks, one buffer at a time), the
+	     read of the clusters is linked to the writes of the blocks
+	     to consecutive data blocks, so the kernel starts the
+	     writes when the read is done, and a failed or short read
+	     cancels them.  The operations are submitted at the end of
+	     the file (or when the submission ring is full); the job is
+	     ended by reapUring when all its buffers are done.
+	     The data blocks written are not indirect blocks, so the
+	     indirect block cache of the minix module is not affected.
+-----------------------------------------------------------------*/
+void uringCopyJob(COPYJOB *job)
+{
+   FATEXTENTS *ext = job->ext;
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   struct fatExtent *run;  // current run of clusters
+   struct uringBuffer *buf;
+   struct io_uring_sqe *sqe;
+   int i = 0;  // number of blocks queued
+   int e, c;  // for counting runs and clusters
+   int n;  // number of clusters to read
+   int b;  // number of blocks to write
+   int first, len, runs;  // runs of consecutive data blocks
+
+   job->firstFailed = job->numBlocks;
+   job->pending = 1;  // the job is not ended while it is queued
+   for(e=0 ; e<ext->numExtents && i<job->numBlocks ; e++)
+   {
+      run = ext->extents+e;
+      for(c=0 ; c<run->length && i<job->numBlocks ; c+=n)
+      {
+         n = run->length - c;
+         if(n > copyBufferClusters) n = copyBufferClusters;
+         if(n > (job->numBlocks-i+mult-1)/mult) n = (job->numBlocks-i+mult-1)/mult;
+         b = n*mult;
+         if(b > job->numBlocks-i) b = job->numBlocks-i;
+         for(runs=1, first=1 ; first<b ; first++)  // count the writes
+            if(job->zones[i+first] != job->zones[i+first-1]+1) runs++;
+         buf = getUringBuffer();
+         if(uringSqSpace(&copyUring) < 1+runs)
+         {
+            STAT_ADD(stats.uringSubmits, 1);
+            TRACE_BEGIN("io_uring_enter", NULL);
+            if(uringSubmit(&copyUring, 0) == ERR1) perror("uringCopyJob");
+            TRACE_END("io_uring_enter");
+         }
+         buf->job = job;
+         buf->block = i;
+         buf->pending = 1+runs;
+         buf->failed = FALSE;
+         job->pending++;
+         // read the clusters
+         sqe = uringGetSqe(&copyUring);
+         sqe->opcode = IORING_OP_READ_FIXED;
+         sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+         sqe->fd = 0;  // FAT file system
+         sqe->addr = (unsigned long)buf->buffer;
+         sqe->len = n*CLUSTER_SIZE;
+         sqe->off = DATA_POS + (off_t)(run->start+c-2)*CLUSTER_SIZE;
+         sqe->buf_index = buf-uringBuffers;
+         sqe->user_data = (__u64)sqe->len<<32 | (buf-uringBuffers);
+         uringReads++;
+         countIO(&stats.fat, 0, sqe->len, 0);
+         // write the blocks, one write per run of consecutive data blocks
+         for(first=0 ; first<b ; first+=len)
+         {
+            for(len=1 ; first+len < b ; len++)
+               if(job->zones[i+first+len] != job->zones[i+first]+len) break;
+            sqe = uringGetSqe(&copyUring);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE | (first+len < b ? IOSQE_IO_LINK : 0);
+            sqe->fd = 1;  // Minix file system
+            sqe->addr = (unsigned long)(buf->buffer+first*BLOCK_SIZE);
+            sqe->len = len*BLOCK_SIZE;
+            sqe->off = (off_t)job->zones[i+first]*BLOCK_SIZE;
+            sqe->buf_index = buf-uringBuffers;
+            sqe->user_data = (__u64)sqe->len<<32 | (buf-uringBuffers);
+            uringWrites++;
+            countIO(&stats.minix, 0, 0, sqe->len);
+         }
+         i += b;
+      }
+   }
+   if(i < job->numBlocks) job->firstFailed = i;  // clusters missing
+   STAT_ADD(stats.uringSubmits, 1);
+   TRACE_BEGIN("io_uring_enter", NULL);
+   if(uringSubmit(&copyUring, 0) == ERR1) perror("uringCopyJob");
+   TRACE_END("io_uring_enter");
+   if(--job->pending == 0) endCopyJob(job, job->firstFailed);  // all done already
+}
+
+/*-----------------------------------------------------------------
+Function: getUringBuffer
+
+Returns: a free buffer
+
+Description: Takes a free buffer, waiting for operations to complete
+             while all buffers are in flight.
+-----------------------------------------------------------------*/
+struct uringBuffer *getUringBuffer()
+{
+   if(numUringFree == 0) uringWaits++;
+   while(numUringFree == 0) reapUring(TRUE);
+   return(uringBuffers+uringFree[--numUringFree]);
+}
+
+/*-----------------------------------------------------------------
+Function: reapUring
+
+Parameters: int wait - TRUE to wait for at least one completion
+
+Description: Handles the completed operations.  The result of each
+             operation is checked against its length (kept in the
+	     upper half of user_data); a buffer is free when all its
+	     operations are complete, and a job ends with its last
+	     buffer.  The blocks of a failed buffer and the blocks after
+	     them are not counted as copied.
+-----------------------------------------------------------------*/
+void reapUring(int wait)
+{
+   struct io_uring_cqe *cqe;
+   struct uringBuffer *buf;
+   COPYJOB *job;
+   int n;  // result of the submission
+   if(wait && uringPeekCqe(&copyUring) == NULL)
+   {
+      STAT_ADD(stats.uringSubmits, 1);
+      TRACE_BEGIN("io_uring_enter (wait)", NULL);
+      n = uringSubmit(&copyUring, 1);
+      TRACE_END("io_uring_enter (wait)");
+      if(n == ERR1)
+      {
+         perror("reapUring");
+         return;
+      }
+   }
+   while((cqe = uringPeekCqe(&copyUring)) != NULL)
+   {
+      buf = uringBuffers + (cqe->user_data & 0xffffffff);
+      if(cqe->res != (int)(cqe->user_data>>32))
+      {
+         if(cqe->res != -ECANCELED)  // cancelled after a failure
+            fprintf(stderr,"io_uring operation failed: %s\n",
+                    cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+         buf->failed = TRUE;
+      }
+      uringCqeSeen(&copyUring);
+      if(--buf->pending > 0) continue;
+      job = buf->job;
+      if(buf->failed && buf->block < job->firstFailed) job->firstFailed = buf->block;
+      buf->job = NULL;
+      uringFree[numUringFree++] = buf-uringBuffers;
+      if(--job->pending == 0) endCopyJob(job, job->firstFailed);
+   }
+}
+
+//************************************************************
+// The two-phase copy
+//************************************************************
+
+/*-----------------------------------------------------------------
+Function: planCopyJob
+
+Parameters: COPYJOB *job - file to copy
+
+Description: Adds a piece for each run of contiguous clusters of the
+             file that holds blocks to copy.  The file is ended with
+	     its last piece (see endCopyJob); a file without pieces is
+	     ended at once.
+-----------------------------------------------------------------*/
+void planCopyJob(COPYJOB *job)
+{
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   struct copyPiece *more;
+   int e;
+
+   job->firstFailed = job->numBlocks;
+   job->pending = 0;
+   for(e=0 ; e<job->ext->numExtents && job->ext->extents[e].logical*mult < job->numBlocks ; e++)
+   {
+      if(numPieces == maxPieces)
+      {
+         more = realloc(pieces, (maxPieces+1024)*sizeof(struct copyPiece));
+         if(more == NULL) { perror("planCopyJob"); break; }
+         pieces = more;
+         maxPieces += 1024;
+      }
+      pieces[numPieces].job = job;
+      pieces[numPieces].extent = e;
+      numPieces++;
+      job->pending++;
+   }
+   if(e == 0) endCopyJob(job, 0);  // nothing to copy
+   else
+   {
+      e--;  // the last run planned
+      if((job->ext->extents[e].logical+job->ext->extents[e].length)*mult < job->numBlocks)
+         job->firstFailed = (job->ext->extents[e].logical+job->ext->extents[e].length)*mult;
+      numPlanned++;
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: runCopyPlan
+
+Description: The data pass of the two-phase copy: sorts the pieces
+             by cluster and copies them in that order.  When the FAT
+	     image is streamed, only the clusters of the pieces are
+	     kept from the stream from now on.
+-----------------------------------------------------------------*/
+void runCopyPlan()
+{
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   struct fatExtent *run;
+   COPYJOB *piece;
+   int i, n;
+   logPrintf(LOG_INFO, "Copying %d files in %d runs of clusters, in the order of the clusters\n",
+          numPlanned, numPieces);
+   qsort(pieces, numPieces, sizeof(struct copyPiece), comparePieces);
+   if(fatStream)
+   {
+      for(i=0 ; i<numPieces ; i++)
+      {
+         run = pieces[i].job->ext->extents+pieces[i].extent;
+         n = (pieces[i].job->numBlocks - run->logical*mult + mult-1)/mult;
+         wantFatClusters(run->start, n < run->length ? n : run->length);
+      }
+      dropFatClusters();
+   }
+   for(i=0 ; i<numPieces ; i++)
+   {
+      piece = newCopyPiece(pieces[i].job, pieces[i].extent);
+      if(piece != NULL) dispatchCopyJob(piece);
+   }
+   free(pieces);
+   pieces = NULL;
+   numPieces = maxPieces = numPlanned = 0;
+}
+
+/*-----------------------------------------------------------------
+Function: comparePieces
+
+Description: Orders the pieces by their first cluster (for qsort).
+-----------------------------------------------------------------*/
+int comparePieces(const void *a, const void *b)
+{
+   const struct copyPiece *p1 = a, *p2 = b;
+   return(p1->job->ext->extents[p1->extent].start - p2->job->ext->extents[p2->extent].start);
+}
+
+/*-----------------------------------------------------------------
+Function: newCopyPiece
+
+Parameters: COPYJOB *job - file
+            int e - run of clusters of the file
+
+Returns: a job that copies the run, or NULL.
+
+Description: The piece is a job of its own: its extent index holds the
+             run only, and its blocks are the blocks of the run in the
+	     file (from offset).  If it cannot be created, the file
+	     is kept only up to the run.
+-----------------------------------------------------------------*/
+COPYJOB *newCopyPiece(COPYJOB *job, int e)
+{
+   int mult = CLUSTER_SIZE/BLOCK_SIZE; // blocks per cluster
+   int offset = job->ext->extents[e].logical*mult;
+   int numBlocks = job->ext->extents[e].length*mult;
+   COPYJOB *piece;
+   FATEXTENTS *ext = malloc(sizeof(FATEXTENTS));
+
+   if(numBlocks > job->numBlocks-offset) numBlocks = job->numBlocks-offset;
+   if(ext != NULL && (ext->extents = malloc(sizeof(struct fatExtent))) == NULL)
+   {
+      free(ext);
+      ext = NULL;
+   }
+   if(ext == NULL || (piece = malloc(sizeof(COPYJOB))) == NULL)
+   {
+      perror("newCopyPiece");
+      freeFatExtents(ext);
+      endCopyPiece(job, offset, numBlocks, 0);
+      return(NULL);
+   }
+   ext->extents[0] = job->ext->extents[e];
+   ext->extents[0].logical = 0;
+   ext->numExtents = 1;
+   ext->numClusters = ext->extents[0].length;
+   piece->ext = ext;
+   piece->inodeNum = job->inodeNum;
+   piece->numBlocks = numBlocks;
+   memcpy(piece->zones, job->zones+offset, numBlocks*sizeof(unsigned short));
+   piece->parent = job;
+   piece->offset = offset;
+   return(piece);
+}
+
+/*-----------------------------------------------------------------
+Function: endCopyPiece
+
+Parameters: COPYJOB *job - file
+            int offset - logical block number of the piece in the file
+            int numBlocks - number of blocks of the piece
+            int copied - number of blocks of the piece copied
+
+Description: Counts the blocks copied for the file, and ends the file
+             (endCopyJob) with its last piece.  The pieces of a file
+	     can end in any order and in any thread.
+-----------------------------------------------------------------*/
+void endCopyPiece(COPYJOB *job, int offset, int numBlocks, int copied)
+{
+   int last;  // TRUE for the last piece of the file
+   pthread_mutex_lock(&pieceLock);
+   if(copied < numBlocks && offset+copied < job->firstFailed)
+      job->firstFailed = offset+copied;
+   last = --job->pending == 0;
+   pthread_mutex_unlock(&pieceLock);
+   if(last) endCopyJob(job, job->firstFailed);
+}
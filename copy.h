@@ -0,0 +1,102 @@
+/*-----------------------------------------------------------------
+File: copy.h
+Description: Contains definitions for the copy module, which copies
+             the contents of files from the FAT file system to the
+	     data blocks allocated in the Minix file system, either
+	     directly, with a pool of worker threads, with a
+	     reader/writer pipeline or with io_uring.
+------------------------------------------------------------------*/
+
+#ifndef COPY_H_DEF
+#define COPY_H_DEF
+
+#include "fat.h"
+#include "minix.h"
+#include "uring.h"
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define COPYQUEUESIZE 64  /* maximum number of jobs waiting for a worker */
+#define MAXRINGDEPTH 4096  /* maximum number of buffers in the pipeline */
+#define RINGSPINS 64  /* yields while a ring is empty before the thread blocks */
+
+/* How the contents of the files are copied (fat2minix options) */
+struct copyOptions
+{
+   int numThreads;  // -j: number of worker threads (0 - no workers)
+   int ringDepth;  // -p: number of buffers of the pipeline (0 - no pipeline)
+   int uringDepth;  // -u: number of io_uring buffers (0 - no io_uring)
+   int bufferSize;  // -b: size of a read buffer in bytes (0 - MAX_READ_SIZE)
+   int twoPhase;  // -t: copy after the walk, in the order of the clusters
+   int copyRange;  // -c: copy with copy_file_range
+};
+
+/* A file to copy: all Minix data blocks are already allocated and the
+   inode is saved, only the contents remain to be copied */
+struct copyJob
+{
+   int inodeNum;  // inode of the file
+   int numBlocks;  // number of blocks to copy
+   FATEXTENTS *ext;  // extent index of the FAT file
+   unsigned short zones[7+BLOCK_SIZE/2];  // data block of each block of the file
+   int blocksCopied;  // number of blocks written by the pipeline writer
+   int firstFailed;  // first block not written with io_uring (numBlocks if none)
+   int pending;  // io_uring buffers of the job in flight (+1 while submitting)
+                 // or pieces of the file not copied (two-phase copy)
+   struct copyJob *parent;  // file of a piece (two-phase copy), or NULL
+   int offset;  // logical block number in the file of the first block of a piece
+   struct copyJob *next;  // next job in the queue
+};
+typedef struct copyJob COPYJOB;
+
+/* A run of contiguous clusters of a file, copied in the data pass of the
+   two-phase copy */
+struct copyPiece
+{
+   COPYJOB *job;  // the file
+   int extent;  // the run: index in the extent index of the file
+};
+
+/* A buffer passed from the pipeline reader to the writer */
+struct copyBuffer
+{
+   char *buffer;  // pooled buffer of copyBufferClusters clusters
+   char *data;  // contents of the blocks (buffer, or the FAT mapping)
+   COPYJOB *job;  // file the blocks belong to
+   int block;  // logical block number in the file of the first block
+   int numBlocks;  // number of blocks (0 if none)
+   int lastOfJob;  // TRUE for the last buffer of the file
+};
+
+/* A buffer of the io_uring backend, registered with the kernel */
+struct uringBuffer
+{
+   char *buffer;  // copyBufferClusters clusters
+   COPYJOB *job;  // file the blocks belong to (NULL if the buffer is free)
+   int block;  // logical block number in the file of the first block
+   int pending;  // operations in flight (read and writes)
+   int failed;  // TRUE if an operation failed
+};
+
+/* Single-producer/single-consumer ring of buffers, without locks:
+   only the producer moves tail and only the consumer moves head.  The
+   lock is only used by a consumer that blocks on an empty ring */
+struct copyRing
+{
+   struct copyBuffer **slots;
+   unsigned size;  // number of slots (power of 2)
+   _Atomic unsigned head;  // next slot to take
+   _Atomic unsigned tail;  // next slot to fill
+   _Atomic int sleeping;  // TRUE while the consumer blocks (ringPut wakes it)
+   long blocked;  // times the consumer blocked
+   pthread_mutex_t lock;
+   pthread_cond_t notEmpty;
+};
+
+// Prototypes of the entry points
+int startCopyWorkers(struct copyOptions *);
+void submitCopyJob(COPYJOB *);
+int finishCopyJobs(void);
+int copyFileBlocks(COPYJOB *, char *);
+
+#endif
@@ -0,0 +1,223 @@
+/*-----------------------------------------------------------------
+File: dio.c
+Description: This file contains code for reading and writing the file
+             systems with positional I/O (pread/pwrite).
+
+	     When the file systems are opened with O_DIRECT (fat2minix
+	     --direct) the page cache is bypassed, and the offset, the
+	     size and the buffer of every transfer must be aligned
+	     (ioAlign).  Aligned transfers are done directly; the others
+	     go through aligned buffers taken from a pool, reading the
+	     aligned blocks around the data, and for writes copying the
+	     data in and writing the blocks back (read-modify-write).
+------------------------------------------------------------------*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // statx
+#endif
+#include "dio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define OK 0
+#define ERR1 -1
+
+// Global data - initialised by setDirectIO
+int ioAlign = 0;  // O_DIRECT alignment (0 - no O_DIRECT)
+int ioPoolSize = IOPOOLSIZE;  // size of the buffers of the pool
+void *ioPool[IOPOOLMAX];  // free buffers of the pool
+int ioPoolFree = 0;  // number of free buffers in the pool
+pthread_mutex_t ioPoolLock = PTHREAD_MUTEX_INITIALIZER;
+/* Read-modify-write of blocks shared with other data is done by one
+   thread at a time, so that concurrent writes to neighbouring data are
+   not lost */
+pthread_mutex_t ioRmwLock = PTHREAD_MUTEX_INITIALIZER;
+
+//*************** Prototypes of local functions **********************
+void *getPoolBuffer(void);
+void putPoolBuffer(void *);
+
+/*-----------------------------------------------------------------
+Function: setDirectIO
+
+Parameters: int fd - file system opened with O_DIRECT
+
+Returns: OK, or ERR1 if the file does not support O_DIRECT.
+
+Description: Determines the alignment required by O_DIRECT for the
+             file (statx STATX_DIOALIGN, IOALIGN when the kernel does
+	     not tell) and keeps the largest alignment of the files.
+-----------------------------------------------------------------*/
+int setDirectIO(int fd)
+{
+   int align = IOALIGN;
+#ifdef STATX_DIOALIGN
+   struct statx sx;
+   if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 &&
+      (sx.stx_mask & STATX_DIOALIGN))
+   {
+      if(sx.stx_dio_offset_align == 0) return(ERR1);  // not supported
+      align = sx.stx_dio_offset_align;
+      if(sx.stx_dio_mem_align > align) align = sx.stx_dio_mem_align;
+   }
+#endif
+   if(align > ioAlign) ioAlign = align;
+   if(ioPoolSize < 4*ioAlign) ioPoolSize = 4*ioAlign;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: allocIOBuffer
+
+Parameters: size_t size - size of the buffer
+
+Returns: buffer aligned for O_DIRECT (free with free), or NULL.
+
+Description: Buffers used for reading or writing the file systems
+             are allocated aligned, so that their transfers are done
+	     directly with O_DIRECT.
+-----------------------------------------------------------------*/
+void *allocIOBuffer(size_t size)
+{
+   void *buffer;
+   errno = posix_memalign(&buffer, ioAlign > IOALIGN ? ioAlign : IOALIGN, size);
+   if(errno != 0) return(NULL);
+   return(buffer);
+}
+
+/*-----------------------------------------------------------------
+Function: ioRead
+
+Parameters: int fd - file system
+            void *buffer - where to store the data
+            size_t size - number of bytes
+            off_t offset - position in the file system
+
+Returns: number of bytes read (less than size at the end of the file),
+         or -1 on error (errno is set).
+
+Description: Reads with pread.  With O_DIRECT, an unaligned transfer
+             reads the aligned blocks around the data into a buffer
+	     of the pool, in pieces that fit in the buffer.
+-----------------------------------------------------------------*/
+ssize_t ioRead(int fd, void *buffer, size_t size, off_t offset)
+{
+   char *bounce;
+   ssize_t done = 0;
+   size_t len;
+   off_t start, end;  // aligned blocks around a piece
+   ssize_t n;
+
+   if(ioAlign == 0 ||
+      (((uintptr_t)buffer | size | offset) & (ioAlign-1)) == 0)
+      return(pread(fd, buffer, size, offset));
+   if((bounce = getPoolBuffer()) == NULL) return(-1);
+   while(done < size)
+   {
+      len = size-done;
+      if(len > ioPoolSize-2*ioAlign) len = ioPoolSize-2*ioAlign;
+      start = (offset+done) & ~(off_t)(ioAlign-1);
+      end = (offset+done+len+ioAlign-1) & ~(off_t)(ioAlign-1);
+      n = pread(fd, bounce, end-start, start);
+      if(n < 0) { if(done == 0) done = -1; break; }
+      n -= offset+done-start;  // bytes of the piece available
+      if(n <= 0) break;  // end of file
+      if(n > len) n = len;
+      memcpy((char *)buffer+done, bounce+(offset+done-start), n);
+      done += n;
+      if(n < len) break;  // end of file
+   }
+   putPoolBuffer(bounce);
+   return(done);
+}
+
+/*-----------------------------------------------------------------
+Function: ioWrite
+
+Parameters: int fd - file system
+            void *buffer - data to write
+            size_t size - number of bytes
+            off_t offset - position in the file system
+
+Returns: number of bytes written, or -1 on error (errno is set).
+
+Description: Writes with pwrite.  With O_DIRECT, an unaligned transfer
+             is copied into a buffer of the pool and written as aligned
+	     blocks; a block only partly covered by the data is read
+	     first (read-modify-write).
+-----------------------------------------------------------------*/
+ssize_t ioWrite(int fd, void *buffer, size_t size, off_t offset)
+{
+   char *bounce;
+   ssize_t done = 0;
+   size_t len;
+   off_t start, end;  // aligned blocks around a piece
+   ssize_t n;
+   int partial;  // TRUE if the piece only partly covers its blocks
+
+   if(ioAlign == 0 ||
+      (((uintptr_t)buffer | size | offset) & (ioAlign-1)) == 0)
+      return(pwrite(fd, buffer, size, offset));
+   if((bounce = getPoolBuffer()) == NULL) return(-1);
+   while(done < size)
+   {
+      len = size-done;
+      if(len > ioPoolSize-2*ioAlign) len = ioPoolSize-2*ioAlign;
+      start = (offset+done) & ~(off_t)(ioAlign-1);
+      end = (offset+done+len+ioAlign-1) & ~(off_t)(ioAlign-1);
+      partial = start != offset+done || end != offset+done+len;
+      if(partial)
+      {
+         pthread_mutex_lock(&ioRmwLock);
+         n = pread(fd, bounce, end-start, start);
+         if(n < 0) n = 0;
+         if(n < end-start) memset(bounce+n, 0, end-start-n);  // beyond the end
+      }
+      memcpy(bounce+(offset+done-start), (char *)buffer+done, len);
+      n = pwrite(fd, bounce, end-start, start);
+      if(partial) pthread_mutex_unlock(&ioRmwLock);
+      if(n != end-start) { if(done == 0) done = -1; break; }
+      done += len;
+   }
+   putPoolBuffer(bounce);
+   return(done);
+}
+
+/*-----------------------------------------------------------------
+Function: getPoolBuffer / putPoolBuffer
+
+Parameters: void *buffer - buffer given back to the pool
+
+Returns: getPoolBuffer - an aligned buffer of ioPoolSize bytes, or NULL.
+
+Description: The pool keeps up to IOPOOLMAX free buffers for the
+             unaligned transfers of all threads.
+-----------------------------------------------------------------*/
+void *getPoolBuffer()
+{
+   void *buffer = NULL;
+   pthread_mutex_lock(&ioPoolLock);
+   if(ioPoolFree > 0) buffer = ioPool[--ioPoolFree];
+   pthread_mutex_unlock(&ioPoolLock);
+   if(buffer == NULL) buffer = allocIOBuffer(ioPoolSize);
+   return(buffer);
+}
+
+void putPoolBuffer(void *buffer)
+{
+   pthread_mutex_lock(&ioPoolLock);
+   if(ioPoolFree < IOPOOLMAX)
+   {
+      ioPool[ioPoolFree++] = buffer;
+      buffer = NULL;
+   }
+   pthread_mutex_unlock(&ioPoolLock);
+   free(buffer);
+}
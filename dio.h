@@ -0,0 +1,27 @@
+/*-----------------------------------------------------------------
+File: dio.h
+Description: Contains definitions for the dio module, which reads and
+             writes the file systems with positional I/O, and keeps
+	     the I/O aligned when the file systems are opened with
+	     O_DIRECT (fat2minix --direct).
+------------------------------------------------------------------*/
+
+#ifndef DIO_H_DEF
+#define DIO_H_DEF
+
+#include <sys/types.h>
+
+#define IOALIGN 4096  /* alignment of the I/O buffers (and default O_DIRECT alignment) */
+#define IOPOOLSIZE (64*1024)  /* size of a buffer of the pool for unaligned I/O */
+#define IOPOOLMAX 8  /* maximum number of free buffers kept in the pool */
+
+// Global data (see dio.c)
+extern int ioAlign;  // O_DIRECT alignment of offsets, sizes and buffers (0 - no O_DIRECT)
+
+// Prototypes of the entry points
+int setDirectIO(int);
+void *allocIOBuffer(size_t);
+ssize_t ioRead(int, void *, size_t, off_t);
+ssize_t ioWrite(int, void *, size_t, off_t);
+
+#endif
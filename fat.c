@@ -7,16 +7,58 @@ Description: This file contains code for reading structures from
 ------------------------------------------------------------------*/
 
 #include "fatDefn.h"
+#include "minix.h"  // BLOCK_SIZE
 #include "errno.h"
 #include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "dio.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 /* some global data */
 struct fat_boot_sector fbs;  // FAT Boot Sector
-unsigned short *fatPtr;  // pointer to the FAT Table
+void *fatPtr;  // FAT Table in memory (NULL: read in windows, see fatNext)
 int fatfd;  // File descriptor for FAT file system
+// Geometry of the file system (set by readFatBoot)
+int fatType = 16;  // 16 or 32
+unsigned fatLength;  // sectors per FAT table
+unsigned numFatClusters;  // number of data clusters
+unsigned fatRootCluster = 0;  // first cluster of the FAT32 root directory
+unsigned fatEOF = EOF_FAT16;  // smallest end of chain value
+unsigned fatLastCluster;  // last cluster indicator (entry 1 of the FAT)
+off_t fatPos, rootDirPos, dataPos;  // positions of the FAT, root directory, data
+struct fatWindow fatWindows[FATWINDOWS];  // windows of a large FAT table
+char *fatMap = NULL;  // FAT file system mapped in memory (NULL if not mapped)
+off_t fatMapSize;  // size of the mapping in bytes
+// FAT file system read from a stream (see streamFatImage)
+int fatStream = FALSE;  // TRUE if the FAT file system is read from a stream
+off_t streamPos = 0;  // number of bytes read from the stream
+char *streamHead = NULL;  // boot sector, FAT tables and root directory
+off_t streamHeadSize = 0;  // size of streamHead
+struct heldCluster **heldClusters = NULL;  // hash table of the clusters read from the stream and not used yet
+int numHeldBuckets = 0;  // size of the hash table (power of 2)
+int numHeld = 0;  // number of held clusters
+unsigned char *wantedClusters = NULL;  // bit map of the clusters to hold (NULL - all in use)
+long heldBytes = 0, maxHeldBytes = 0;  // memory used by the held clusters
+pthread_mutex_t streamLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Prototypes of local functions
 void removeTrailingSpace(char *);
+int setFatGeometry(void);
+void readFatInfo(void);
+off_t clusterOffset(int);
+int loadFatWindow(struct fatWindow *, long);
+int skipStream(off_t);
+int readStream(char *, int);
+char *readStreamRegion(off_t, int, char *);
+int advanceStream(int);
+char *findHeldCluster(int);
+char *holdCluster(int);
+void releaseCluster(int);
+int growHeldClusters(void);
 
 /*-----------------------------------------------------------------
 Function: readFatBoot(fd)
@@ -49,6 +91,11 @@ Description: Displays all data from the boot sector
 	     Also calls readFatTable to read the Fat table.  Saves
 	     the fd for other functions.
 
+	     The geometry of the file system is set by setFatGeometry:
+	     FAT16, or FAT32 when fat_length is 0 (the size of the FAT
+	     is then in fat32_length and the root directory is a chain
+	     of clusters starting at root_cluster).
+
 -----------------------------------------------------------------*/
 int readFatBoot(int fd)
 {
@@ -56,31 +103,146 @@ int readFatBoot(int fd)
      char string[BUFSIZ];  // creates large buffer
 
      fatfd = fd;  // save for other functions.
-     if(lseek(fd, 0, SEEK_SET)==-1) perror("readFatBoot");  // move to start of FS
-     n = read(fd,&fbs,sizeof(struct fat_boot_sector)); // reads in the boot sector
+     if(fatMap != NULL)  // copy from the mapped image
+     {
+        n = sizeof(struct fat_boot_sector);
+        if(fatMapSize < n) n = fatMapSize;
+        memcpy(&fbs, fatMap, n);
+        countIO(&stats.fat, 0, n, 0);
+     }
+     else if(fatStream)
+     {
+        n = readStream((char *)&fbs, sizeof(struct fat_boot_sector));
+     }
+     else
+     {
+        n = ioRead(fd,&fbs,sizeof(struct fat_boot_sector),0); // reads in the boot sector
+        countIO(&stats.fat, 1, n > 0 ? n : 0, 0);
+     }
      if(n != sizeof(struct fat_boot_sector))
      {
-         printf("Could not read bootsector (%d,%d)\n",n,sizeof(struct fat_boot_sector));
+         logPrintf(LOG_ERROR, "Could not read bootsector (%d,%d)\n",n,sizeof(struct fat_boot_sector));
 	 return(ERR1);
      }
+     if(setFatGeometry() == ERR1) return(ERR1);
      /* Printout the contents */
-    printf("------------Boot Sector - FAT 16--------------\n");
+    logPrintf(LOG_DEBUG, "------------Boot Sector - FAT %d--------------\n", fatType);
     strncpy(string, fbs.system_id, 8);
-    printf("System id: %s\n",string);
-    printf("Sector Size: %hd\n", *(short *) fbs.sector_size); // 2 byte int
-    printf("Cluster Size: %hhd\n", fbs.cluster_size); // 1 byte int
-    printf("Nmber of Reserved Sectors: %hd\n", fbs.reserved); // 2 byte int
-    printf("Number of FATs: %hhd\n", fbs.fats); // 1 byte int
-    printf("Max Number of Root Directory Entries: %hd\n", *(short *) fbs.dir_entries); // 2 byte int
-    printf("Total number of sectors: %hd\n", *(short *) fbs.sectors); // 2 byte int
-    printf("Media code: %hhx\n", fbs.media); // 1 byte hex
-    printf("Number of sectors per FAT: %hd\n",  fbs.fat_length); // 2 byte int
-    printf("Number of sectors per track: %hd\n",  fbs.secs_track); // 2 byte int
-    printf("Number of heads: %hd\n", fbs.heads); // 2 byte int
-    printf("Total number of sectors(if previous is 0): %d\n", fbs.total_sect); // 4 byte int
-    printf("-----------------------------------------\n\n");
+    logPrintf(LOG_DEBUG, "System id: %s\n",string);
+    logPrintf(LOG_DEBUG, "Sector Size: %hd\n", *(short *) fbs.sector_size); // 2 byte int
+    logPrintf(LOG_DEBUG, "Cluster Size: %hhd\n", fbs.cluster_size); // 1 byte int
+    logPrintf(LOG_DEBUG, "Nmber of Reserved Sectors: %hd\n", fbs.reserved); // 2 byte int
+    logPrintf(LOG_DEBUG, "Number of FATs: %hhd\n", fbs.fats); // 1 byte int
+    logPrintf(LOG_DEBUG, "Max Number of Root Directory Entries: %hd\n", *(short *) fbs.dir_entries); // 2 byte int
+    logPrintf(LOG_DEBUG, "Total number of sectors: %hd\n", *(short *) fbs.sectors); // 2 byte int
+    logPrintf(LOG_DEBUG, "Media code: %hhx\n", fbs.media); // 1 byte hex
+    logPrintf(LOG_DEBUG, "Number of sectors per FAT: %hd\n",  fbs.fat_length); // 2 byte int
+    logPrintf(LOG_DEBUG, "Number of sectors per track: %hd\n",  fbs.secs_track); // 2 byte int
+    logPrintf(LOG_DEBUG, "Number of heads: %hd\n", fbs.heads); // 2 byte int
+    logPrintf(LOG_DEBUG, "Total number of sectors(if previous is 0): %d\n", fbs.total_sect); // 4 byte int
+    if(fatType == 32)
+    {
+       logPrintf(LOG_DEBUG, "Number of sectors per FAT (FAT32): %u\n", fbs.fat32_length); // 4 byte int
+       logPrintf(LOG_DEBUG, "Root directory cluster: %u\n", fbs.root_cluster); // 4 byte int
+       logPrintf(LOG_DEBUG, "FS Information sector: %hu\n", fbs.info_sector); // 2 byte int
+    }
+    logPrintf(LOG_DEBUG, "Number of clusters: %u\n", numFatClusters);
+    logPrintf(LOG_DEBUG, "-----------------------------------------\n\n");
     // Also read the FAT table
-    return(readFatTable());
+    if(readFatTable() == ERR1) return(ERR1);
+    fatLastCluster = fatNext(1);
+    if(fatType == 32) readFatInfo();
+    return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: setFatGeometry
+
+Returns: OK, or ERR1 if the boot sector does not describe a FAT16 or
+         FAT32 file system.
+
+Description: Sets the type of the file system, the positions of the
+             FAT tables, root directory and data area, and the number
+	     of clusters from the boot sector (FAT_POS, ROOTDIR_POS,
+	     DATA_POS and NUM_FAT_ENTRIES in fatDefn.h).  As in the
+	     Linux kernel, a FAT32 file system is recognised by a
+	     fat_length of 0.  FAT12 is not supported (it is read as
+	     FAT16), nor are clusters smaller than a Minix block (the
+	     blocks of a file are copied from within a cluster).
+-----------------------------------------------------------------*/
+int setFatGeometry()
+{
+   unsigned long totalSectors;  // sectors in the file system
+   unsigned long rootSectors;  // sectors of the FAT16 root directory
+   unsigned long entries;  // entries a FAT table can hold
+
+   if(SECTOR_SIZE <= 0 || fbs.cluster_size == 0 || fbs.fats == 0)
+   {
+      logPrintf(LOG_ERROR, "Not a FAT file system (sector size %d, cluster size %d, %d FATs)\n",
+                SECTOR_SIZE, fbs.cluster_size, fbs.fats);
+      return(ERR1);
+   }
+   if(CLUSTER_SIZE % BLOCK_SIZE != 0)  // a Minix block is copied from a single cluster
+   {
+      logPrintf(LOG_ERROR, "Clusters of %d bytes not supported (must be a multiple of %d bytes)\n",
+                CLUSTER_SIZE, BLOCK_SIZE);
+      return(ERR1);
+   }
+   fatType = fbs.fat_length == 0 ? 32 : 16;
+   fatLength = fatType == 32 ? fbs.fat32_length : fbs.fat_length;
+   totalSectors = *(unsigned short *)fbs.sectors != 0 ? *(unsigned short *)fbs.sectors : fbs.total_sect;
+   rootSectors = (*(unsigned short *)fbs.dir_entries*sizeof(struct msdos_dir_entry)+SECTOR_SIZE-1)/SECTOR_SIZE;
+   fatPos = (off_t)fbs.reserved*SECTOR_SIZE;
+   rootDirPos = fatPos + fbs.fats*FAT_SIZE;
+   dataPos = rootDirPos + (off_t)rootSectors*SECTOR_SIZE;
+   if(fatType == 32 && (rootSectors != 0 || fbs.root_cluster < 2 || fatLength == 0))
+   {
+      logPrintf(LOG_ERROR, "Not a FAT32 file system (%lu root sectors, root cluster %u, FAT of %u sectors)\n",
+                rootSectors, fbs.root_cluster, fatLength);
+      return(ERR1);
+   }
+   numFatClusters = 0;
+   if(totalSectors > dataPos/SECTOR_SIZE)
+      numFatClusters = (totalSectors - dataPos/SECTOR_SIZE)/fbs.cluster_size;
+   entries = FAT_SIZE/(fatType/8);
+   if(numFatClusters+2 > entries || numFatClusters == 0)
+      numFatClusters = entries > 2 ? entries-2 : 0;  // the FAT table is the limit
+   fatEOF = fatType == 32 ? EOF_FAT32 : EOF_FAT16;
+   fatRootCluster = fatType == 32 ? fbs.root_cluster & FAT32_MASK : 0;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: readFatInfo
+
+Description: Reads the FS Information sector of a FAT32 file system
+             and prints the number of free clusters it records.  The
+	     sector is only informative (the FAT table is not
+	     updated), so an invalid sector is ignored.
+-----------------------------------------------------------------*/
+void readFatInfo()
+{
+   struct fat_boot_fsinfo *info;
+   char *buffer = NULL;  // not used if the image is mapped or streamed
+   off_t offset = (off_t)fbs.info_sector*SECTOR_SIZE;
+
+   if(fbs.info_sector == 0 || fbs.info_sector == 0xFFFF || offset+SECTOR_SIZE > FAT_POS)
+      return;  // no FS Information sector
+   if(fatMap == NULL && !fatStream && (buffer = allocIOBuffer(sizeof(struct fat_boot_fsinfo))) == NULL)
+   {
+      perror("readFatInfo");
+      return;
+   }
+   info = (struct fat_boot_fsinfo *)readFatRegion(offset, sizeof(struct fat_boot_fsinfo), buffer);
+   if(info == NULL) { }  // error printed by readFatRegion
+   else if(info->signature1 != FAT_FSINFO_SIG1 || info->signature2 != FAT_FSINFO_SIG2)
+      logPrintf(LOG_INFO, "FAT32 FS Information sector not valid - ignored\n");
+   else if(info->free_clusters > numFatClusters)  // 0xFFFFFFFF: not known
+      logPrintf(LOG_INFO, "FAT32: %u clusters of %d bytes\n", numFatClusters, CLUSTER_SIZE);
+   else
+      logPrintf(LOG_INFO, "FAT32: %u clusters of %d bytes, %u in use\n",
+                numFatClusters, CLUSTER_SIZE, numFatClusters - info->free_clusters);
+   free(buffer);
 }
 /*-----------------------------------------------------------------
 Function: readFatTable
@@ -90,24 +252,72 @@ Parameters: None
 Description: Reads in the FAT table.  Also
              allocates memory using malloc for saving the FAT table.
              Note that the FAT table is represented
-             as an array of short's, that is 2 byte integers.
+             as an array of 2 byte (FAT16) or 4 byte (FAT32) integers,
+	     read with fatNext.
              It is assumed that fbs has been setup, i.e.
 	     a call to readFatBoot has been made.
+	     When the image is mapped, fatPtr points directly
+	     into the mapping and nothing is read.  When the image is
+	     streamed, everything up to the data area (FAT tables and
+	     root directory) is read and kept, fatPtr pointing into it;
+	     with FAT32 only the first FAT table is kept.
+	     A FAT table larger than FATWINDOWS windows (FAT32) is not
+	     read: fatPtr is NULL and fatNext reads the windows of the
+	     table as the cluster chains are walked.
 -----------------------------------------------------------------*/
 int readFatTable( )
 {
-   // FAT Tables contain two byte entries
-   // Setup config info from boot sector
-   int sectorSize = (*(short *)fbs.sector_size); // size in bytes
-   int fatSize = fbs.fat_length * sectorSize; // size in bytes
-   fatPtr = (unsigned short*) malloc(fatSize); // allocates memory for FAT Table
+   off_t fatSize = FAT_SIZE; // size in bytes
+   off_t n;
+   if(fatMap != NULL)
+   {
+      if(fatSize <= (off_t)FATWINDOW*FATWINDOWS)
+         fatPtr = readFatRegion(FAT_POS, fatSize, NULL);  // prefetched
+      else if(FAT_POS+fatSize <= fatMapSize)
+         fatPtr = fatMap+FAT_POS;  // pages read as the chains are walked
+      else
+      {
+         fprintf(stderr,"readFatTable: FAT table outside of image\n");
+         fatPtr = NULL;
+      }
+      if(fatPtr == NULL) return(ERR1);
+      // the root directory is needed right after the FAT table
+      if(DATA_POS > ROOTDIR_POS) readFatRegion(ROOTDIR_POS, DATA_POS-ROOTDIR_POS, NULL);
+      return(OK);
+   }
+   if(fatStream)
+   {
+      // FAT32 has no root directory region: the other FAT tables are skipped
+      streamHeadSize = fatType == 32 ? FAT_POS+fatSize : DATA_POS;
+      streamHead = malloc(streamHeadSize);
+      if(streamHead == NULL)
+      {
+         perror("readFatTable");
+         return(ERR1);
+      }
+      memcpy(streamHead, &fbs, sizeof(struct fat_boot_sector));
+      n = streamHeadSize-streamPos;  // rest of the area kept
+      if(readStream(streamHead+streamPos, n) != n || skipStream(DATA_POS-streamPos) == ERR1)
+      {
+         fprintf(stderr,"readFatTable: FAT stream ends before the data area\n");
+         return(ERR1);
+      }
+      fatPtr = streamHead+FAT_POS;
+      return(OK);
+   }
+   if(fatSize > (off_t)FATWINDOW*FATWINDOWS)
+   {
+      fatPtr = NULL;  // read in windows by fatNext
+      return(OK);
+   }
+   fatPtr = allocIOBuffer(fatSize); // allocates memory for FAT Table
    if(fatPtr == NULL)
    {
       perror("malloc");
       return(ERR1);
    }
-   if(lseek(fatfd, sectorSize, SEEK_SET)==-1) perror("readFatTable"); // seek to first FAT table
-   if(read(fatfd, fatPtr, fatSize)==-1) perror("readFatTable");  // Reads in the FAT table from the disk
+   if(ioRead(fatfd, fatPtr, fatSize, FAT_POS)==-1) perror("readFatTable");  // Reads in the first FAT table from the disk
+   countIO(&stats.fat, 1, fatSize, 0);
    return(OK);
 }
 
@@ -117,21 +327,21 @@ Function: saveFatTable
 Parameters: None
 
 Description: Saves the the FAT table in the file system (hard drive).
+             Nothing is saved when the table is read in windows
+	     (they are never changed).
 -----------------------------------------------------------------*/
 int saveFatTable( )
 {
-   // FAT Tables contain two byte entries
    int i;
-   // Setup config info from boot sector
-   int sectorSize = (*(short *)fbs.sector_size); // size in bytes
-   int fatSize = fbs.fat_length * sectorSize; // size in bytes
+   off_t fatSize = FAT_SIZE; // size in bytes
    int numFats = fbs.fats; // number of FAT tables - usually 2
+   if(fatPtr == NULL) return(OK);
    /* time to write the FATs */
    for(i=0 ; i < numFats ; i++)
    {
-      if(lseek(fatfd, sectorSize+i*(fbs.fat_length * sectorSize), SEEK_SET)==-1) 
-          perror("saveFatTable");
-      if(write(fatfd, fatPtr, fatSize)==-1) perror("saveFatTable");  // Reads in the FAT table from the disk
+      if(ioWrite(fatfd, fatPtr, fatSize, FAT_POS+i*fatSize)==-1)
+          perror("saveFatTable");  // Writes the FAT table to the disk
+      countIO(&stats.fat, 1, 0, fatSize);
    }
    return(OK);
 }
@@ -163,7 +373,7 @@ FATDIR *openFatDirectory(char *dirname)
    }
    else
    {
-      printf("Could not find FAT Directory %s\n",dirname);
+      logPrintf(LOG_ERROR, "Could not find FAT Directory %s\n",dirname);
       free(dirTablePtr->table);
       free(dirTablePtr);
       dirTablePtr = NULL;
@@ -241,7 +451,7 @@ Description: Scanning to find directory table. This is a recursive
 	     clusterNum where the directory table is stored.
 -----------------------------------------------------------------*/
 int scanSubDirectories(char *path, struct msdos_dir_entry *tbl, 
-		       FATDIR *dirTablePtr, unsigned short parentCluster)
+		       FATDIR *dirTablePtr, unsigned parentCluster)
 {
    int numSubDirEntries = CLUSTER_SIZE/sizeof(struct msdos_dir_entry);
    struct msdos_dir_entry subDirTable[numSubDirEntries]; // for subdirectories
@@ -263,7 +473,7 @@ int scanSubDirectories(char *path, struct msdos_dir_entry *tbl,
       {
          if(*path == '\0') // if at end of path, then found directory 
 	 {
-	    dirTablePtr->clusterNum = tbl[ix].start;  // this is where its stored
+	    dirTablePtr->clusterNum = FAT_START(tbl+ix);  // this is where its stored
             dirTablePtr->size = CLUSTER_SIZE;
             dirTablePtr->numEntries = dirTablePtr->size/sizeof(struct msdos_dir_entry);
 	    dirTablePtr->parentCluster = parentCluster;
@@ -274,15 +484,15 @@ int scanSubDirectories(char *path, struct msdos_dir_entry *tbl,
 	 }
 	 else // otherwise need to find next subdirectory in path
 	 {
-	    readCluster(tbl[ix].start, subDirTable, "scanSubDirectories");
-            retcd = scanSubDirectories(path, subDirTable, dirTablePtr, tbl[ix].start);
+	    readCluster(FAT_START(tbl+ix), subDirTable, "scanSubDirectories");
+            retcd = scanSubDirectories(path, subDirTable, dirTablePtr, FAT_START(tbl+ix));
             break;  // leave the loop
 	 }
       }
    }
    if(ix == numSubDirEntries) // did not find the name in the table
    {
-      printf("Could not find subdirectory %s\n", subDirName);
+      logPrintf(LOG_ERROR, "Could not find subdirectory %s\n", subDirName);
       retcd = ERR1;
    }
    return(retcd);
@@ -370,7 +580,7 @@ void displayFatDirEntry(struct msdos_dir_entry *de)
                              ((de->time&0x07ef)>>5), 
                              (de->time&0x001f)); 
        /* content information */
-   printf("   Start Cluster: %x, Size: %d\n", de->start, de->size);
+   printf("   Start Cluster: %x, Size: %d\n", FAT_START(de), de->size);
 }
 
 /*-----------------------------------------------------------------
@@ -439,40 +649,689 @@ Description: Reads (readCluster) a cluster from memory or
 void readCluster(int clusterNum, void *buffer, char *errStr)
 {
    char errorString[BUFSIZ];
+   off_t offset;
    *(char *)buffer = '\0';  // set to null char
-   sprintf(errorString,"readCluster (from %s)",errStr);
-   if(clusterNum == 0) // seek to root directory
+   offset = clusterOffset(clusterNum);
+   if(fatMap != NULL)  // copy from the mapped image
    {
-      if(lseek(fatfd, ROOTDIR_POS, SEEK_SET)==-1)
-           perror(errorString); // seek to directory table
-   }
-   else
-   {
-      if(lseek(fatfd, DATA_POS + (clusterNum-2)*CLUSTER_SIZE, SEEK_SET)==-1)
-           perror(errorString); // seek to directory table
+      if(offset+CLUSTER_SIZE <= fatMapSize)
+      {
+         memcpy(buffer, fatMap+offset, CLUSTER_SIZE);
+         countIO(&stats.fat, 0, CLUSTER_SIZE, 0);
+      }
+      else fprintf(stderr,"readCluster (from %s): cluster %d outside of image\n",
+                   errStr, clusterNum);
+      return;
    }
-   if(read(fatfd, buffer, CLUSTER_SIZE)==-1) 
-       perror(errorString); // seek to directory table
+   sprintf(errorString,"readCluster (from %s)",errStr);
+   if(ioRead(fatfd, buffer, CLUSTER_SIZE, offset)==-1) 
+       perror(errorString);
+   countIO(&stats.fat, 1, CLUSTER_SIZE, 0);
 }
 
 void writeCluster(int clusterNum, void *buffer, char *errStr)
 {
    char errorString[BUFSIZ];
+   off_t offset;  // position of the cluster
    sprintf(errorString,"writeCluster (from %s)",errStr);
-   if(clusterNum == 0) // seek to root directory
+   offset = clusterOffset(clusterNum);
+   if(ioWrite(fatfd, buffer, CLUSTER_SIZE, offset)==-1) 
+       perror(errorString);
+   countIO(&stats.fat, 1, 0, CLUSTER_SIZE);
+}
+
+/*-----------------------------------------------------------------
+Function: clusterOffset
+
+Parameters:  int clusterNum - cluster number, 0 for the root directory
+
+Returns:  position of the cluster in the FAT file system (the first
+          cluster of the root directory with FAT32).
+-----------------------------------------------------------------*/
+off_t clusterOffset(int clusterNum)
+{
+   if(clusterNum == 0 && fatType == 32) clusterNum = fatRootCluster;
+   if(clusterNum == 0) return(ROOTDIR_POS);  // FAT16 root directory
+   return(DATA_POS + (off_t)(clusterNum-2)*CLUSTER_SIZE);
+}
+
+/*-----------------------------------------------------------------
+Function: mapFatImage   unmapFatImage
+
+Parameters:  int fd - file descriptor of open FAT file system
+
+Returns:  OK - image mapped
+          ERR1 - image could not be mapped (reads are used instead)
+
+Description: Maps the whole FAT file system read-only in memory
+             (mapFatImage), or releases the mapping (unmapFatImage).
+	     Once mapped, all reads are served by readFatRegion
+	     from the mapping; the FAT table, directory tables and
+	     file contents are then views into the mapping instead
+	     of copies.  Call mapFatImage before readFatBoot.
+-----------------------------------------------------------------*/
+int mapFatImage(int fd)
+{
+   struct stat st;
+   char *map;
+
+   if(fstat(fd, &st) == -1) { perror("mapFatImage"); return(ERR1); }
+   if(S_ISBLK(st.st_mode)) fatMapSize = lseek(fd, 0, SEEK_END);  // device size
+   else fatMapSize = st.st_size;
+   if(fatMapSize <= 0)
+   {
+      fprintf(stderr,"mapFatImage: cannot map an image of unknown size\n");
+      return(ERR1);
+   }
+   map = mmap(NULL, fatMapSize, PROT_READ, MAP_SHARED, fd, 0);
+   if(map == MAP_FAILED) { perror("mapFatImage"); return(ERR1); }
+   // data is mostly read forward, one file after the other
+   madvise(map, fatMapSize, MADV_SEQUENTIAL);
+   fatMap = map;
+   return(OK);
+}
+
+void unmapFatImage()
+{
+   if(fatMap != NULL)
+   {
+      munmap(fatMap, fatMapSize);
+      fatMap = NULL;
+      fatPtr = NULL;  // was pointing into the mapping
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: streamFatImage   endFatStream
+
+Parameters:  int fd - file descriptor of the FAT file system (a pipe,
+                      standard input...)
+
+Returns:  OK, or ERR1 if there is no memory for the held clusters
+
+Description: The FAT file system is read once from start to end, without
+             seeking (streamFatImage, call before readFatBoot).  The
+	     boot sector, the FAT tables and the root directory are kept
+	     in memory (readFatTable, only the first FAT table with
+	     FAT32): a whole FAT table is kept, as the chains are
+	     followed in any order and the stream cannot be read
+	     again.  The data clusters must then be read in ascending
+	     order: clusters passed over to reach a cluster are held
+	     in memory (hash table, see holdCluster) until they are
+	     read, all the clusters in use while the directories are
+	     scanned, only the clusters wanted (wantFatClusters) after
+	     that.
+	     endFatStream releases the memory and prints how much was
+	     held at most.
+-----------------------------------------------------------------*/
+int streamFatImage(int fd)
+{
+   if(growHeldClusters() == ERR1)
    {
-      if(lseek(fatfd, ROOTDIR_POS, SEEK_SET)==-1)
-           perror(errorString); // seek to directory table
+      perror("streamFatImage");
+      return(ERR1);
    }
+   fatfd = fd;
+   fatStream = TRUE;
+   return(OK);
+}
+
+void endFatStream()
+{
+   struct heldCluster *held;
+   int c;
+   if(!fatStream) return;
+   logPrintf(LOG_INFO, "Read %lld bytes from the FAT stream, held at most %ld bytes in memory\n",
+          (long long)streamPos, maxHeldBytes);
+   for(c=0 ; c<numHeldBuckets ; c++)
+      while((held = heldClusters[c]) != NULL)
+      {
+         heldClusters[c] = held->next;
+         free(held);
+      }
+   free(heldClusters);
+   numHeldBuckets = 0;
+   numHeld = 0;
+   free(wantedClusters);
+   free(streamHead);
+   heldClusters = NULL;
+   wantedClusters = NULL;
+   streamHead = NULL;
+   streamHeadSize = 0;
+   fatPtr = NULL;  // was pointing into streamHead
+   fatStream = FALSE;
+}
+
+/*-----------------------------------------------------------------
+Function: wantFatClusters   dropFatClusters
+
+Parameters:  int clusterNum - first cluster of a run
+             int numClusters - number of clusters in the run
+
+Description: Once the directories are scanned, the clusters still to
+             be read are marked (wantFatClusters) and the held
+	     clusters that are not are released (dropFatClusters).
+	     From then on, only the clusters marked are held.  Nothing
+	     is done if the image is not streamed.
+-----------------------------------------------------------------*/
+void wantFatClusters(int clusterNum, int numClusters)
+{
+   if(!fatStream) return;
+   pthread_mutex_lock(&streamLock);
+   if(wantedClusters == NULL) wantedClusters = calloc((NUM_FAT_ENTRIES+7)/8, 1);
+   if(wantedClusters == NULL) perror("wantFatClusters");  // all clusters held
    else
+      for( ; numClusters > 0 && clusterNum < NUM_FAT_ENTRIES ; numClusters--, clusterNum++)
+         wantedClusters[clusterNum/8] |= 1 << (clusterNum%8);
+   pthread_mutex_unlock(&streamLock);
+}
+
+void dropFatClusters()
+{
+   struct heldCluster *held, *next;
+   int c;
+   if(!fatStream) return;
+   pthread_mutex_lock(&streamLock);
+   if(wantedClusters == NULL) wantedClusters = calloc((NUM_FAT_ENTRIES+7)/8, 1);
+   for(c=0 ; c<numHeldBuckets && wantedClusters != NULL ; c++)
+      for(held = heldClusters[c] ; held != NULL ; held = next)
+      {
+         next = held->next;
+         if(!IS_WANTED(held->cluster)) releaseCluster(held->cluster);
+      }
+   pthread_mutex_unlock(&streamLock);
+}
+
+/*-----------------------------------------------------------------
+Function: readStream
+
+Parameters:  char *buffer - where to store the data
+             int size - number of bytes
+
+Returns:  number of bytes read (less than size at the end of the stream)
+
+Description: Reads the next bytes of the stream; a pipe can return
+             fewer bytes than asked, so reads are repeated.
+-----------------------------------------------------------------*/
+int readStream(char *buffer, int size)
+{
+   int done = 0;
+   ssize_t n;
+   while(done < size)
+   {
+      n = read(fatfd, buffer+done, size-done);
+      countIO(&stats.fat, 1, n > 0 ? n : 0, 0);
+      if(n == -1 && errno == EINTR) continue;
+      if(n == -1) perror("readStream");
+      if(n <= 0) break;
+      done += n;
+   }
+   streamPos += done;
+   return(done);
+}
+
+/*-----------------------------------------------------------------
+Function: readStreamRegion
+
+Parameters:  see readFatRegion
+
+Returns:  address of the data - in memory for the boot sector, FAT
+          tables and root directory, otherwise buffer.
+          NULL - error (the region was passed and not held, or the
+	  stream ended)
+
+Description: Reads a region of a streamed FAT file system.  Each
+             cluster of the region is taken from the held clusters,
+	     or from the stream after advancing it to the cluster.
+	     A held cluster is released once read up to its end:
+	     every cluster is read once (a directory during the scan,
+	     a file in the data pass).
+-----------------------------------------------------------------*/
+char *readStreamRegion(off_t offset, int size, char *buffer)
+{
+   off_t pos;  // position of the next byte to copy
+   int cluster, within;  // cluster of pos and position in the cluster
+   int n;  // number of bytes from the cluster
+   int done;
+   char *data;  // held cluster
+
+   if(offset >= 0 && offset+size <= streamHeadSize) return(streamHead+offset);
+   if(offset < DATA_POS)
+   {
+      fprintf(stderr,"readFatRegion: region across the data area of the FAT stream\n");
+      return(NULL);
+   }
+   pthread_mutex_lock(&streamLock);
+   for(done=0 ; done<size ; done+=n)
+   {
+      pos = offset+done;
+      cluster = (pos-DATA_POS)/CLUSTER_SIZE + 2;
+      within = (pos-DATA_POS)%CLUSTER_SIZE;
+      n = CLUSTER_SIZE-within;
+      if(n > size-done) n = size-done;
+      if(cluster >= NUM_FAT_ENTRIES) break;
+      if((data = findHeldCluster(cluster)) == NULL && advanceStream(cluster) == OK)
+      {
+         if(within == 0 && n == CLUSTER_SIZE)  // straight from the stream
+         {
+            if(readStream(buffer+done, n) != n) break;
+            continue;
+         }
+         if((data = holdCluster(cluster)) == NULL) { perror("readFatRegion"); break; }
+         if(readStream(data, CLUSTER_SIZE) != CLUSTER_SIZE)
+         {
+            releaseCluster(cluster);
+            break;
+         }
+      }
+      if(data == NULL)
+      {
+         fprintf(stderr,"readFatRegion: cluster %d already passed in the FAT stream\n", cluster);
+         break;
+      }
+      memcpy(buffer+done, data+within, n);
+      if(within+n == CLUSTER_SIZE) releaseCluster(cluster);
+   }
+   if(heldBytes > maxHeldBytes) maxHeldBytes = heldBytes;
+   pthread_mutex_unlock(&streamLock);
+   if(done < size) return(NULL);
+   return(buffer);
+}
+
+/*-----------------------------------------------------------------
+Function: advanceStream
+
+Parameters:  int clusterNum - cluster to reach
+
+Returns:  OK - the next cluster of the stream is clusterNum
+          ERR1 - clusterNum was passed, or the stream ended
+
+Description: Reads the clusters before clusterNum.  Those in use (or
+             wanted) are held in memory, the others are skipped.
+	     Called with streamLock.
+-----------------------------------------------------------------*/
+int advanceStream(int clusterNum)
+{
+   int c = (streamPos-DATA_POS)/CLUSTER_SIZE + 2;  // next cluster of the stream
+   char *skip = NULL;  // buffer for the clusters skipped
+   char *data;  // held cluster
+
+   if(c > clusterNum) return(ERR1);
+   for( ; c<clusterNum ; c++)
+   {
+      if(wantedClusters != NULL ? IS_WANTED(c) : fatNext(c) != 0)
+      {
+         if((data = holdCluster(c)) == NULL) { perror("advanceStream"); break; }
+         if(readStream(data, CLUSTER_SIZE) != CLUSTER_SIZE)
+         {
+            releaseCluster(c);
+            break;
+         }
+      }
+      else
+      {
+         if(skip == NULL && (skip = malloc(CLUSTER_SIZE)) == NULL)
+         {
+            perror("advanceStream");
+            break;
+         }
+         if(readStream(skip, CLUSTER_SIZE) != CLUSTER_SIZE) break;
+      }
+   }
+   free(skip);
+   if(heldBytes > maxHeldBytes) maxHeldBytes = heldBytes;
+   if(c < clusterNum)
+   {
+      fprintf(stderr,"advanceStream: FAT stream ends before cluster %d\n", clusterNum);
+      return(ERR1);
+   }
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: skipStream
+
+Parameters:  off_t size - number of bytes
+
+Returns:  OK, or ERR1 if the stream ends
+
+Description: Reads and drops the next bytes of the stream.
+-----------------------------------------------------------------*/
+int skipStream(off_t size)
+{
+   char *skip;
+   int n;
+   if(size <= 0) return(OK);
+   skip = malloc(MAX_READ_SIZE);
+   if(skip == NULL) { perror("skipStream"); return(ERR1); }
+   for( ; size > 0 ; size -= n)
+   {
+      n = size < MAX_READ_SIZE ? size : MAX_READ_SIZE;
+      if(readStream(skip, n) != n) break;
+   }
+   free(skip);
+   return(size > 0 ? ERR1 : OK);
+}
+
+/*-----------------------------------------------------------------
+Function: findHeldCluster   holdCluster   releaseCluster
+
+Parameters:  int clusterNum - cluster of the stream
+
+Returns:  findHeldCluster - data of the held cluster, NULL if not held
+          holdCluster - CLUSTER_SIZE bytes for the cluster (to be
+	                filled), NULL if there is no memory
+
+Description: The held clusters are kept in a hash table keyed by
+             cluster number, so the memory used follows the clusters
+	     held rather than the size of the FAT.  holdCluster adds
+	     a cluster (not held yet), releaseCluster frees one.
+	     Called with streamLock.
+-----------------------------------------------------------------*/
+char *findHeldCluster(int clusterNum)
+{
+   struct heldCluster *held;
+   for(held = heldClusters[clusterNum & (numHeldBuckets-1)] ; held != NULL ; held = held->next)
+      if(held->cluster == clusterNum) return(held->data);
+   return(NULL);
+}
+
+char *holdCluster(int clusterNum)
+{
+   struct heldCluster *held, **bucket;
+   if(numHeld >= 2*numHeldBuckets) growHeldClusters();  // else longer chains
+   held = malloc(sizeof(struct heldCluster) + CLUSTER_SIZE);
+   if(held == NULL) return(NULL);
+   bucket = &heldClusters[clusterNum & (numHeldBuckets-1)];
+   held->cluster = clusterNum;
+   held->next = *bucket;
+   *bucket = held;
+   numHeld++;
+   heldBytes += CLUSTER_SIZE;
+   return(held->data);
+}
+
+void releaseCluster(int clusterNum)
+{
+   struct heldCluster *held, **link;
+   link = &heldClusters[clusterNum & (numHeldBuckets-1)];
+   for( ; (held = *link) != NULL ; link = &held->next)
+      if(held->cluster == clusterNum)
+      {
+         *link = held->next;
+         free(held);
+         numHeld--;
+         heldBytes -= CLUSTER_SIZE;
+         return;
+      }
+}
+
+/*-----------------------------------------------------------------
+Function: growHeldClusters
+
+Returns:  OK, or ERR1 if there is no memory (the table is unchanged)
+
+Description: Creates the hash table of the held clusters (HELDBUCKETS
+             buckets), or doubles it and moves the clusters held.
+-----------------------------------------------------------------*/
+int growHeldClusters()
+{
+   struct heldCluster **buckets, *held, *next;
+   int num = numHeldBuckets == 0 ? HELDBUCKETS : 2*numHeldBuckets;
+   int b;
+   buckets = calloc(num, sizeof(struct heldCluster *));
+   if(buckets == NULL) return(ERR1);
+   for(b=0 ; b<numHeldBuckets ; b++)
+      for(held = heldClusters[b] ; held != NULL ; held = next)
+      {
+         next = held->next;
+         held->next = buckets[held->cluster & (num-1)];
+         buckets[held->cluster & (num-1)] = held;
+      }
+   free(heldClusters);
+   heldClusters = buckets;
+   numHeldBuckets = num;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: readFatRegion
+
+Parameters:  off_t offset - position in the FAT file system (bytes)
+             int size - number of bytes
+	     char *buffer - buffer for the data (unused when the
+	                    image is mapped, can then be NULL)
+
+Returns:  address of the data - in the mapping when the image is mapped,
+          otherwise buffer.
+          NULL - error
+
+Description: Reads a region of the FAT file system.  When the image is
+             mapped, no data is copied: the pages are prefetched with
+	     madvise(MADV_WILLNEED) and the address in the mapping is
+	     returned.  When the image is streamed, see readStreamRegion.
+	     Otherwise the region is read with a single pread (ioRead).
+-----------------------------------------------------------------*/
+char *readFatRegion(off_t offset, int size, char *buffer)
+{
+   long pageSize;
+   off_t start;
+   if(fatStream) return(readStreamRegion(offset, size, buffer));
+   if(fatMap != NULL)
    {
-      if(lseek(fatfd, DATA_POS + (clusterNum-2)*CLUSTER_SIZE, SEEK_SET)==-1)
-           perror(errorString); // seek to directory table
+      if(offset < 0 || offset+size > fatMapSize)
+      {
+         fprintf(stderr,"readFatRegion: region outside of image\n");
+         return(NULL);
+      }
+      pageSize = sysconf(_SC_PAGESIZE);
+      start = offset - offset%pageSize;  // madvise needs page alignment
+      madvise(fatMap+start, size+(offset-start), MADV_WILLNEED);
+      countIO(&stats.fat, 1, size, 0);
+      return(fatMap+offset);
    }
-   if(write(fatfd, buffer, CLUSTER_SIZE)==-1) 
+   countIO(&stats.fat, 1, size, 0);
+   TRACE_BEGIN("read FAT region", NULL);
+   if(ioRead(fatfd, buffer, size, offset) != size)
+   {
+      perror("readFatRegion");
+      buffer = NULL;
+   }
+   TRACE_END("read FAT region");
+   return(buffer);
+}
+
+/*-----------------------------------------------------------------
+Function: readFatClusters
+
+Parameters:  int clusterNum - first cluster of a physically contiguous run
+             int numClusters - number of clusters in the run
+	     char *buffer - buffer of at least numClusters*CLUSTER_SIZE bytes
+	                    (unused when the image is mapped)
+
+Returns:  address of the clusters (see readFatRegion)
+          NULL - error in reading
+
+Description: Reads a run of contiguous data clusters with a single
+             pread, so that a run costs one system call instead of
+	     a seek and a read per cluster.
+-----------------------------------------------------------------*/
+char *readFatClusters(int clusterNum, int numClusters, char *buffer)
+{
+   return(readFatRegion(DATA_POS + (off_t)(clusterNum-2)*CLUSTER_SIZE,
+                        numClusters*CLUSTER_SIZE, buffer));
+}
+
+/*-----------------------------------------------------------------
+Function: fatNext
+
+Parameters:  unsigned clusterNum - cluster of a chain
+
+Returns:  the next cluster of the chain (the entry of clusterNum in the
+          FAT table, without the reserved bits with FAT32), or fatEOF
+	  if clusterNum is outside of the table.
+
+Description: Reads an entry of the FAT table.  A FAT32 table can be
+             hundreds of Mbytes, so when it is too large to be read
+	     whole (fatPtr is NULL, see readFatTable) it is read in
+	     windows of FATWINDOW bytes, on demand; FATWINDOWS windows
+	     are kept, each in the slot of its number modulo FATWINDOWS.
+	     A chain is mostly within a window or the next, so a chain
+	     costs a read per window at most.  Called by the main
+	     thread only (the windows are not locked).
+-----------------------------------------------------------------*/
+unsigned fatNext(unsigned clusterNum)
+{
+   off_t pos;  // position of the entry in the FAT table
+   struct fatWindow *w;
+   if(clusterNum >= NUM_FAT_ENTRIES) return(fatEOF);
+   if(fatPtr != NULL)
+   {
+      if(fatType == 16) return(((unsigned short *)fatPtr)[clusterNum]);
+      return(((unsigned *)fatPtr)[clusterNum] & FAT32_MASK);
+   }
+   pos = (off_t)clusterNum*(fatType/8);
+   w = fatWindows + (pos/FATWINDOW)%FATWINDOWS;
+   if((w->entries == NULL || w->num != pos/FATWINDOW) && loadFatWindow(w, pos/FATWINDOW) == ERR1)
+      return(fatEOF);  // the chain ends there
+   if(fatType == 16) return(*(unsigned short *)(w->entries + pos%FATWINDOW));
+   return(*(unsigned *)(w->entries + pos%FATWINDOW) & FAT32_MASK);
+}
+
+/*-----------------------------------------------------------------
+Function: loadFatWindow
+
+Parameters:  struct fatWindow *w - slot for the window
+             long num - number of the window in the FAT table
+
+Returns:  OK, or ERR1 if the window cannot be read.
+-----------------------------------------------------------------*/
+int loadFatWindow(struct fatWindow *w, long num)
+{
+   off_t pos = (off_t)num*FATWINDOW;  // position in the FAT table
+   int size = FAT_SIZE-pos < FATWINDOW ? FAT_SIZE-pos : FATWINDOW;
+   w->num = -1;
+   if(w->entries == NULL && (w->entries = allocIOBuffer(FATWINDOW)) == NULL)
+   {
+      perror("loadFatWindow");
+      return(ERR1);
+   }
+   TRACE_BEGIN("read FAT window", NULL);
+   if(ioRead(fatfd, w->entries, size, FAT_POS+pos) != size)
+   {
+      perror("loadFatWindow");
+      TRACE_END("read FAT window");
+      return(ERR1);
+   }
+   TRACE_END("read FAT window");
+   countIO(&stats.fat, 1, size, 0);
+   w->num = num;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: getFatExtents
+
+Parameters:  unsigned startCluster - first cluster of the file
+
+Returns:  FATEXTENTS * - extent index of the file (free with freeFatExtents)
+          NULL - error or empty chain
+
+Description: Walks the cluster chain of a file once in the FAT table
+             and records it as runs of physically contiguous
+	     clusters (start cluster, length).  The logical cluster
+	     number of the first cluster of each run is kept so that
+	     findFatCluster can locate any cluster with a binary search
+	     instead of walking the chain again.
+-----------------------------------------------------------------*/
+FATEXTENTS *getFatExtents(unsigned startCluster)
+{
+   FATEXTENTS *ext;
+   struct fatExtent *tmp;
+   int maxExtents = 16;  // grows as needed
+   unsigned clusterNum = startCluster;
+   int count;  // guards against loops in a damaged FAT
+
+   if(IS_LAST_CLUSTER(startCluster)) return(NULL);  // no content
+   ext = malloc(sizeof(FATEXTENTS));
+   if(ext == NULL) { perror("getFatExtents"); return(NULL); }
+   ext->extents = malloc(maxExtents*sizeof(struct fatExtent));
+   if(ext->extents == NULL)
+   {
+      perror("getFatExtents");
+      free(ext);
+      return(NULL);
+   }
+   ext->numExtents = 0;
+   ext->numClusters = 0;
+   for(count = 0 ; !IS_LAST_CLUSTER(clusterNum) && count < NUM_FAT_ENTRIES ; count++)
+   {
+      if(ext->numExtents > 0 &&
+         ext->extents[ext->numExtents-1].start +
+	 ext->extents[ext->numExtents-1].length == clusterNum)
+         ext->extents[ext->numExtents-1].length++;  // extends the current run
+      else
+      {
+         if(ext->numExtents == maxExtents)  // need more room
+         {
+            maxExtents *= 2;
+            tmp = realloc(ext->extents, maxExtents*sizeof(struct fatExtent));
+            if(tmp == NULL) { perror("getFatExtents"); break; }
+            ext->extents = tmp;
+         }
+         ext->extents[ext->numExtents].start = clusterNum;
+         ext->extents[ext->numExtents].length = 1;
+         ext->extents[ext->numExtents].logical = ext->numClusters;
+         ext->numExtents++;
+      }
+      ext->numClusters++;
+      clusterNum = fatNext(clusterNum);  // next cluster in the chain
+   }
+   return(ext);
+}
+
+/*-----------------------------------------------------------------
+Function: freeFatExtents
+
+Parameters:  FATEXTENTS *ext - extent index from getFatExtents
+
+Description: Releases the memory of an extent index.
+-----------------------------------------------------------------*/
+void freeFatExtents(FATEXTENTS *ext)
+{
+   if(ext != NULL)
+   {
+      free(ext->extents);
+      free(ext);
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: findFatCluster
+
+Parameters:  FATEXTENTS *ext - extent index of the file
+             int logicalCluster - cluster number within the file
+
+Returns:  physical cluster number
+          ERR1 - past the end of the file
+
+Description: Maps a logical cluster number to its physical cluster
+             with a binary search over the runs of the file.
+-----------------------------------------------------------------*/
+int findFatCluster(FATEXTENTS *ext, int logicalCluster)
+{
+   int lo = 0, hi, mid;
+
+   if(ext == NULL || logicalCluster < 0 || logicalCluster >= ext->numClusters)
+      return(ERR1);
+   hi = ext->numExtents - 1;
+   while(lo < hi)  // find last run starting at or before logicalCluster
    {
-       perror(errorString); // seek to directory table
+      mid = (lo + hi + 1)/2;
+      if(ext->extents[mid].logical <= logicalCluster) lo = mid;
+      else hi = mid - 1;
    }
+   return(ext->extents[lo].start + (logicalCluster - ext->extents[lo].logical));
 }
 
 /*-----------------------------------------------------------------
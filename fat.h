@@ -7,7 +7,16 @@
 #include "fatDefn.h"
 // Add external references
 extern struct fat_boot_sector fbs;  // FAT Boot Sector
-extern unsigned short *fatPtr;  // pointer to the FAT Table
+extern void *fatPtr;  // FAT Table in memory (NULL: read in windows, see fatNext)
+extern int fatType;  // 16 or 32
+extern unsigned fatLength;  // sectors per FAT table
+extern unsigned numFatClusters;  // number of data clusters
+extern unsigned fatRootCluster;  // first cluster of the FAT32 root directory
+extern unsigned fatEOF;  // smallest end of chain value
+extern unsigned fatLastCluster;  // last cluster indicator
+extern off_t fatPos, rootDirPos, dataPos;  // positions of the regions
 extern int fatfd;  // File descriptor for FAT file system
+extern char *fatMap;  // FAT file system mapped in memory (NULL if not mapped)
+extern int fatStream;  // TRUE if the FAT file system is read from a stream
 
 #endif
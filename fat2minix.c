@@ -5,36 +5,83 @@ Description: This file contains code for reading the minix
 
 	     Synopsis:
 
-	     fat2minix <fat dev file> <minix dev file>
+	     fat2minix [-m] [-M] [-j N] [-p DEPTH] [-u DEPTH] [-b KB] [-t] [-c]
+	               [-q | -v] [--direct] [--stats=json] [--trace=FILE]
+		       <fat dev file> <minix dev file>
 
 	     where <fat dev file> is the device file that contains the
-	     FAT file system (example /dev/hdb1) with content.
+	     FAT16 or FAT32 file system (example /dev/hdb1) with content, or -
+	     to read the FAT file system from the standard input (a
+	     pipe) in a single pass (this implies -t; the first FAT
+	     table is kept whole in memory, and the clusters passed
+	     over until they are read).
 
 	     and <minix dev file> contains the empty minix file system.
+
+	     -m  map the FAT file system in memory (mmap) and read
+	         everything from the mapping.
+	     -M  map the Minix file system in memory (mmap) and update
+	         it in place, flushed once when the file system is closed.
+	     -j N  copy the contents of the files with N worker threads
+	         while the directories are converted.
+	     -p DEPTH  copy the contents of the files with a reader thread
+	         and a writer thread that pass DEPTH buffers to each other.
+	     -u DEPTH  copy the contents of the files with io_uring, with
+	         DEPTH buffers in flight.
+	     -b KB  size of the buffers for reading clusters in Kbytes.
+	     -t  two-phase conversion: convert the directories first,
+	         then copy the contents of all files in the order of
+	         their clusters (any of -j, -p, -u can be used for that).
+	     -c  copy the contents of the files with copy_file_range,
+	         without reading them (with -j or on its own).
+	     -q  quiet: print only the errors.
+	     -v  verbose: print every directory and file converted, the
+	         FAT boot sector and the Minix super block (by default
+		 only the settings, a progress line every second and
+		 the summaries are printed, see log.h).
+	     --direct  open both file systems with O_DIRECT, so that
+	         the conversion does not fill the page cache.
+	     --stats=json  print the counters of the conversion (system
+	         calls, bytes read and written, seeks, bit map words
+		 scanned, inodes, indirect blocks, directory tables) and
+		 the wall time of each phase as JSON at exit (see stats.h).
+	     --trace=FILE  record a timeline of the conversion in FILE
+	         (Chrome trace-event format, see trace.h); only when
+		 built with make TRACE=-DTRACE.
 Student Name:
 Student Number:
 ------------------------------------------------------------------*/
 #include 	"fat2minix.h"
 #include 	"fat.h"
 #include 	"minix.h"
+#include 	"copy.h"
+#include 	"dio.h"
+#include 	"stats.h"
+#include 	"trace.h"
+#include 	"log.h"
 /*----------------------------------------------
 The following global variables are accessed.
 (defined in the fat.c module, see also fat.h)
 They are initialised by readFatBoot
 struct fat_boot_sector fbs;  // FAT Boot Sector
-unsigned short *fatPtr;  // pointer to the FAT Table
+void *fatPtr;  // pointer to the FAT Table (read with fatNext)
 int fatfd;  // File descriptor for FAT file system
 --------------------------------------------------------*/ 
+int numDirsMade = 0;  // directories created (progress lines)
+int numFilesMade = 0;  // files created
+int numErrors = 0;  // errors in the conversion (main then returns ERR1)
 // Function Prototypes
 int copyFatDir(void);
-void copyDirEntries(char *, struct msdos_dir_entry *, int);
-void processSubDirectory(struct msdos_dir_entry *, char *);
+void copyDirEntries(MINIXDIR *, struct msdos_dir_entry *, int);
+void processSubDirectory(struct msdos_dir_entry *, MINIXDIR *);
+void copyDirClusters(MINIXDIR *, unsigned);
+int openImage(char *, int, int);
 // Three functions to complete
-void createMinixDir(struct dentry *, char *,struct msdos_dir_entry *);
-void createMinixFile(struct dentry *, struct msdos_dir_entry *);
-void addContentsToMinix(struct msdos_dir_entry *, struct minix_inode *);
+int createMinixDir(struct dentry *, char *,struct msdos_dir_entry *);
+int createMinixFile(struct dentry *, struct msdos_dir_entry *);
+COPYJOB *addContentsToMinix(struct msdos_dir_entry *, struct minix_inode *);
 // Some utility functions
-char *getFatDataBlock(int, int , char *);
+char *getFatDataBlock(int, FATEXTENTS *, char *);
 unsigned getMinixTimeFromFat(struct msdos_dir_entry *);
 
 /*-----------------------------------------------------------------
@@ -44,54 +91,217 @@ Parameters: int argc - number of command line arguments
 	   char **argv - pointers to command line arguments
 
 Description: 
-	Command synopsis: fat2minix <fat file> <minix file>
+	Command synopsis: fat2minix [-m] [-M] [-j N] [-p DEPTH] [-u DEPTH] [-b KB]
+	                            [-t] [-c] [-q | -v] [--direct] [--stats=json]
+				    [--trace=FILE] <fat file> <minix file>
+	-m map the FAT file system in memory instead of reading it.
+	-M map the Minix file system in memory instead of reading/writing it.
+	-j N copy file contents with N worker threads (default 0: the
+	     contents are copied as each file is created).
+	-p DEPTH copy file contents with a reader/writer pipeline of
+	     DEPTH buffers (instead of the worker threads).
+	-u DEPTH copy file contents with io_uring with DEPTH buffers in
+	     flight (instead of threads, if io_uring is available).
+	-b KB size of the read buffers in Kbytes (default 64).
+	-t (--two-phase) copy file contents after all directories are
+	     converted, reading the FAT data area in cluster order.
+	-c (--copy-range) copy file contents in the kernel with
+	     copy_file_range (blocks of zeros are then written).
+	-q (--quiet) print the errors only.
+	-v (--verbose) also print each directory and file created.
+	--direct bypass the page cache (O_DIRECT) for both file systems.
+	--stats=json print the counters and the time of each phase (load,
+	     traverse, copy, flush) as JSON at exit.
+	--trace=FILE write a trace of the conversion to FILE (tracing builds).
 	<fat file> is the filename of the hard drive partition where
-	       the FAT physical file system is located.
+	       the FAT physical file system is located, or - for the
+	       standard input (streamed in one pass, implies -t, keeps
+	       one FAT table in memory).
 	<minix file> is the filename of the hard drive partition where
 	       the minix physical file system is located.
+	Built with -DNO_MAIN, the module has no main (bench/microbench.c
+	calls its functions).
+
+Returns: OK, or ERR1 if anything could not be converted (errors
+         are counted in numErrors).
 ------------------------------------------------------------------*/
+#ifndef NO_MAIN
 int main(int argc, char **argv)
 {
    int fd1;   /* file descriptor for minix file system */
    int fd2;   /* file descriptor for FAT file system */
-
-   if(argc != 3)
+   int mapFat = FALSE;  /* -m: map the FAT file system */
+   int mapMinix = FALSE;  /* -M: map the Minix file system */
+   struct copyOptions copy = {0};  /* -j -p -u -b -t -c: how to copy files */
+   int direct = FALSE;  /* --direct: use O_DIRECT */
+   int printStats = FALSE;  /* --stats=json: print the counters */
+   char *traceName = NULL;  /* --trace=FILE: file for the trace */
+   int minixOpen = FALSE;  /* TRUE once initMinixFS succeeded */
+   static struct option longOptions[] =
+   {
+      {"direct", no_argument, NULL, 'D'},
+      {"stats", required_argument, NULL, 'S'},
+      {"trace", required_argument, NULL, 'T'},
+      {"two-phase", no_argument, NULL, 't'},
+      {"copy-range", no_argument, NULL, 'c'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0}
+   };
+   char *end;
+   int opt;
+
+   while((opt = getopt_long(argc, argv, "mMj:p:u:b:tcqv", longOptions, NULL)) != -1)
    {
-      printf("Usage: fat2minix <fat device> <minix device>\n");
+      if(opt == 'm') mapFat = TRUE;
+      else if(opt == 'M') mapMinix = TRUE;
+      else if(opt == 'j')
+      {
+         copy.numThreads = strtol(optarg, &end, 10);
+         if(*end != '\0' || copy.numThreads < 0) argc = 0;
+      }
+      else if(opt == 'p')
+      {
+         copy.ringDepth = strtol(optarg, &end, 10);
+         if(*end != '\0' || copy.ringDepth < 1) argc = 0;
+      }
+      else if(opt == 'u')
+      {
+         copy.uringDepth = strtol(optarg, &end, 10);
+         if(*end != '\0' || copy.uringDepth < 1) argc = 0;
+      }
+      else if(opt == 't') copy.twoPhase = TRUE;
+      else if(opt == 'c') copy.copyRange = TRUE;
+      else if(opt == 'q') logLevel = LOG_ERROR;
+      else if(opt == 'v') logLevel = LOG_DEBUG;
+      else if(opt == 'D') direct = TRUE;
+      else if(opt == 'S')
+      {
+         printStats = TRUE;
+         if(strcmp(optarg, "json") != 0) argc = 0;
+      }
+      else if(opt == 'T') traceName = optarg;
+      else if(opt == 'b')
+      {
+         copy.bufferSize = strtol(optarg, &end, 10)*1024;
+         if(*end != '\0' || copy.bufferSize < 1) argc = 0;
+      }
+      else argc = 0;  // forces the usage message
+   }
+   if(argc - optind != 2)
+   {
+      printf("Usage: fat2minix [-m] [-M] [-j N] [-p DEPTH] [-u DEPTH] [-b KB] [-t] [-c] [-q | -v]\n"
+             "                 [--direct] [--stats=json] [--trace=FILE] <fat device> <minix device>\n"
+             "<fat device> may be - for the standard input (keeps one FAT table in memory)\n");
       return(ERR1);
    }
+   argv += optind-1;  // argv[1] and argv[2] are the devices
+   if(traceName != NULL)
+   {
+#ifdef TRACE
+      if(startTrace(traceName) == ERR1) return(ERR1);
+#else
+      logPrintf(LOG_INFO, "Built without tracing (make TRACE=-DTRACE) - no trace written\n");
+#endif
+   }
+   startLogger();  // messages printed at once if it cannot start
+   enterPhase(PHASE_LOAD);
    
-   fd2 = open(argv[1],O_RDONLY);  /* open FAT fs for reading */
+   if(strcmp(argv[1], "-") == 0)  /* stream the FAT fs from standard input */
+   {
+      fd2 = STDIN_FILENO;
+      if(streamFatImage(fd2) == ERR1)
+      {
+         logPrintf(LOG_ERROR, "Could not stream the FAT file system from the standard input\n");
+         stopLogger();
+         return(ERR1);
+      }
+      mapFat = FALSE;
+      copy.twoPhase = TRUE;  // files are copied once all clusters are known
+   }
+   else fd2 = openImage(argv[1],O_RDONLY,direct);  /* open FAT fs for reading */
    if(fd2 == -1)
    {
-      printf("Could not open %s\n",argv[1]);
+      logPrintf(LOG_ERROR, "Could not open %s\n",argv[1]);
+      stopLogger();
       return(ERR1);
    }
 
-   fd1 = open(argv[2],O_RDWR);  /* open minix fs for reading and writing */
+   fd1 = openImage(argv[2],O_RDWR,direct);  /* open minix fs for reading and writing */
    if(fd1 == -1)
    {
       close(fd2);
-      printf("Could not open %s\n",argv[1]);
+      logPrintf(LOG_ERROR, "Could not open %s\n",argv[2]);
+      stopLogger();
       return(ERR1);
    }
 
+   if(mapFat && mapFatImage(fd2) == ERR1)
+      logPrintf(LOG_INFO, "Could not map %s - reading it instead\n",argv[1]);
+   if(mapMinix && mapMinixImage(fd1) == ERR1)
+      logPrintf(LOG_INFO, "Could not map %s - reading/writing it instead\n",argv[2]);
    if(readFatBoot(fd2) == ERR1)
-   {
-      printf("Error in reading FAT Boot Sector or FAT Table - terminating\n");
-   }
+      logPrintf(LOG_ERROR, "Error in reading FAT Boot Sector or FAT Table - terminating\n");
    else if(initMinixFS(fd1) == ERR1)
+      logPrintf(LOG_ERROR, "Error in initiallising Minix file system - terminating\n");
+   else minixOpen = TRUE;
+   if(!minixOpen) numErrors++;
+   else if(startCopyWorkers(&copy) == ERR1)
    {
-      printf("Error in initiallising Minix file system - terminating\n");
+      logPrintf(LOG_ERROR, "Could not start copying files - terminating\n");
+      numErrors++;
    }
    else
    {
-      printf("Scanning the FAT Directory\n");
-      copyFatDir(); 
+      logPrintf(LOG_INFO, "Scanning the FAT Directory\n");
+      enterPhase(PHASE_TRAVERSE);
+      if(copyFatDir() == ERR1) numErrors++;
+      enterPhase(PHASE_COPY);
+      if(finishCopyJobs() == ERR1) numErrors++;  // all contents copied before closing
+      logPrintf(LOG_INFO, "Converted %d directories and %d files\n", numDirsMade, numFilesMade);
    }
+   unmapFatImage();
+   endFatStream();
    close(fd2);
-   closeMinixFS();
-   return(OK);
+   enterPhase(PHASE_FLUSH);
+   if(!minixOpen) close(fd1);  // nothing to save
+   else if(closeMinixFS() == ERR1) numErrors++;
+   enterPhase(NUM_PHASES);
+#ifdef TRACE
+   endTrace();
+#endif
+   if(numErrors > 0) logPrintf(LOG_ERROR, "Conversion failed (%d errors)\n", numErrors);
+   stopLogger();  // messages printed before the counters
+   if(printStats) printStatsJson(stdout);
+   return(numErrors > 0 ? ERR1 : OK);
+}
+#endif
+
+/*-----------------------------------------------------------------
+Function: openImage
+
+Parameters: char *name - file name of the file system
+            int flags - O_RDONLY or O_RDWR
+            int direct - TRUE to open with O_DIRECT
+
+Returns: file descriptor, or -1 on error.
+
+Description: Opens a file system.  With direct, the file is opened with
+             O_DIRECT and the alignment it needs is recorded (see dio.c);
+	     a file that does not support O_DIRECT is opened normally.
+-----------------------------------------------------------------*/
+int openImage(char *name, int flags, int direct)
+{
+   int fd = -1;
+   if(direct)
+   {
+      fd = open(name, flags|O_DIRECT);
+      if(fd != -1 && setDirectIO(fd) == ERR1) { close(fd); fd = -1; errno = EINVAL; }
+      if(fd == -1 && errno == EINVAL)
+         logPrintf(LOG_INFO, "%s does not support O_DIRECT - using the page cache\n", name);
+      else return(fd);
+   }
+   return(open(name, flags));
 }
 
 /*-----------------------------------------------------------------
@@ -107,34 +317,63 @@ Description: Copies the contents of the FAT directory to the Minix
              directory. This function reads in the FAT root directory
              and calls the recursive routine copyDirEntries to recurse
              down the FAT directory structure for copying to the
-	     Minix file system.
+	     Minix file system.  The FAT32 root directory is a chain of
+	     clusters like any subdirectory (see copyDirClusters).
 -----------------------------------------------------------------*/
 int copyFatDir()
 {
    // Config info from the boot sector
-   int sectorSize = (*(short *)fbs.sector_size); // in bytes
    int maxRootEntries = *(short *) fbs.dir_entries; // number of directory entries
    int rootDirSize = sizeof(struct msdos_dir_entry)*maxRootEntries; // in bytes
-   // allocate memory to store root directory
-   struct msdos_dir_entry *rootdir = (struct msdos_dir_entry *) malloc(rootDirSize); 
-   if(rootdir == NULL)
+   struct msdos_dir_entry *rootdir;
+   MINIXDIR *minixRoot;  // Minix root directory
+   // allocate memory to store root directory (not used if the image is mapped)
+   char *buffer = NULL;
+   if(fatType == 32)
    {
-      perror("copyFatDir-malloc");
-      return(ERR1);
+      minixRoot = openMinixDir("/");
+      if(minixRoot == NULL)
+      {
+         logPrintf(LOG_ERROR, "Error in opening minix directory /\n");
+         return(ERR1);
+      }
+      TRACE_BEGIN("directory", "/");
+      copyDirClusters(minixRoot, fatRootCluster);
+      closeMinixDir(minixRoot);
+      TRACE_END("directory");
+      return(OK);
+   }
+   if(fatMap == NULL)
+   {
+      buffer = allocIOBuffer(rootDirSize); 
+      if(buffer == NULL)
+      {
+         perror("copyFatDir-malloc");
+         return(ERR1);
+      }
    }
    // Read in root directory
-   lseek(fatfd,sectorSize*(1+fbs.fats*fbs.fat_length) ,SEEK_SET);
-   read(fatfd, rootdir, rootDirSize);
+   rootdir = (struct msdos_dir_entry *) readFatRegion(ROOTDIR_POS, rootDirSize, buffer);
+   STAT_ADD(stats.fat.dirLoads, 1);
+   // Open the Minix root directory
+   minixRoot = openMinixDir("/");
+   if(minixRoot == NULL) logPrintf(LOG_ERROR, "Error in opening minix directory /\n");
    // Loop through the root directory
-   copyDirEntries("/", rootdir, maxRootEntries);   // note that rootdir represents an address
-   free(rootdir);  // free the allocated memory
-   return(OK);
+   else if(rootdir != NULL)
+   {
+      TRACE_BEGIN("directory", "/");
+      copyDirEntries(minixRoot, rootdir, maxRootEntries);   // note that rootdir represents an address
+      closeMinixDir(minixRoot);
+      TRACE_END("directory");
+   }
+   free(buffer);  // free the allocated memory
+   return(rootdir == NULL ? ERR1 : OK);
 }
 
 /*-----------------------------------------------------------------
 Function: copyDirEntries
 
-Parameters: char *name - name of directory
+Parameters: MINIXDIR *dir - open Minix directory
             struct msdos_dir_entry *dirTblPtr - pointer to a directory Table
 	                                        consists of an array pointers to structures
             int numEntries - number of entries in the directory table
@@ -145,9 +384,10 @@ Description: Recursive function that copies files and directories to the
 	     processSubDirectory that calls copyDirEntries. 
 
 	     The perspective of this function is to scan a single FAT directory
-	     table.  It opens the corresponding Minix directory (using the name
-	     parameter) which should be empty. As files and subdirectories are
-	     created, the Minix directory table is updated.
+	     table.  The corresponding Minix directory is already open (dir)
+	     and is carried from the parent, so no path is resolved. As files
+	     and subdirectories are created, the Minix directory table is
+	     updated; the caller closes the directory.
 	     
 	     Two main loops are used in this function.  The first run through the 
 	     the FAT directory table calling creatMinixDir and creatMinixFile for 
@@ -166,75 +406,79 @@ Description: Recursive function that copies files and directories to the
                gives the value of the element, the expression
                is equivalent to *(dirTblPtr+i).
 -----------------------------------------------------------------*/
-void copyDirEntries(char *name, struct msdos_dir_entry *dirTblPtr, int numEntries)
+void copyDirEntries(MINIXDIR *dir, struct msdos_dir_entry *dirTblPtr, int numEntries)
 {
     int i;
-    struct dentry *minixDirTable;
+    struct dentry *entry;  // new entry in the Minix directory table
     char filename[100];
-    int numRecords;
-    struct minix_inode ino;
-    int inodeNum;
-    int parentInodeNum;
-
-    // Open the Minix Directory
-    minixDirTable = openMinixDirectory(name,&numRecords, &inodeNum, &parentInodeNum, &ino);
-    if(minixDirTable == NULL) printf("Error in opening minix directory %s\n", name);
-    else
+
+    TRACE_BEGIN("copyDirEntries", NULL);
+    // Loop through the directory table and add entries
+    for(i = 0 ; i < numEntries; i++)
     {
-       // Loop through the directory table and add entries
-       for(i = 0 ; i < numEntries; i++)
+       if(dirTblPtr[i].attr == (char)0x0f)  // 0xf indicates LFN name
+           /* Ignore - not used in this assignment */;
+       else if(dirTblPtr[i].name[0]==(char)0x00) { }   // available
+       else if(dirTblPtr[i].name[0]==(char)0x05) { }   // deleted
+       else if(dirTblPtr[i].name[0]==(char)0xE5) { }   // deleted
+       else if(findMinixDirEntry(dir, getFatName(dirTblPtr+i, filename)) != ERR1)
+       {
+          logPrintf(LOG_ERROR, "Duplicate name >%s< - ignored\n", filename);
+          numErrors++;
+       }
+       else if((entry = newMinixDirEntry(dir)) == NULL)  // table full
+       {
+          numErrors++;
+          break;
+       }
+       else if(dirTblPtr[i].name[0]==(char)0x2E ||     // dot or dotdot
+               dirTblPtr[i].attr&ATTR_DIR)             // directory - assume name with no extension
        {
-          if(dirTblPtr[i].attr == (char)0x0f)  // 0xf indicates LFN name
-	      /* Ignore - not used in this assignment */;
-          else if(dirTblPtr[i].name[0]==(char)0x00) { }   // available
-          else if(dirTblPtr[i].name[0]==(char)0x05) { }   // deleted
-          else if(dirTblPtr[i].name[0]==(char)0xE5) { }   // deleted
-          else if(dirTblPtr[i].name[0]==(char)0x2E ||     // dot or dotdot
-                  dirTblPtr[i].attr&ATTR_DIR)             // directory - assume name with no extension
+          if(strcmp(".",filename) == 0)  // only need to update Minix dir table
+          {
+            entry->ino = dir->inoNum;
+            strcpy(entry->name,".");
+          }
+          else if(strcmp("..",filename) == 0)  // only need to update Minix dir table
           {
-             if(getFatName(dirTblPtr+i, filename) != NULL)
-	     {
-	        if(strcmp(".",filename) == 0)  // only need to update Minix dir table
-	        {
-	          minixDirTable[numRecords].ino = inodeNum;
-		  strcpy(minixDirTable[numRecords].name,".");
-	        }
-	        else if(strcmp("..",filename) == 0)  // only need to update Minix dir table
-	        {
-	          minixDirTable[numRecords].ino = parentInodeNum;
-		  strcpy(minixDirTable[numRecords].name,"..");
-	        }
-	        else createMinixDir(minixDirTable+numRecords,   
-		                    filename,dirTblPtr+i);
-	     }
-             numRecords++; // increase number of records
-	     ino.i_nlinks++; // increase number of sub-directories
-	     ino.i_size += sizeof(struct dentry); // increase size of directory table
+            entry->ino = dir->parentInoNum;
+            strcpy(entry->name,"..");
           }
-          else // Assume a file - first char in name is not one of the above values and
+          else if(createMinixDir(entry, filename, dirTblPtr+i) == ERR1)
           {
-             // ATTR_DIR does not have directory bit set
-	     createMinixFile(minixDirTable+numRecords,dirTblPtr+i);
-             numRecords++; // increase number of records
-	     ino.i_size += sizeof(struct dentry); // increase size of directory table
+             dropMinixDirEntry(dir);  // no inode or data block
+             numErrors++;
+             continue;
           }
+          dir->ino.i_nlinks++; // increase number of sub-directories
+          dir->ino.i_size += sizeof(struct dentry); // increase size of directory table
        }
-       closeMinixDirectory(minixDirTable, numRecords, inodeNum, &ino);
-
-       // Now recurse into subdirectories by calling processSubDirectory
-       // that will call copyDirEntries
-       for(i = 0 ; i < numEntries; i++)
+       else // Assume a file - first char in name is not one of the above values and
        {
-          if(dirTblPtr[i].attr == (char)0x0f)  // 0xf indicates LFN name
-	        /* ignore no long directory names */; 
-          else if(dirTblPtr[i].name[0]==(char)0x00) { }   // available
-          else if(dirTblPtr[i].name[0]==(char)0x05) { }   // deleted
-          else if(dirTblPtr[i].name[0]==(char)0xE5) { }   // deleted
-          else if(dirTblPtr[i].name[0]==(char)0x2E) { }// dot or dotdot
-          else if(dirTblPtr[i].attr&ATTR_DIR)  // Directory
-             processSubDirectory(dirTblPtr+i, name); // recursion - will call copyDirEntries
+          // ATTR_DIR does not have directory bit set
+          if(createMinixFile(entry, dirTblPtr+i) == ERR1)
+          {
+             dropMinixDirEntry(dir);  // no inode
+             numErrors++;
+          }
+          else dir->ino.i_size += sizeof(struct dentry); // increase size of directory table
        }
     }
+
+    // Now recurse into subdirectories by calling processSubDirectory
+    // that will call copyDirEntries
+    for(i = 0 ; i < numEntries; i++)
+    {
+       if(dirTblPtr[i].attr == (char)0x0f)  // 0xf indicates LFN name
+           /* ignore no long directory names */; 
+       else if(dirTblPtr[i].name[0]==(char)0x00) { }   // available
+       else if(dirTblPtr[i].name[0]==(char)0x05) { }   // deleted
+       else if(dirTblPtr[i].name[0]==(char)0xE5) { }   // deleted
+       else if(dirTblPtr[i].name[0]==(char)0x2E) { }// dot or dotdot
+       else if(dirTblPtr[i].attr&ATTR_DIR)  // Directory
+          processSubDirectory(dirTblPtr+i, dir); // recursion - will call copyDirEntries
+    }
+    TRACE_END("copyDirEntries");
 }
 
 /*-----------------------------------------------------------------
@@ -242,50 +486,80 @@ Function: processSubDirectory
 
 Parameters: struct msdos_dir_entry *de - pointer to a directory entry
                                         that references sub-directory
-            char *curMinixPath - current path to subdirectory
+            MINIXDIR *parent - open Minix directory containing the
+	                       subdirectory
 
 Global Variables:
        int fd;  // the file system file descriptor
        struct fat_boot_sector fbs;  // FAT Boot Sector
-       unsigned short *fatPtr;  // pointer to the FAT Table
+       void *fatPtr;  // pointer to the FAT Table
 
 
-Description: Displays the contents of the directory entry
+Description: Copies the contents of a FAT subdirectory.  The Minix
+             subdirectory is opened once from its parent and kept open
+	     while each cluster of the FAT directory is copied.
 -----------------------------------------------------------------*/
-void processSubDirectory(struct msdos_dir_entry *de, char *curMinixPath)
+void processSubDirectory(struct msdos_dir_entry *de, MINIXDIR *parent)
 {
    char fatName[100];
-   char minixName[100];
-   unsigned short clusterNum;  // current cluster number
-   // Get config values from boot sector
-   int sectorSize = (*(short *)fbs.sector_size); // in bytes
-   int maxRootEntries = *(short *) fbs.dir_entries; // number of entries
-   int clusterSize = sectorSize * fbs.cluster_size; // in bytes
-   // number of subdirectories in the cluster
-   int numSubDirEntries = clusterSize/sizeof(struct msdos_dir_entry);
-   struct msdos_dir_entry subDir[numSubDirEntries];  // sub directory table
-   int flag;               // to control reading clusters
-   // offset before FAT data region (in bytes)
-   int toFATDataRegion = (1 + fbs.fat_length*(fbs.fats)) * sectorSize + 
-                      (maxRootEntries*sizeof(struct msdos_dir_entry));
-   // Build the name of the directory
+   MINIXDIR *dir;  // the Minix subdirectory
+   // Open the Minix directory
    getFatName(de,fatName); 
-   if(strcmp(curMinixPath,"/")==0) sprintf(minixName,"/%s",fatName);
-   else sprintf(minixName,"%s/%s",curMinixPath,fatName);
+   dir = openMinixSubDir(parent, fatName);
+   if(dir == NULL)
+   {
+      logPrintf(LOG_ERROR, "Error in opening minix directory %s\n", fatName);
+      numErrors++;
+      return;
+   }
+   TRACE_BEGIN("directory", fatName);
+   copyDirClusters(dir, FAT_START(de));
+   closeMinixDir(dir);
+   TRACE_END("directory");
+}
+
+/*-----------------------------------------------------------------
+Function: copyDirClusters
+
+Parameters: MINIXDIR *dir - open Minix directory
+            unsigned clusterNum - first cluster of the FAT directory
+
+Description: Copies each cluster of a FAT directory table to the
+             Minix directory, following the chain of clusters in the
+	     FAT table (see fatNext).
+-----------------------------------------------------------------*/
+void copyDirClusters(MINIXDIR *dir, unsigned clusterNum)
+{
+   // number of subdirectories in the cluster
+   int numSubDirEntries = CLUSTER_SIZE/sizeof(struct msdos_dir_entry);
+   struct msdos_dir_entry *subDir;  // sub directory table
+   // buffer for the table (not used if the image is mapped)
+   char *buffer = NULL;
+   int count;  // guards against loops in a damaged FAT
    // Setup a cluster
-   flag = TRUE; // keep reading clusters
-   // Read all sectors of the directory using FAT table
-   clusterNum = de->start;  // first cluster
-   while(flag)
+   if(fatMap == NULL)
+   {
+      buffer = allocIOBuffer(CLUSTER_SIZE);
+      if(buffer == NULL)
+      {
+         perror("copyDirClusters");
+         numErrors++;
+         return;
+      }
+   }
+   // Read all clusters of the directory using FAT table
+   for(count = 0 ; !IS_LAST_CLUSTER(clusterNum) && count < NUM_FAT_ENTRIES ; count++)
    {
-     lseek(fatfd, (clusterNum-2)*clusterSize + toFATDataRegion, SEEK_SET);
-     if(read(fatfd, subDir, clusterSize)>0)  // reads the cluster
+     subDir = (struct msdos_dir_entry *) readFatClusters(clusterNum, 1, buffer);
+     STAT_ADD(stats.fat.dirLoads, 1);
+     if(subDir != NULL)  // reads the cluster
      { // not the best error checking
-          copyDirEntries(minixName, subDir, numSubDirEntries);   // note that subDir represents an address
+          copyDirEntries(dir, subDir, numSubDirEntries);   // note that subDir represents an address
      }
-     if(fatPtr[clusterNum] == fatPtr[1]) flag = FALSE; // End of the chain
-     else clusterNum = fatPtr[clusterNum]; // gets next cluster number
+     else numErrors++;
+     clusterNum = fatNext(clusterNum); // gets next cluster number
    }
+   free(buffer);
 }
 
 /*-----------------------------------------------------------------
@@ -319,15 +593,46 @@ Description: Creates a sub-directory in the Minix file system. To do this
 		     attributes will be updated by copyDirEntries when the directory is opened
 		     to add at least "." and ".." the 2 entries that should be present
 		     for all directories in the FAT directory.
+
+Returns: OK - directory created
+         ERR1 - no free inode or data block (the inode found is
+	        freed and newDirEntry is left empty).
 -----------------------------------------------------------------*/
-void createMinixDir(struct dentry *newDirEntry, char *name,
-                    struct msdos_dir_entry *fatDir) 
+int createMinixDir(struct dentry *newDirEntry, char *name,
+                   struct msdos_dir_entry *fatDir) 
 {
 
+   struct minix_inode ino;
+   short inodeNum;
+   int blockNum;
+   char zeros[BLOCK_SIZE];  // empty directory table
+
    // Some output to show progress
-   printf("Create Minix directory >%s<\n",name);
-   fflush(stdout);
-     // Complete this function
+   logPrintf(LOG_DEBUG, "Create Minix directory >%s<\n",name);
+   // Get an inode and a data block for the directory table
+   inodeNum = findFreeInode();
+   if(inodeNum == ERR1) return(ERR1);
+   blockNum = findFreeDataBlock();
+   if(blockNum == ERR1)
+   {
+      freeInode(inodeNum);
+      return(ERR1);
+   }
+   logProgress(++numDirsMade, numFilesMade);
+   memset(&ino, 0, sizeof(struct minix_inode));
+   ino.i_zone[0] = blockNum;
+   memset(zeros, 0, BLOCK_SIZE);
+   saveDataBlock(0, &ino, zeros);  // empty directory table
+   // Inode attributes - i_size and i_nlinks are updated by copyDirEntries
+   ino.i_mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+   ino.i_uid = getuid();
+   ino.i_gid = getgid();
+   ino.i_time = getMinixTimeFromFat(fatDir);
+   saveInode(inodeNum, &ino);
+   // Fill in the directory entry
+   newDirEntry->ino = inodeNum;
+   strncpy(newDirEntry->name, name, sizeof(newDirEntry->name));
+   return(OK);
 }
 
 /*-----------------------------------------------------------------
@@ -359,15 +664,48 @@ Description: Creates a file in the Minix file system. The FAT directory entry
 		     i_uid, i_gid (use getuid() and getgid()), i_time using the
                      getMinixTimeFromFat() function, i_size with size of the file,
 		     i_nlinks to 1 (only one link to the file).
+
+Returns: OK - file created (its contents may be truncated)
+         ERR1 - no free inode (newDirEntry is left empty).
 -----------------------------------------------------------------*/
-void createMinixFile(struct dentry *newDirEntry, struct msdos_dir_entry *fatDir) 
+int createMinixFile(struct dentry *newDirEntry, struct msdos_dir_entry *fatDir) 
 {
    char name[100];
+   struct minix_inode ino;
+   short inodeNum;
+   COPYJOB *job = NULL;  // contents to copy
    // Some output to show progress
    getFatName(fatDir,name);
-   printf("Create Minix File >%s<\n",name);
-   fflush(stdout);
-     // Complete this function - note that it calls addContentsToMinix
+   logPrintf(LOG_DEBUG, "Create Minix File >%s<\n",name);
+   TRACE_BEGIN("createMinixFile", name);
+   inodeNum = findFreeInode();
+   if(inodeNum == ERR1) { TRACE_END("createMinixFile"); return(ERR1); }
+   logProgress(numDirsMade, ++numFilesMade);
+   // Inode attributes
+   memset(&ino, 0, sizeof(struct minix_inode));
+   ino.i_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+   ino.i_uid = getuid();
+   ino.i_gid = getgid();
+   ino.i_time = getMinixTimeFromFat(fatDir);
+   ino.i_size = fatDir->size;
+   ino.i_nlinks = 1;
+   if(fatDir->size != 0)
+   {
+      TRACE_BEGIN("addContentsToMinix", NULL);
+      job = addContentsToMinix(fatDir, &ino);
+      TRACE_END("addContentsToMinix");
+   }
+   saveInode(inodeNum, &ino);
+   if(job != NULL)  // the copy may update the saved inode
+   {
+      job->inodeNum = inodeNum;
+      submitCopyJob(job);
+   }
+   // Fill in the directory entry
+   newDirEntry->ino = inodeNum;
+   strncpy(newDirEntry->name, name, sizeof(newDirEntry->name));
+   TRACE_END("createMinixFile");
+   return(OK);
 }
 
 /*-----------------------------------------------------------------
@@ -393,18 +731,57 @@ Description: Add the file content to the Minix file system.
 	     the indirect block (i_zone(7)). In this case it is necessary to
 	     allocate an additional data block to extend the data block index
 	     table. 
+
+	     All data blocks (and the indirect block) are allocated at once
+	     with allocFileBlocks, as one contiguous run when possible,
+	     and the indirect block is written.  The extent index of the
+	     file is built once with getFatExtents.  The contents are
+	     not copied here: a copy job is returned for submitCopyJob
+	     (copy.c), to be submitted once the inode is saved.
+
+Returns: the copy job, or NULL if there is nothing to copy.
 ----------------------------------------------------------------*/
-void addContentsToMinix(struct msdos_dir_entry *fatDir, struct minix_inode *inoPtr)
+COPYJOB *addContentsToMinix(struct msdos_dir_entry *fatDir, struct minix_inode *inoPtr)
 {
+   COPYJOB *job;
+   int numBlocks = (fatDir->size + BLOCK_SIZE - 1)/BLOCK_SIZE;
 
-     // Complete this function 
+   if(numBlocks > 7+BLOCK_SIZE/2)
+   {
+      fprintf(stderr,"File too large, double indirect block not implemented - truncated\n");
+      numErrors++;
+      numBlocks = 7+BLOCK_SIZE/2;
+      inoPtr->i_size = numBlocks*BLOCK_SIZE;
+   }
+   job = malloc(sizeof(COPYJOB));
+   if(job == NULL) { perror("addContentsToMinix"); inoPtr->i_size = 0; numErrors++; return(NULL); }
+   job->ext = getFatExtents(FAT_START(fatDir));
+   if(job->ext == NULL)
+   {
+      fprintf(stderr,"No clusters for file of size %d\n", fatDir->size);
+      inoPtr->i_size = 0;
+      numErrors++;
+      free(job);
+      return(NULL);
+   }
+   // Get all data blocks of the file, the indirect block gives blocks 7 and up
+   numBlocks = allocFileBlocks(numBlocks, inoPtr, job->zones+7);
+   memcpy(job->zones, inoPtr->i_zone, 7*sizeof(unsigned short));  // direct blocks
+   job->numBlocks = numBlocks;
+   if(numBlocks*BLOCK_SIZE < inoPtr->i_size)  // file system full
+   {
+      inoPtr->i_size = numBlocks*BLOCK_SIZE;
+      numErrors++;
+   }
+   if(inoPtr->i_zone[7] != 0) writeDataBlock(inoPtr->i_zone[7], (char *)(job->zones+7));
+   return(job);
 } 
 
 /*-----------------------------------------------------------------
 Function: getFatDataBlock
 
 Parameters:  int blockNum - Minix Block Number (Minix block of of size BLOCK_SIZE)
-             struct msdos_dir_entry *fatDir  - pointer to FAT Directory Entry 
+             FATEXTENTS *ext - extent index of the FAT file (getFatExtents)
 	     char *block - pointer to buffer for storing block
 
 Global Variables:
@@ -412,35 +789,27 @@ Global Variables:
 
 Description: Reads a block of data from a FAT cluster into the buffer
              referenced by block. It is assumed that CLUSTER_SIZE is 
-	     a multiple of BLOCK_SIZE.
+	     a multiple of BLOCK_SIZE.  The physical cluster is found
+	     in the extent index without walking the cluster chain,
+	     and only the block itself is read.  Returns the address
+	     of the block: block, or the block in the mapping when
+	     the FAT image is mapped (see readFatRegion).
 ----------------------------------------------------------------*/
-char *getFatDataBlock(int blockNum, int clusterNum, char *block)
+char *getFatDataBlock(int blockNum, FATEXTENTS *ext, char *block)
 {
    // Assume cluster size is a multiple of block size
    int mult = CLUSTER_SIZE/BLOCK_SIZE; // multiplier of BLOCK_SIZE to get ClUSTER_SIZE
-   int num = blockNum/mult;    // logical cluster number to find
-   int i;  // to count clusters
-   char cluster[CLUSTER_SIZE];
+   int clusterNum;  // physical cluster number
+   off_t offset;  // position of the block in the FAT file system
    char *retadr = NULL;
    
    // find physical cluster number
-   for(i=0 ; i<num ; i++) 
-   {
-      clusterNum = fatPtr[clusterNum]; 
-      if(clusterNum == fatPtr[1]) break; // at last one  
-   }
-   // Read in cluster
-   if(clusterNum == fatPtr[1]) retadr = NULL;
-   else
+   clusterNum = findFatCluster(ext, blockNum/mult);
+   // Read in the block only, not the whole cluster
+   if(clusterNum != ERR1)
    {
-      if(lseek(fatfd, (clusterNum-2)*CLUSTER_SIZE + DATA_POS, SEEK_SET) != -1) 
-      {
-         if(read(fatfd, cluster, CLUSTER_SIZE)>0)  // reads the cluster
-         {
-            memcpy(block, cluster+(blockNum%mult)*BLOCK_SIZE, BLOCK_SIZE);
-	    retadr = block;
-         }
-      }
+      offset = DATA_POS + (off_t)(clusterNum-2)*CLUSTER_SIZE + (blockNum%mult)*BLOCK_SIZE;
+      retadr = readFatRegion(offset, BLOCK_SIZE, block);
    }
    return(retadr);
 }
@@ -470,5 +839,6 @@ unsigned getMinixTimeFromFat(struct msdos_dir_entry *fatDirEntryPtr)
                                                   // Minix Month: 0 to 11
    curTime.tm_year =  (1980+(date>>9)) - 1900; // Minix year, num years since 1900
                                                    // FAT year, num years since 1980
+   curTime.tm_isdst = -1;  // let mktime determine daylight saving time
    return(mktime(&curTime)); // convert to Unix time 
 }
@@ -5,6 +5,9 @@ Description: Contains definitions and include files for the
 ------------------------------------------------------------------*/
 
 /* Include files */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* O_DIRECT */
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -15,6 +18,8 @@ Description: Contains definitions and include files for the
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
 #include <linux/types.h>
 #include <linux/minix_fs.h>
 
@@ -35,6 +35,8 @@ Description: defninitions for FAT file system.
 
 
 #define EOF_FAT16 0xFFF8
+#define EOF_FAT32 0x0FFFFFF8
+#define FAT32_MASK 0x0FFFFFFF  /* the top 4 bits of a FAT32 entry are reserved */
 
 struct fat_boot_sector {
 	__s8	ignored[3];	/* Boot strap short or near jump */
@@ -52,6 +54,28 @@ struct fat_boot_sector {
 	__u16	heads;		/* number of heads */
 	__u32	hidden;		/* hidden sectors (unused) */
 	__u32	total_sect;	/* number of sectors (if sectors == 0) */
+
+	/* The following fields are only used by FAT32 */
+	__u32	fat32_length;	/* sectors/FAT */
+	__u16	flags;		/* bit 8: fat mirroring, low 4: active fat */
+	__u8	version[2];	/* major, minor filesystem version */
+	__u32	root_cluster;	/* first cluster in root directory */
+	__u16	info_sector;	/* filesystem info sector */
+	__u16	backup_boot;	/* backup boot sector */
+	__u16	reserved2[6];	/* Unused */
+};
+
+#define FAT_FSINFO_SIG1	0x41615252
+#define FAT_FSINFO_SIG2	0x61417272
+
+/* FAT32 file system information sector */
+struct fat_boot_fsinfo {
+	__u32	signature1;	/* 0x41615252L */
+	__u32	reserved1[120];	/* Nothing as far as I can tell */
+	__u32	signature2;	/* 0x61417272L */
+	__u32	free_clusters;	/* Free cluster count.  -1 if unknown */
+	__u32	next_cluster;	/* Most recently allocated cluster */
+	__u32	reserved2[4];
 };
 
 struct msdos_dir_entry {
@@ -99,22 +123,64 @@ struct msdos_dir_slot {
 struct fatDirTable
 {
    char name[BUFSIZ];  // store name 
-   unsigned short clusterNum;  // set to 0 for root directory
-   unsigned short parentCluster;  // set to 0 for root directory
+   unsigned clusterNum;  // set to 0 for root directory
+   unsigned parentCluster;  // set to 0 for root directory
    struct msdos_dir_entry *table; // the directory table
    int numEntries;  // number of entries in the table
    int size;  // size in bytes
 };
 typedef struct fatDirTable FATDIR;
 
+/* run of physically contiguous clusters in a cluster chain */
+struct fatExtent
+{
+   unsigned start;  // first physical cluster of the run
+   int length;  // number of clusters in the run
+   int logical;  // logical cluster number (in the file) of the first cluster
+};
+
+/* extent index of a file - built once from the FAT table */
+struct fatExtentList
+{
+   struct fatExtent *extents;  // runs in file order
+   int numExtents;  // number of runs
+   int numClusters;  // total number of clusters in the chain
+};
+typedef struct fatExtentList FATEXTENTS;
+
+/* Window of the FAT table read when the table is too large to be kept
+   in memory (see fatNext) */
+struct fatWindow
+{
+   long num;  // number of the window in the FAT table (-1: none)
+   char *entries;  // FATWINDOW bytes of the FAT table
+};
+
+/* Cluster of a FAT stream held in memory until it is read (see
+   streamFatImage), in a hash table chained by cluster number */
+struct heldCluster
+{
+   int cluster;  // number of the cluster
+   struct heldCluster *next;  // next cluster of the same bucket
+   char data[];  // CLUSTER_SIZE bytes
+};
+
 /********* Some defines that use global variables *********/
 #define SECTOR_SIZE (*(short *)fbs.sector_size) // size in bytes
 #define CLUSTER_SIZE (SECTOR_SIZE*fbs.cluster_size)  // in bytes
-#define FAT_POS SECTOR_SIZE
-#define ROOTDIR_POS (SECTOR_SIZE*(1+fbs.fats*fbs.fat_length))
-#define DATA_POS (ROOTDIR_POS+((*(short *)fbs.dir_entries)*sizeof(struct msdos_dir_entry)))
-#define LAST_CLUSTER fatPtr[1]  // last cluster indicator
-#define NUM_FAT_ENTRIES ((fbs.fat_length*SECTOR_SIZE)/2)  // number of entries in FAT
+#define FAT_POS fatPos  // position of the first FAT table (set by readFatBoot)
+#define ROOTDIR_POS rootDirPos  // FAT16 root directory (DATA_POS with FAT32)
+#define DATA_POS dataPos  // position of cluster 2
+#define FAT_SIZE ((off_t)fatLength*SECTOR_SIZE)  // size of a FAT table in bytes
+#define LAST_CLUSTER fatLastCluster  // last cluster indicator (entry 1)
+#define NUM_FAT_ENTRIES (numFatClusters+2)  // entries in use in the FAT (clusters+2)
+#define MAX_READ_SIZE (64*1024)  // largest single read of a run of clusters
+#define IS_LAST_CLUSTER(c) ((c) == LAST_CLUSTER || (c) >= fatEOF || (c) < 2)  // end of chain
+#define FAT_START(de) ((de)->start | (fatType == 32 ? (unsigned)(de)->starthi << 16 : 0))  // first cluster
+#define FATWINDOW (64*1024)  // bytes of the FAT table read at once (large tables)
+#define FATWINDOWS 256  // windows kept in memory (tables up to 16 Mbytes are read whole)
+#define HELDBUCKETS 1024  // first size of the hash table of held clusters (power of 2)
+#define IS_WANTED(c) (wantedClusters[(c)/8] & 1 << ((c)%8))  // cluster still to be read
 
 /*-----------------------------------------------------------------------
   Function Prototypes
@@ -125,9 +191,17 @@ int readFatTable(void);
 FATDIR *openFatDirectory(char *);
 void closeFatDirectory(FATDIR *);
 int getFatDirTable(char *, FATDIR *);
-int scanSubDirectories(char *, struct msdos_dir_entry *, FATDIR *, unsigned short);
+int scanSubDirectories(char *, struct msdos_dir_entry *, FATDIR *, unsigned);
 void writeCluster(int , void *, char *);
 void readCluster(int , void *, char *);
+char *readFatClusters(int, int, char *);
+char *readFatRegion(off_t, int, char *);
+int mapFatImage(int);
+void unmapFatImage(void);
+int streamFatImage(int);
+void endFatStream(void);
+void wantFatClusters(int, int);
+void dropFatClusters(void);
 char getmsTime(time_t );
 unsigned short getTime(time_t );
 unsigned short getDate(time_t );
@@ -135,5 +209,9 @@ void printFatDirEntries(FATDIR *);
 void displayFatDirEntry(struct msdos_dir_entry *);
 void printFatTable(unsigned short *, int );
 char *getFatName(struct msdos_dir_entry *, char *);
+unsigned fatNext(unsigned);
+FATEXTENTS *getFatExtents(unsigned);
+void freeFatExtents(FATEXTENTS *);
+int findFatCluster(FATEXTENTS *, int);
 
 #endif
@@ -0,0 +1,222 @@
+/*-----------------------------------------------------------------
+File: log.c
+Description: This file contains the logger (see log.h).  A message is
+             formatted by the thread that logs it straight into a
+	     slot of the ring of that thread; the writer thread takes
+	     the messages of all rings and writes them to the standard
+	     output.  A thread never waits for the output: when its
+	     ring is full an information or debug message is dropped
+	     and counted, and an error is written to the standard
+	     error instead (errors are never lost).
+
+	     Before startLogger and after stopLogger, messages are
+	     printed at once.
+------------------------------------------------------------------*/
+
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#define OK 0
+#define ERR1 -1
+
+// Global data
+int logLevel = LOG_INFO;  // messages above this level are not printed
+int logRunning = 0;  // TRUE while the writer thread runs
+int logStopping = 0;  // TRUE when the writer thread must end
+struct logRing *logRings = NULL;  // rings of all threads, newest first
+_Atomic long logDropped = 0;  // messages dropped (ring full)
+pthread_t logWriter;
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;  // guards the list and the sleep
+pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;  // wakes the writer to stop
+__thread struct logRing *threadRing = NULL;  // ring of this thread
+
+//*************** Prototypes of local functions **********************
+void *logWriterThread(void *);
+int drainLogs(void);
+struct logRing *getLogRing(void);
+
+/*-----------------------------------------------------------------
+Function: startLogger
+
+Returns: OK, or ERR1 if the writer thread cannot be created (messages
+         are then printed at once).
+-----------------------------------------------------------------*/
+int startLogger()
+{
+   logStopping = 0;
+   if(pthread_create(&logWriter, NULL, logWriterThread, NULL) != 0) return(ERR1);
+   logRunning = 1;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: stopLogger
+
+Description: Prints the messages left, ends the writer thread and
+             reports the messages dropped.  Called by the main thread
+	     once the other threads are done.
+-----------------------------------------------------------------*/
+void stopLogger()
+{
+   struct logRing *ring, *next;
+   if(!logRunning) return;
+   pthread_mutex_lock(&logLock);
+   logStopping = 1;
+   pthread_cond_signal(&logWake);
+   pthread_mutex_unlock(&logLock);
+   pthread_join(logWriter, NULL);
+   logRunning = 0;
+   for(ring = logRings ; ring != NULL ; ring = next)
+   {
+      next = ring->next;
+      free(ring);
+   }
+   logRings = NULL;
+   threadRing = NULL;
+   if(logDropped > 0) fprintf(stderr,"%ld messages not printed (output too slow)\n", (long)logDropped);
+}
+
+/*-----------------------------------------------------------------
+Function: logPrintf
+
+Parameters: int level - LOG_ERROR, LOG_INFO or LOG_DEBUG
+            const char *format, ... - as printf
+
+Description: Logs a message if its level is not above logLevel.
+             If the ring of the thread is full, an error goes
+	     straight to the standard error (not buffered, so it does
+	     not wait for the standard output); other messages are
+	     dropped.
+-----------------------------------------------------------------*/
+void logPrintf(int level, const char *format, ...)
+{
+   struct logRing *ring;
+   unsigned tail;
+   va_list args;
+   if(level > logLevel) return;
+   va_start(args, format);
+   if(!logRunning || (ring = getLogRing()) == NULL)
+   {
+      vprintf(format, args);
+      va_end(args);
+      return;
+   }
+   tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) != LOGRINGSIZE)
+   {
+      vsnprintf(ring->lines[tail&(LOGRINGSIZE-1)], LOGLINE, format, args);
+      atomic_store_explicit(&ring->tail, tail+1, memory_order_release);  // publish the message
+   }
+   else if(level == LOG_ERROR) vfprintf(stderr, format, args);  // full: errors are kept
+   else logDropped++;  // full: the message is lost rather than waiting
+   va_end(args);
+}
+
+/*-----------------------------------------------------------------
+Function: logProgress
+
+Parameters: int numDirs - directories converted so far
+            int numFiles - files converted so far
+
+Description: Logs a progress line (LOG_INFO) at most every
+             PROGRESS_INTERVAL seconds.  Called by the main thread
+	     for each directory and file; the coarse clock costs no
+	     system call.
+-----------------------------------------------------------------*/
+void logProgress(int numDirs, int numFiles)
+{
+   static time_t last = 0;
+   struct timespec now;
+   if(logLevel < LOG_INFO) return;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+   if(last == 0) last = now.tv_sec;  // no line right at the start
+   if(now.tv_sec - last < PROGRESS_INTERVAL) return;
+   last = now.tv_sec;
+   logPrintf(LOG_INFO, "Converted %d directories and %d files\n", numDirs, numFiles);
+}
+
+/*-----------------------------------------------------------------
+Function: getLogRing
+
+Returns: the ring of the calling thread (created with its first
+         message), or NULL if there is no memory.
+-----------------------------------------------------------------*/
+struct logRing *getLogRing()
+{
+   if(threadRing != NULL) return(threadRing);
+   threadRing = malloc(sizeof(struct logRing));
+   if(threadRing == NULL) return(NULL);
+   atomic_init(&threadRing->head, 0);
+   atomic_init(&threadRing->tail, 0);
+   pthread_mutex_lock(&logLock);
+   threadRing->next = logRings;
+   logRings = threadRing;
+   pthread_mutex_unlock(&logLock);
+   return(threadRing);
+}
+
+/*-----------------------------------------------------------------
+Function: logWriterThread
+
+Parameters: void *arg - not used
+
+Description: Writer thread: prints the messages of all rings, and
+             sleeps LOGWAIT ms when there are none.  When asked to
+	     stop, prints the messages left.
+-----------------------------------------------------------------*/
+void *logWriterThread(void *arg)
+{
+   struct timespec until;
+   pthread_mutex_lock(&logLock);
+   while(!logStopping)
+   {
+      pthread_mutex_unlock(&logLock);
+      if(drainLogs() > 0)
+      {
+         pthread_mutex_lock(&logLock);
+         continue;
+      }
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += LOGWAIT*1000000L;
+      if(until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+      pthread_mutex_lock(&logLock);
+      if(!logStopping) pthread_cond_timedwait(&logWake, &logLock, &until);
+   }
+   pthread_mutex_unlock(&logLock);
+   drainLogs();
+   return(NULL);
+}
+
+/*-----------------------------------------------------------------
+Function: drainLogs
+
+Returns: number of messages printed.
+
+Description: Prints the messages of each ring in order (the messages
+             of different threads may be interleaved).
+-----------------------------------------------------------------*/
+int drainLogs()
+{
+   struct logRing *ring;
+   unsigned head;
+   int n = 0;
+   pthread_mutex_lock(&logLock);
+   ring = logRings;  // rings are only added at the front
+   pthread_mutex_unlock(&logLock);
+   for( ; ring != NULL ; ring = ring->next)
+   {
+      head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      while(head != atomic_load_explicit(&ring->tail, memory_order_acquire))
+      {
+         fputs(ring->lines[head&(LOGRINGSIZE-1)], stdout);
+         atomic_store_explicit(&ring->head, ++head, memory_order_release);  // slot free again
+         n++;
+      }
+   }
+   if(n > 0) fflush(stdout);
+   return(n);
+}
@@ -0,0 +1,44 @@
+/*-----------------------------------------------------------------
+File: log.h
+Description: Contains definitions for the log module, which prints the
+             messages of the conversion on the standard output
+	     without making the conversion wait for it: each thread
+	     puts its messages in a ring of its own, and a writer
+	     thread prints them.
+------------------------------------------------------------------*/
+
+#ifndef LOG_H_DEF
+#define LOG_H_DEF
+
+#include <stdatomic.h>
+
+/* Levels of the messages, and of logLevel (fat2minix -q, -v) */
+#define LOG_ERROR 0  /* errors: printed even when quiet, never dropped */
+#define LOG_INFO 1  /* settings, summaries and progress (default) */
+#define LOG_DEBUG 2  /* every directory and file, boot sector, super block */
+
+#define LOGLINE 256  /* longest message (longer ones are cut) */
+#define LOGRINGSIZE 1024  /* messages in the ring of a thread (power of 2) */
+#define LOGWAIT 10  /* ms the writer sleeps when the rings are empty */
+#define PROGRESS_INTERVAL 1  /* seconds between progress lines */
+
+/* Single-producer/single-consumer ring of messages, without locks:
+   only the thread that logs moves tail and only the writer moves head */
+struct logRing
+{
+   char lines[LOGRINGSIZE][LOGLINE];
+   _Atomic unsigned head;  // next message to print
+   _Atomic unsigned tail;  // next slot to fill
+   struct logRing *next;  // rings of the other threads
+};
+
+// Global data (see log.c)
+extern int logLevel;  // messages above this level are not printed
+
+// Prototypes of the entry points
+int startLogger(void);
+void stopLogger(void);
+void logPrintf(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+void logProgress(int, int);
+
+#endif
@@ -4,14 +4,43 @@ Description: This file contains code for manipulating the contents of
              a Minix directory.
 ------------------------------------------------------------------*/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // fallocate
+#endif
 #include "minix.h"
 #include "fat.h"
+#include "dio.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 // Global data structures - initialised by initMinixFS
 int minixfd;  // file discriptor of open Minix file system
 struct minix_super_block minixSB;  // the Minix super block
 unsigned char *imap; // inode map
 unsigned char *zmap; // zone, data block, map
+struct minix_inode *itable; // inode table (inode n is itable[n-1])
+unsigned char *itableDirty; // one bit per inode table block changed in memory
+struct indirectCache indCache[NUM_INDIRECT_CACHE]; // recently used indirect blocks
+int indCacheNext = 0; // next cache entry to replace
+struct minixBitmap inodeBitmap; // allocator over imap
+struct minixBitmap zoneBitmap; // allocator over zmap
+
+/* the bit maps are scanned 64 bits at a time */
+typedef uint64_t bitmapWord __attribute__((__may_alias__));
+char *minixMap = NULL;  // Minix file system mapped in memory (NULL if not mapped)
+off_t minixMapSize;  // size of the mapping in bytes
+/* Protects the inode table, the bit maps and the indirect block cache
+   when files are copied by worker threads (see copy.c); directory
+   tables are only used by the main thread */
+pthread_mutex_t minixLock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct pendingWrites pending;  // data blocks held by this thread
+_Atomic int punchHoles = TRUE;  // FALSE once the file system cannot have holes (any worker)
 
 //*************** Prototypes of local functions **********************
 // See minix.h for the prototype functions of entry points (i.e. functions
@@ -19,6 +48,25 @@ unsigned char *zmap; // zone, data block, map
 // Functions to support opening file system and reading data structures
 unsigned char *loadIMAP(void);
 unsigned char *loadZMAP(void);
+struct minix_inode *loadITABLE(void);
+int saveITABLE(void);
+// Functions for reading/writing the file system (file or mapping)
+int minixRead(off_t, void *, int);
+int minixWrite(off_t, void *, int);
+int flushPending(char *, int);
+// Functions for caching indirect blocks
+unsigned short *getIndirectBlock(int);
+void updateIndirectCache(int, char *, int);
+// Functions for allocating from the bit maps
+void initBitmap(struct minixBitmap *, unsigned char *, int);
+int allocBits(struct minixBitmap *, int, int *);
+int allocBitRun(struct minixBitmap *, int, int *);
+int nextClearRun(struct minixBitmap *, int, int *);
+void setBitRange(struct minixBitmap *, int, int);
+void clearBit(struct minixBitmap *, int);
+// Functions for the directory hash index
+unsigned hashDirName(char *);
+int updateDirHash(MINIXDIR *);
 
 //************************************************************
 // Functions for opening and closing the Minix File system
@@ -34,9 +82,12 @@ Global variables/structures:
     struct minix_super_block minixSB  - the super block
     unsigned char *imap - inode map
     unsigned char *zmap - zone, data block, map
+    struct minix_inode *itable - inode table
 
 Description: Reads and displays the minix super block. Also
              sets up the global data variables/structures.
+	     If mapMinixImage was called, the maps are used in place
+	     in the mapping.
 -----------------------------------------------------------------*/
 int initMinixFS(int fd)
 {
@@ -45,36 +96,29 @@ int initMinixFS(int fd)
     // initialise minixfd
     minixfd = fd;
     // Get the super block
-    if(lseek(fd,BLOCK_SIZE,SEEK_SET) == -1) /* move to super block */
+    n = minixRead(BLOCK_SIZE,&minixSB,sizeof(struct minix_super_block));
+    if(n != sizeof(struct minix_super_block))
     {
-       printf("Could not seek to super-block\n");
+       logPrintf(LOG_ERROR, "Could not read super-block (%d,%d)\n",n,sizeof(struct minix_super_block));
        retcd = ERR1;
     }
     else
     {
-       n = read(fd,&minixSB,sizeof(struct minix_super_block));
-       if(n != sizeof(struct minix_super_block))
-       {
-          printf("Could not read super-block (%d,%d)\n",n,sizeof(struct minix_super_block));
-	  retcd = ERR1;
-       }
-       else
-       {
-           /* Printout the contents */
-          printf("------------SUPER Block - Minix Version 1--------------\n");
-          printf("Number of inodes %d\n",minixSB.s_ninodes);
-          printf("Number of blocks %d\n",minixSB.s_nzones);
-          printf("Number of IMAP Blocks %d\n",minixSB.s_imap_blocks);
-          printf("Number of MAP Blocks %d\n",minixSB.s_zmap_blocks);
-          printf("First data block %d\n",minixSB.s_firstdatazone);
-          printf("Zone size %d (should always be 0)\n",minixSB.s_log_zone_size);
-          printf("Maximum size of file %d\n",minixSB.s_max_size);
-          printf("Magic number %x\n",minixSB.s_magic);
-          printf("State %d\n",minixSB.s_state);
-          printf("Number of data blocks %d\n",minixSB.s_zones);
-          printf("-----------------------------------------\n\n");
-       }
+        /* Printout the contents */
+       logPrintf(LOG_DEBUG, "------------SUPER Block - Minix Version 1--------------\n");
+       logPrintf(LOG_DEBUG, "Number of inodes %d\n",minixSB.s_ninodes);
+       logPrintf(LOG_DEBUG, "Number of blocks %d\n",minixSB.s_nzones);
+       logPrintf(LOG_DEBUG, "Number of IMAP Blocks %d\n",minixSB.s_imap_blocks);
+       logPrintf(LOG_DEBUG, "Number of MAP Blocks %d\n",minixSB.s_zmap_blocks);
+       logPrintf(LOG_DEBUG, "First data block %d\n",minixSB.s_firstdatazone);
+       logPrintf(LOG_DEBUG, "Zone size %d (should always be 0)\n",minixSB.s_log_zone_size);
+       logPrintf(LOG_DEBUG, "Maximum size of file %d\n",minixSB.s_max_size);
+       logPrintf(LOG_DEBUG, "Magic number %x\n",minixSB.s_magic);
+       logPrintf(LOG_DEBUG, "State %d\n",minixSB.s_state);
+       logPrintf(LOG_DEBUG, "Number of data blocks %d\n",minixSB.s_zones);
+       logPrintf(LOG_DEBUG, "-----------------------------------------\n\n");
     }
+    if(retcd == ERR1) return(retcd);
 
     // Load the maps
     imap = loadIMAP();  // Inode Map
@@ -85,8 +129,25 @@ int initMinixFS(int fd)
        if(zmap == NULL) 
        {
 	  retcd = ERR1;
-          free(imap);
+          if(minixMap == NULL) free(imap);
        }
+       else
+       {
+          itable = loadITABLE(); // Inode table
+          if(itable == NULL)
+          {
+             retcd = ERR1;
+             if(minixMap == NULL) { free(imap); free(zmap); }
+          }
+       }
+    }
+    if(retcd == OK)
+    {
+       // bit 0 of each map is reserved, bit n is inode n / zone FIRSTZONE+n-1
+       initBitmap(&inodeBitmap, imap, minixSB.s_ninodes+1);
+       initBitmap(&zoneBitmap, zmap, minixSB.s_nzones-FIRSTZONE+1);
+       logPrintf(LOG_DEBUG, "Free inodes %d, free data blocks %d\n\n",
+              inodeBitmap.numFree, zoneBitmap.numFree);
     }
     return(retcd);
 }
@@ -100,37 +161,65 @@ Global variables:
     struct minix_super_block minixSB  - the super block
     unsigned char *imap - inode map
     unsigned char *zmap - zone, data block, map
+    struct minix_inode *itable - inode table
+
+Returns: OK, or ERR1 if something could not be written.
 
-Description: Saves maps, frees up allocated memory and closes the file.
+Description: Saves maps and the changed inode table blocks, frees up
+             allocated memory and closes the file.
+             When the file system is mapped, all changes are already
+	     in the mapping and are flushed with a single msync.
+	     Call only after initMinixFS succeeded.
 -----------------------------------------------------------------*/
-void closeMinixFS()
+int closeMinixFS()
 {
    int n;
    int imapsize = minixSB.s_imap_blocks*BLOCK_SIZE; // size of imap
    int zmapsize = minixSB.s_zmap_blocks*BLOCK_SIZE; // size of zmap
+   int retcd;
 
+   retcd = flushDataBlocks();  // data blocks held by this thread
+   if(minixMap != NULL)
+   {
+      TRACE_BEGIN("msync", NULL);
+      if(msync(minixMap, minixMapSize, MS_SYNC) == -1)
+      {
+         perror("closeMinixFS (msync)");
+         retcd = ERR1;
+      }
+      TRACE_END("msync");
+      countIO(&stats.minix, 1, 0, 0);
+      munmap(minixMap, minixMapSize);
+      minixMap = NULL;
+      close(minixfd);
+      return(retcd);
+   }
+   TRACE_BEGIN("save maps and inode table", NULL);
+   // save inode table
+   if(saveITABLE() == ERR1) retcd = ERR1;
    // save maps and free allocated memory to maps
    // IMAP
-   if(lseek(minixfd,2*BLOCK_SIZE,SEEK_SET) == -1) /* move to imap */
-          printf("Could not seek to IMAP\n");
-   else
+   n = ioWrite(minixfd,imap,imapsize,2*BLOCK_SIZE);
+   countIO(&stats.minix, 1, 0, n > 0 ? n : 0);
+   if(n != imapsize)
    {
-       n = write(minixfd,imap,imapsize);
-       if(n != imapsize) printf("Could not write IMAP (%d,%d)\n",n,imapsize);
+      logPrintf(LOG_ERROR, "Could not write IMAP (%d,%d)\n",n,imapsize);
+      retcd = ERR1;
    }
    free(imap);
    // ZMAP
-   if(lseek(minixfd,(2+minixSB.s_imap_blocks)*BLOCK_SIZE,SEEK_SET) == -1) /* move to zmap */
-     printf("Could not seek to ZMAP\n");
-   else
+   n = ioWrite(minixfd,zmap,zmapsize,(2+minixSB.s_imap_blocks)*BLOCK_SIZE);
+   countIO(&stats.minix, 1, 0, n > 0 ? n : 0);
+   if(n != zmapsize)
    {
-      n = write(minixfd,zmap,zmapsize);
-      if(n != zmapsize)
-         printf("Could not write ZMAP (%d,%d)\n",n,zmapsize);
+      logPrintf(LOG_ERROR, "Could not write ZMAP (%d,%d)\n",n,zmapsize);
+      retcd = ERR1;
    }
    free(zmap);
+   TRACE_END("save maps and inode table");
    // close file
    close(minixfd);
+   return(retcd);
 }
 
 /*-----------------------------------------------------------------
@@ -142,6 +231,7 @@ Global variables/structures:
 
 Description: Allocates memory for the Inode map (address saved in imap)
              and loads the Inode map from the disk to the allocated memory.
+	     When the file system is mapped, returns the map in the mapping.
 -----------------------------------------------------------------*/
 unsigned char *loadIMAP()
 {
@@ -149,28 +239,25 @@ unsigned char *loadIMAP()
     int n; // number of bytes read
     unsigned char *map; // working pointer variable
 
+    if(minixMap != NULL)
+    {
+       if((2*BLOCK_SIZE)+imapsize > minixMapSize) return(NULL);
+       return((unsigned char *)minixMap+2*BLOCK_SIZE);
+    }
     // Allocate memory
-    map = malloc(minixSB.s_imap_blocks*BLOCK_SIZE);
+    map = allocIOBuffer(minixSB.s_imap_blocks*BLOCK_SIZE);
     if(map == NULL)
        fprintf(stderr,"Could not allocate memory for IMAP\n");
     else
     {  // Read in the IMAP
-       if(lseek(minixfd,2*BLOCK_SIZE,SEEK_SET) == -1) // move to imap on disk
+       n = ioRead(minixfd,map,imapsize,2*BLOCK_SIZE);  // reads imap from disk to memory
+       countIO(&stats.minix, 1, n > 0 ? n : 0, 0);
+       if(n != imapsize)
        {
-          printf("Could not seek to IMAP\n");
-	  free(map);
+          logPrintf(LOG_ERROR, "Could not read IMAP (%d,%d)\n",n,imapsize);
+          free(map);
           map = NULL;
        }
-       else
-       {
-           n = read(minixfd,map,imapsize);  // reads imap from disk to memory
-           if(n != imapsize)
-           {
-             printf("Could not read IMAP (%d,%d)\n",n,imapsize);
-	     free(map);
-	     map = NULL;
-           }
-       }
     }
     return(map);
 }
@@ -185,6 +272,7 @@ Global variables/structures:
 Description: Allocates memory for the Zone (i.e. data block) map 
              (address saved in zmap) and loads the Inode map from 
 	     the disk to the allocated memory.
+	     When the file system is mapped, returns the map in the mapping.
 -----------------------------------------------------------------*/
 unsigned char *loadZMAP()
 {
@@ -192,30 +280,194 @@ unsigned char *loadZMAP()
     int n; // number of bytes read
     unsigned char *map;  // working pointer variable
 
+    if(minixMap != NULL)
+    {
+       if((2+minixSB.s_imap_blocks)*BLOCK_SIZE+zmapsize > minixMapSize) return(NULL);
+       return((unsigned char *)minixMap+(2+minixSB.s_imap_blocks)*BLOCK_SIZE);
+    }
     // Allocate memory
-    map = malloc(minixSB.s_zmap_blocks*BLOCK_SIZE);
+    map = allocIOBuffer(minixSB.s_zmap_blocks*BLOCK_SIZE);
     if(map == NULL)
        fprintf(stderr,"Could not allocate memory for ZMAP\n");
     else
     {  // Read in the ZMAP
-       if(lseek(minixfd,(2+minixSB.s_imap_blocks)*BLOCK_SIZE,SEEK_SET) == -1) /* move to zmap on disk */
+       n = ioRead(minixfd,map,zmapsize,(2+minixSB.s_imap_blocks)*BLOCK_SIZE);  // read map from the disk into the memory
+       countIO(&stats.minix, 1, n > 0 ? n : 0, 0);
+       if(n != zmapsize)
        {
-          printf("Could not seek to ZMAP\n");
-	  free(map);
+          logPrintf(LOG_ERROR, "Could not read ZMAP (%d,%d)\n",n,zmapsize);
+          free(map);
           map = NULL;
        }
-       else
+    }
+    return(map);
+}
+
+/*-----------------------------------------------------------------
+Function: mapMinixImage
+
+Parameters: int fd - file descriptor of open file system (read/write)
+
+Global variables:
+    char *minixMap - the mapping
+    off_t minixMapSize - size of the mapping
+
+Returns: OK - file system mapped
+         ERR1 - could not map, read/write is used instead
+
+Description: Maps the whole Minix file system read/write in memory.
+             The super block, maps, inode table and zones are then
+	     updated in place and closeMinixFS flushes them with a
+	     single msync. Call before initMinixFS.
+-----------------------------------------------------------------*/
+int mapMinixImage(int fd)
+{
+   struct stat st;
+   char *map;
+
+   if(fstat(fd, &st) == -1) { perror("mapMinixImage"); return(ERR1); }
+   if(S_ISBLK(st.st_mode)) minixMapSize = lseek(fd, 0, SEEK_END);  // device size
+   else minixMapSize = st.st_size;
+   if(minixMapSize <= 0)
+   {
+      fprintf(stderr,"mapMinixImage: cannot map an image of unknown size\n");
+      return(ERR1);
+   }
+   map = mmap(NULL, minixMapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+   if(map == MAP_FAILED) { perror("mapMinixImage"); return(ERR1); }
+   minixMap = map;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: minixRead   minixWrite
+
+Parameters: off_t offset - position in the file system (bytes)
+            void *buffer - data to read/write
+            int size - number of bytes
+
+Returns: number of bytes read/written, -1 on error.
+
+Description: Reads/writes the file system at a given position with
+             ioRead/ioWrite (pread/pwrite, aligned for O_DIRECT), or
+	     copies from/to the mapping when the file system is mapped.
+	     The data blocks held by the thread are written before
+	     reading, so that they are read back as written.
+-----------------------------------------------------------------*/
+int minixRead(off_t offset, void *buffer, int size)
+{
+   int n;
+   if(pending.numBlocks > 0 && flushPending(NULL, 0) == ERR1) return(-1);
+   if(minixMap != NULL)
+   {
+      if(offset < 0 || offset+size > minixMapSize) { errno = EINVAL; return(-1); }
+      memcpy(buffer, minixMap+offset, size);
+      countIO(&stats.minix, 0, size, 0);
+      return(size);
+   }
+   n = ioRead(minixfd, buffer, size, offset);
+   countIO(&stats.minix, 1, n > 0 ? n : 0, 0);
+   return(n);
+}
+
+int minixWrite(off_t offset, void *buffer, int size)
+{
+   int n;
+   if(minixMap != NULL)
+   {
+      if(offset < 0 || offset+size > minixMapSize) { errno = EINVAL; return(-1); }
+      memcpy(minixMap+offset, buffer, size);
+      countIO(&stats.minix, 0, 0, size);
+      return(size);
+   }
+   n = ioWrite(minixfd, buffer, size, offset);
+   countIO(&stats.minix, 1, 0, n > 0 ? n : 0);
+   return(n);
+}
+
+/*-----------------------------------------------------------------
+Function: loadITABLE
+
+Global variables/structures:
+    struct minix_super_block minixSB  - the super block
+    struct minix_inode *itable - inode table
+    unsigned char *itableDirty - changed inode table blocks
+
+Description: Allocates memory for the inode table and loads all of its
+             NUMITABLEBLOCKS blocks with a single read, so that readInode
+	     and saveInode work in memory.  saveInode marks the block
+	     of the inode in itableDirty. When the file system is mapped,
+	     returns the table in the mapping.
+-----------------------------------------------------------------*/
+struct minix_inode *loadITABLE()
+{
+    int itablesize = (NUMITABLEBLOCKS)*BLOCK_SIZE; // size of inode table
+    off_t start = (2+minixSB.s_imap_blocks+minixSB.s_zmap_blocks)*BLOCK_SIZE;
+    int n; // number of bytes read
+    struct minix_inode *tbl;  // working pointer variable
+
+    if(minixMap != NULL)
+    {
+       if(start+itablesize > minixMapSize) return(NULL);
+       return((struct minix_inode *)(minixMap+start));
+    }
+    // Allocate memory
+    tbl = allocIOBuffer(itablesize);
+    itableDirty = calloc((NUMITABLEBLOCKS)/8+1, 1);
+    if(tbl == NULL || itableDirty == NULL)
+    {
+       fprintf(stderr,"Could not allocate memory for inode table\n");
+       free(tbl);
+       free(itableDirty);
+       return(NULL);
+    }
+    n = minixRead(start,tbl,itablesize);  // read the table from the disk
+    if(n != itablesize)
+    {
+       logPrintf(LOG_ERROR, "Could not read inode table (%d,%d)\n",n,itablesize);
+       free(tbl);
+       free(itableDirty);
+       tbl = NULL;
+    }
+    return(tbl);
+}
+
+/*-----------------------------------------------------------------
+Function: saveITABLE
+
+Global variables/structures:
+    struct minix_inode *itable - inode table
+    unsigned char *itableDirty - changed inode table blocks
+
+Returns: OK, or ERR1 if a block could not be written.
+
+Description: Writes the changed inode table blocks in ascending order,
+             one write for each run of consecutive changed blocks,
+	     and frees the inode table.
+-----------------------------------------------------------------*/
+int saveITABLE()
+{
+    off_t start = (2+minixSB.s_imap_blocks+minixSB.s_zmap_blocks)*BLOCK_SIZE;
+    int numBlocks = NUMITABLEBLOCKS;
+    int first, last;  // run of changed blocks
+    int n;
+    int retcd = OK;
+
+    for(first=0 ; first<numBlocks ; first=last)
+    {
+       if((itableDirty[first/8] & (1<<(first%8))) == 0) { last = first+1; continue; }
+       for(last=first+1 ; last<numBlocks && (itableDirty[last/8] & (1<<(last%8))) ; last++) ;
+       n = minixWrite(start+first*BLOCK_SIZE, ((char *)itable)+first*BLOCK_SIZE,
+                      (last-first)*BLOCK_SIZE);
+       if(n != (last-first)*BLOCK_SIZE)
        {
-           n = read(minixfd,map,zmapsize);  // read map from the disk into the memory
-           if(n != zmapsize)
-           {
-             printf("Could not read ZMAP (%d,%d)\n",n,zmapsize);
-	     free(map);
-             map = NULL;
-           }
+          logPrintf(LOG_ERROR, "Could not write inode table blocks %d-%d\n",first,last-1);
+          retcd = ERR1;
        }
     }
-    return(map);
+    free(itable);
+    free(itableDirty);
+    return(retcd);
 }
 
 //************************************************************
@@ -276,6 +528,211 @@ void closeMinixDirectory( struct dentry *dirPtr, int numRecs,
    free(dirPtr);  // frees allocated memory
 }
 
+/*-----------------------------------------------------------------
+Function: openMinixDir
+
+Parameters: char *dirPathName - full path name of directory to open
+
+Returns: handle of the open directory (release with closeMinixDir)
+         NULL - error
+
+Description: Opens a Minix directory by path name (see openMinixDirectory).
+             This is the only place the path is resolved; directories
+	     below it are opened from their parent handle with
+	     openMinixSubDir.
+-----------------------------------------------------------------*/
+MINIXDIR *openMinixDir(char *dirPathName)
+{
+   MINIXDIR *dir = malloc(sizeof(MINIXDIR));
+   if(dir == NULL) { perror("openMinixDir"); return(NULL); }
+   dir->hash = NULL;  // built when first needed
+   dir->numHashed = 0;
+   dir->table = openMinixDirectory(dirPathName, &dir->numRecs, &dir->inoNum,
+                                   &dir->parentInoNum, &dir->ino);
+   if(dir->table == NULL)
+   {
+      free(dir);
+      dir = NULL;
+   }
+   return(dir);
+}
+
+/*-----------------------------------------------------------------
+Function: openMinixSubDir
+
+Parameters: MINIXDIR *parent - open parent directory
+            char *name - name of the subdirectory in the parent
+
+Returns: handle of the open directory (release with closeMinixDir)
+         NULL - error
+
+Description: Opens a subdirectory from the table of its open parent, so
+             that no path is resolved from the root directory.
+-----------------------------------------------------------------*/
+MINIXDIR *openMinixSubDir(MINIXDIR *parent, char *name)
+{
+   MINIXDIR *dir;
+   int ix = findMinixDirEntry(parent, name);
+   if(ix == ERR1)
+   {
+      fprintf(stderr,"Could not open directory %s\n",name);
+      return(NULL);
+   }
+   dir = malloc(sizeof(MINIXDIR));
+   if(dir == NULL) { perror("openMinixSubDir"); return(NULL); }
+   dir->inoNum = parent->table[ix].ino;
+   dir->parentInoNum = parent->inoNum;
+   dir->table = NULL;
+   dir->hash = NULL;  // built when first needed
+   dir->numHashed = 0;
+   if(readInode(dir->inoNum, &dir->ino) == OK)
+      dir->table = getMinixDirTable(&dir->ino, &dir->numRecs);
+   if(dir->table == NULL)
+   {
+      fprintf(stderr,"Error in reading %s\n",name);
+      free(dir);
+      dir = NULL;
+   }
+   return(dir);
+}
+
+/*-----------------------------------------------------------------
+Function: closeMinixDir
+
+Parameters: MINIXDIR *dir - open directory
+
+Description: Writes the directory table and inode (see
+             closeMinixDirectory) and releases the handle.
+-----------------------------------------------------------------*/
+void closeMinixDir(MINIXDIR *dir)
+{
+   closeMinixDirectory(dir->table, dir->numRecs, dir->inoNum, &dir->ino);
+   free(dir->hash);
+   free(dir);
+}
+
+/*-----------------------------------------------------------------
+Function: newMinixDirEntry
+
+Parameters: MINIXDIR *dir - open directory
+
+Returns: address of the next free entry in the table
+         NULL - the table is full, or it needs a data block and
+	        there are none left
+
+Description: Adds an entry at the end of the directory table.  The
+             caller fills in the name and inode number; the entry is
+	     added to the hash index by the next findMinixDirEntry.
+	     The data block of the table holding the entry is
+	     allocated here, so that the table can always be saved.
+	     dropMinixDirEntry removes the entry just added (before
+	     the next findMinixDirEntry), when it cannot be filled in.
+-----------------------------------------------------------------*/
+struct dentry *newMinixDirEntry(MINIXDIR *dir)
+{
+   int block = dir->numRecs*sizeof(struct dentry)/BLOCK_SIZE;
+   int blockNum;
+   if(dir->numRecs >= MAXDIRENTRIES)
+   {
+      fprintf(stderr,"Directory table full (%d entries)\n",MAXDIRENTRIES);
+      return(NULL);
+   }
+   if(dir->ino.i_zone[block] == 0)
+   {
+      if((blockNum = findFreeDataBlock()) == ERR1) return(NULL);
+      dir->ino.i_zone[block] = blockNum;
+   }
+   return(dir->table + dir->numRecs++);
+}
+
+void dropMinixDirEntry(MINIXDIR *dir)
+{
+   dir->numRecs--;
+   memset(dir->table + dir->numRecs, 0, sizeof(struct dentry));
+}
+
+/*-----------------------------------------------------------------
+Function: findMinixDirEntry
+
+Parameters: MINIXDIR *dir - open directory
+            char *name - name to find
+
+Returns: index of the entry in the table
+         ERR1 - not found
+
+Description: Finds an entry by its exact name in an open directory
+             table using the hash index of the directory.  The index
+	     is built on the first call and brought up to date with
+	     the entries added since the last call.
+-----------------------------------------------------------------*/
+int findMinixDirEntry(MINIXDIR *dir, char *name)
+{
+   unsigned slot;
+   int ix;
+   if(updateDirHash(dir) == ERR1) return(ERR1);
+   for(slot = hashDirName(name) ; dir->hash[slot] != 0 ; slot = (slot+1)%DIRHASHSIZE)
+   {
+      ix = dir->hash[slot]-1;
+      if(strncmp(name, dir->table[ix].name, sizeof(dir->table[ix].name)) == 0)
+         return(ix);
+   }
+   return(ERR1);
+}
+
+/*-----------------------------------------------------------------
+Function: updateDirHash
+
+Parameters: MINIXDIR *dir - open directory
+
+Returns: OK, or ERR1 if the index could not be allocated.
+
+Description: Creates the hash index of a directory if needed and adds
+             the entries not yet in it.  Collisions are resolved by
+	     linear probing; the index always has more slots than a
+	     table has entries.  Empty entries (inode 0) are not indexed,
+	     and for duplicate names the first entry is kept.
+-----------------------------------------------------------------*/
+int updateDirHash(MINIXDIR *dir)
+{
+   unsigned slot;
+   int ix;
+   if(dir->hash == NULL)
+   {
+      dir->hash = calloc(DIRHASHSIZE, sizeof(short));
+      if(dir->hash == NULL) { perror("updateDirHash"); return(ERR1); }
+   }
+   for(ix = dir->numHashed ; ix < dir->numRecs ; ix++)
+   {
+      if(dir->table[ix].ino == 0) continue;
+      for(slot = hashDirName(dir->table[ix].name) ; dir->hash[slot] != 0 ;
+          slot = (slot+1)%DIRHASHSIZE)
+         if(strncmp(dir->table[ix].name, dir->table[dir->hash[slot]-1].name,
+                    sizeof(dir->table[ix].name)) == 0) break;  // duplicate
+      if(dir->hash[slot] == 0) dir->hash[slot] = ix+1;
+   }
+   dir->numHashed = dir->numRecs;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: hashDirName
+
+Parameters: char *name - name of a directory entry
+
+Returns: slot in a directory hash index.
+
+Description: FNV-1a hash of the name (at most the 30 characters kept
+             in a directory entry).
+-----------------------------------------------------------------*/
+unsigned hashDirName(char *name)
+{
+   unsigned h = 2166136261u;
+   int i;
+   for(i = 0 ; i < sizeof(((struct dentry *)0)->name) && name[i] != '\0' ; i++)
+      h = (h ^ (unsigned char)name[i]) * 16777619u;
+   return(h%DIRHASHSIZE);
+}
+
 /*-----------------------------------------------------------------
 Function: scanMinixSubDirectories
 
@@ -314,7 +771,7 @@ int scanMinixSubDirectories(char *path, struct dentry *tbl,
    // Search for sub directory
    for(ix = 0 ; ix < numrecords ; ix++)
    {
-      if((strncmp(subDirName, tbl[ix].name, strlen(subDirName)) == 0)) // found it
+      if((strncmp(subDirName, tbl[ix].name, sizeof(tbl[ix].name)) == 0)) // found it
       {
          readInode(tbl[ix].ino, &ino); // get inode
          if(*path == '\0') // if at end of path, then found directory 
@@ -336,7 +793,7 @@ int scanMinixSubDirectories(char *path, struct dentry *tbl,
    }
    if(ix == numrecords) // did not find the name in the table
    {
-      printf("Could not find subdirectory %s\n", subDirName);
+      logPrintf(LOG_ERROR, "Could not find subdirectory %s\n", subDirName);
       retcd = ERR1;
    }
    return(retcd);
@@ -367,9 +824,10 @@ struct dentry *getMinixDirTable(struct minix_inode *inoPtr, int *numRecords)
    else numDataBlocks = inoPtr->i_size/BLOCK_SIZE;
    *numRecords = inoPtr->i_size/sizeof(struct dentry);
    // Allocate memory for the table
-   dirTablePtr = malloc(7*BLOCK_SIZE);  // allocate maximum amount of memory
+   dirTablePtr = allocIOBuffer(7*BLOCK_SIZE);  // allocate maximum amount of memory
    if(dirTablePtr != NULL)
    {
+       STAT_ADD(stats.minix.dirLoads, 1);
        // zero memory
        memset(dirTablePtr,0,7*BLOCK_SIZE);
        /* Read the contents */
@@ -422,7 +880,11 @@ void saveMinixDirTable(struct minix_inode *inoPtr,
        for(i=0 ; i<numRequired ; i++)
        {
           // Get a new data block if not allocated
-          if(inoPtr->i_zone[i]==0) inoPtr->i_zone[i] = findFreeDataBlock();
+          if(inoPtr->i_zone[i]==0 && (inoPtr->i_zone[i] = findFreeDataBlock()) == (unsigned short)ERR1)
+          {
+             inoPtr->i_zone[i] = 0;  // file system full: the rest is lost
+             break;
+          }
           saveDataBlock(i, inoPtr, ((char *)dirTablePtr)+(i*BLOCK_SIZE) );
        }
    }
@@ -477,40 +939,34 @@ Function: findFreeInode
 Global Variables:
    int minixfd - file descriptor of open fs.
    unsigned char *imap - inode map
+   struct minixBitmap inodeBitmap - allocator over imap
 
 Returns: ERR1 (-1) - error encountered.
          inode number - otherwise.
 
 Description: 
         Finds a free inode using bit map, sets the bit,
-	and returns inode number.
+	and returns inode number.  freeInode clears the bit of an
+	inode found but not used.
 -----------------------------------------------------------------*/
 short findFreeInode()
 {
-   int bytenum, bitnum;
-   short inodenum;
-   // first find byte with a zero
-   for(bytenum=0; bytenum<minixSB.s_ninodes/8 ; bytenum++)
-      if(imap[bytenum] != 0xff) break;
-   // find bit that is clear
-   for(bitnum=0 ; bitnum<8 ; bitnum++)
-      if((imap[bytenum] & (1<<bitnum))==0) break;
-   // Compute and check block number
-   inodenum = bytenum*8 + bitnum;
-   if(inodenum > minixSB.s_ninodes)
-   {
-      fprintf(stderr,"No free inodes\n");
-      inodenum = ERR1;
-   }
-   else
-   {
-      // set the bit
-      bitnum = 1<<bitnum;
-      imap[bytenum] |= bitnum;
-   }
+   int bitnum;
+   short inodenum = ERR1;
+   pthread_mutex_lock(&minixLock);
+   if(allocBits(&inodeBitmap, 1, &bitnum) == 1) inodenum = bitnum;
+   pthread_mutex_unlock(&minixLock);
+   if(inodenum == ERR1) fprintf(stderr,"No free inodes\n");
    return(inodenum);
 }
 
+void freeInode(int inodeNum)
+{
+   pthread_mutex_lock(&minixLock);
+   clearBit(&inodeBitmap, inodeNum);
+   pthread_mutex_unlock(&minixLock);
+}
+
 /*------------------------------------------------------------------
 Function: readInode(ino_num, ino)
 
@@ -520,21 +976,23 @@ Parameters: ino_num - number of inode to read (index)
 Returns: ERR1 - error in reading the inode.
          OK - successful
 
-Description: Reads in an inode.
+Description: Reads in an inode from the inode table in memory.
 -----------------------------------------------------------------*/
 int readInode(int ino_num, struct minix_inode *ino)
 {
      int retcd = OK;
 
-     if(seekToInode(ino_num)==ERR1)
+     if(ino_num < 1 || ino_num > minixSB.s_ninodes)
      {
-	perror("readInode");
+	fprintf(stderr,"readInode: bad inode number %d\n",ino_num);
         retcd = ERR1;
      }
-     else if(read(minixfd,ino,sizeof(struct minix_inode)) != sizeof(struct minix_inode)) 
+     else
      {
-	perror("readInode");
-        retcd = ERR1;
+        pthread_mutex_lock(&minixLock);
+        memcpy(ino,itable+(ino_num-1),sizeof(struct minix_inode));
+        pthread_mutex_unlock(&minixLock);
+        STAT_ADD(stats.inodeReads, 1);
      }
      return(retcd);
 }
@@ -548,22 +1006,30 @@ Parameters: ino_num - number of inode to save (index)
 Returns: ERR1 - error in saving the inode.
          OK - successful
 
-Description: saves an inode.
+Description: saves an inode in the inode table in memory and marks
+             its block as changed; the block is written by closeMinixFS.
 -----------------------------------------------------------------*/
 int saveInode(int ino_num, struct minix_inode *ino)
 {
      int retcd = OK;
+     int blk;  // inode table block of the inode
 
-     if(seekToInode(ino_num)==ERR1) 
+     if(ino_num < 1 || ino_num > minixSB.s_ninodes) 
      {
-	perror("saveInode (seek)");
+        logPrintf(LOG_ERROR, "Error writing inode %d\n",ino_num);
         retcd = ERR1;
      }
-     else if(write(minixfd,ino,sizeof(struct minix_inode)) != sizeof(struct minix_inode)) 
+     else
      {
-        printf("Error writing inode %d\n",ino_num);
-	perror("saveInode (write)");
-        retcd = ERR1;
+        pthread_mutex_lock(&minixLock);
+        memcpy(itable+(ino_num-1),ino,sizeof(struct minix_inode));
+        if(minixMap == NULL)  // mapping is updated in place
+        {
+           blk = (ino_num-1)*INODE_SIZE/BLOCK_SIZE;
+           itableDirty[blk/8] |= 1<<(blk%8);
+        }
+        pthread_mutex_unlock(&minixLock);
+        STAT_ADD(stats.inodeWrites, 1);
      }
      return(retcd);
 }
@@ -580,13 +1046,20 @@ Global Variables:
 Returns: ERR1 - error in reading the inode.
          OK - successful
 
-Description: Seeks to the inode "ino_num".
+Description: Seeks to the inode "ino_num" (seekToInode) or returns
+             its position in the file system (inodeOffset).
 -----------------------------------------------------------------*/
-int seekToInode(int ino_num)
+off_t inodeOffset(int ino_num)
 {
      int start = (2+minixSB.s_imap_blocks+minixSB.s_zmap_blocks)*BLOCK_SIZE;
+     return(start+((ino_num-1)*INODE_SIZE));
+}
 
-     if(lseek(minixfd,(start+((ino_num-1)*INODE_SIZE)),SEEK_SET) == -1) 
+int seekToInode(int ino_num)
+{
+     countIO(&stats.minix, 1, 0, 0);
+     STAT_ADD(stats.minix.seeks, 1);
+     if(lseek(minixfd,inodeOffset(ino_num),SEEK_SET) == -1) 
      {
          perror("seekToInode");
          return(ERR1);
@@ -604,6 +1077,7 @@ Function: findFreeDataBlock
 Global Variables:
    int minixfd - file descriptor of open fs.
    unsigned char *zmap - zone map
+   struct minixBitmap zoneBitmap - allocator over zmap
 
 Returns: ERR1 (-1) - error encountered.
          Data block number.
@@ -614,29 +1088,333 @@ Description:
 -----------------------------------------------------------------*/
 int findFreeDataBlock()
 {
-   int bytenum, bitnum;
    int blocknum;
-
-   // first find byte with a zero
-   for(bytenum=0; bytenum<TOTALDATABLOCKS/8 ; bytenum++)
-      if(zmap[bytenum] != 0xff) break;
-   // find bit that is clear
-   for(bitnum=0 ; bitnum<8 ; bitnum++)
-      if((zmap[bytenum] & (1<<bitnum))==0) break;
-   // Compute and check block number
-   blocknum = bytenum*8 + bitnum + FIRSTZONE;
-   if(blocknum > TOTALBLOCKS)
+   if(allocDataBlocks(1, &blocknum) != 1)
    {
       fprintf(stderr,"No free data blocks\n");
       blocknum = ERR1;
    }
-   else
+   return(blocknum);
+}
+
+/*-----------------------------------------------------------------
+Function: allocDataBlocks
+
+Parameters: int n - number of data blocks wanted
+            int *blocks - array of n elements for the block numbers
+
+Global Variables:
+   struct minixBitmap zoneBitmap - allocator over zmap
+
+Returns: number of data blocks allocated (less than n when the file
+         system is full).
+
+Description: 
+        Allocates up to n data blocks in a single scan of the
+	zone map and returns their block numbers in "blocks".
+-----------------------------------------------------------------*/
+int allocDataBlocks(int n, int *blocks)
+{
+   int i;
+   pthread_mutex_lock(&minixLock);
+   n = allocBits(&zoneBitmap, n, blocks);
+   pthread_mutex_unlock(&minixLock);
+   for(i=0 ; i<n ; i++) blocks[i] += FIRSTZONE-1;  // bit 1 is the first zone
+   return(n);
+}
+
+/*-----------------------------------------------------------------
+Function: allocFileBlocks
+
+Parameters: int numBlocks - number of data blocks in the file
+            struct minix_inode *ino - inode of the file (i_zone is filled)
+            unsigned short *indexblock - indirect block of the file (filled
+	                                 when numBlocks > 7)
+
+Returns: number of data blocks allocated (less than numBlocks when the
+         file system is full).
+
+Description: 
+        Allocates all data blocks of a file at once, as one contiguous
+	run of zones if possible (see allocBitRun).  When the file needs
+	the indirect block, it is part of the run and sits between the
+	seventh and eighth data blocks, i.e. just before the data it
+	indexes.  The caller writes the indirect block.
+-----------------------------------------------------------------*/
+int allocFileBlocks(int numBlocks, struct minix_inode *ino, unsigned short *indexblock)
+{
+   int *blocks;
+   int total = numBlocks;  // number of zones including the indirect block
+   int n, i;
+
+   if(numBlocks > 7+BLOCK_SIZE/2) numBlocks = total = 7+BLOCK_SIZE/2;
+   if(numBlocks > 7) total++;
+   blocks = malloc(total*sizeof(int));
+   if(blocks == NULL) { perror("allocFileBlocks"); return(0); }
+   TRACE_BEGIN("allocFileBlocks", NULL);
+   pthread_mutex_lock(&minixLock);
+   n = allocBitRun(&zoneBitmap, total, blocks);
+   pthread_mutex_unlock(&minixLock);
+   TRACE_END("allocFileBlocks");
+   for(i=0 ; i<n ; i++) blocks[i] += FIRSTZONE-1;  // bit 1 is the first zone
+   if(n < total) fprintf(stderr,"No free data blocks\n");
+   for(i=0 ; i<n && i<7 ; i++) ino->i_zone[i] = blocks[i];
+   if(n > 8)  // at least one block in the indirect block
    {
-      // set the bit
-      bitnum = 1<<bitnum;
-      zmap[bytenum] |= bitnum;
+      ino->i_zone[7] = blocks[7];
+      memset(indexblock, 0, BLOCK_SIZE);
+      for(i=8 ; i<n ; i++) indexblock[i-8] = blocks[i];
+      n--;  // the indirect block is not a data block
    }
-   return(blocknum);
+   else if(n == 8)  // no room left for data after the indirect block
+   {
+      pthread_mutex_lock(&minixLock);
+      clearBit(&zoneBitmap, blocks[7]-(FIRSTZONE-1));  // give it back
+      pthread_mutex_unlock(&minixLock);
+      n = 7;
+   }
+   free(blocks);
+   return(n);
+}
+
+/*-----------------------------------------------------------------
+Function: allocBitRun
+
+Parameters: struct minixBitmap *bm - allocator
+            int n - number of bits wanted
+            int *bits - array of n elements for the bit numbers
+
+Returns: number of bits allocated (less than n when the map is full).
+
+Description: 
+        Allocates n bits as a single run of consecutive clear bits,
+	using the first run long enough from the cursor (next-fit).
+	When no run is long enough, the bits are taken from several
+	runs (best-fit): the smallest run that holds all remaining bits,
+	otherwise the largest run, until all bits are found.  The bit
+	numbers are returned in ascending order.
+-----------------------------------------------------------------*/
+int allocBitRun(struct minixBitmap *bm, int n, int *bits)
+{
+   int start, len;  // a run of clear bits
+   int *runStart, *runLen;  // all runs of clear bits
+   int *runTaken;  // number of bits taken from each run
+   int numRuns = 0, maxRuns;
+   int count = 0;  // number of bits allocated
+   int best, i, pass;
+
+   if(n > bm->numFree) n = bm->numFree;
+   if(n <= 0) return(0);
+   // Next-fit: first run long enough from the cursor, then from the start
+   for(pass=0 ; pass<2 ; pass++)
+   {
+      for(start = nextClearRun(bm, pass == 0 ? bm->next*64 : 0, &len) ;
+          start != ERR1 ; start = nextClearRun(bm, start+len, &len))
+         if(len >= n)
+         {
+            setBitRange(bm, start, n);
+            for(i=0 ; i<n ; i++) bits[i] = start+i;
+            return(n);
+         }
+   }
+   // Best-fit fragments: collect all runs
+   maxRuns = bm->numFree;
+   runStart = malloc(maxRuns*sizeof(int));
+   runLen = malloc(maxRuns*sizeof(int));
+   runTaken = calloc(maxRuns, sizeof(int));
+   if(runStart == NULL || runLen == NULL || runTaken == NULL)
+   {
+      perror("allocBitRun");
+      free(runStart);
+      free(runLen);
+      free(runTaken);
+      return(allocBits(bm, n, bits));
+   }
+   for(start = nextClearRun(bm, 0, &len) ; start != ERR1 && numRuns < maxRuns ;
+       start = nextClearRun(bm, start+len, &len))
+   {
+      runStart[numRuns] = start;
+      runLen[numRuns++] = len;
+   }
+   while(count < n)
+   {
+      best = ERR1;
+      for(i=0 ; i<numRuns ; i++)  // smallest run that is large enough
+         if(runLen[i] >= n-count && (best == ERR1 || runLen[i] < runLen[best])) best = i;
+      if(best == ERR1)  // otherwise the largest run
+         for(i=0 ; i<numRuns ; i++)
+            if(runLen[i] > 0 && (best == ERR1 || runLen[i] > runLen[best])) best = i;
+      if(best == ERR1) break;
+      len = runLen[best] < n-count ? runLen[best] : n-count;
+      setBitRange(bm, runStart[best], len);
+      runTaken[best] = len;
+      count += len;
+      runLen[best] = 0;  // used
+   }
+   // return the bits in ascending order (runs are in ascending order)
+   for(count=0, i=0 ; i<numRuns ; i++)
+      for(len=0 ; len<runTaken[i] ; len++) bits[count++] = runStart[i]+len;
+   free(runStart);
+   free(runLen);
+   free(runTaken);
+   return(count);
+}
+
+/*-----------------------------------------------------------------
+Function: nextClearRun
+
+Parameters: struct minixBitmap *bm - allocator
+            int from - first bit to look at
+            int *len - used to return the length of the run
+
+Returns: first bit of the next run of clear bits at or after "from"
+         ERR1 - no clear bit after "from".
+
+Description: 
+        Finds the next run of clear bits, skipping full and empty
+	words 64 bits at a time.
+-----------------------------------------------------------------*/
+int nextClearRun(struct minixBitmap *bm, int from, int *len)
+{
+   bitmapWord *words = (bitmapWord *)bm->map;
+   uint64_t bitsLeft;  // bits of the current word at or after the position
+   int w, start, end;
+
+   if(from >= bm->numBits) return(ERR1);
+   // find the first clear bit
+   w = from/64;
+   bitsLeft = ~le64toh(words[w]) & (~0ULL << (from%64));
+   while(bitsLeft == 0 && ++w < bm->numWords) bitsLeft = ~le64toh(words[w]);
+   STAT_ADD(stats.bitmapWords, w - from/64 + 1);
+   if(bitsLeft == 0) return(ERR1);
+   start = w*64 + __builtin_ctzll(bitsLeft);
+   if(start >= bm->numBits) return(ERR1);
+   // find the next set bit
+   bitsLeft = le64toh(words[w]) & (~0ULL << (start%64));
+   while(bitsLeft == 0 && ++w < bm->numWords) bitsLeft = le64toh(words[w]);
+   STAT_ADD(stats.bitmapWords, w - start/64);
+   end = bitsLeft == 0 ? bm->numBits : w*64 + __builtin_ctzll(bitsLeft);
+   if(end > bm->numBits) end = bm->numBits;
+   *len = end-start;
+   return(start);
+}
+
+/*-----------------------------------------------------------------
+Function: setBitRange   clearBit
+
+Parameters: struct minixBitmap *bm - allocator
+            int start - first bit
+            int n - number of bits to set
+
+Description: 
+        Sets n consecutive clear bits (setBitRange) or clears a set
+	bit (clearBit), keeping the free count and cursor up to date.
+-----------------------------------------------------------------*/
+void setBitRange(struct minixBitmap *bm, int start, int n)
+{
+   int i;
+   for(i=start ; i<start+n ; i++) bm->map[i/8] |= 1<<(i%8);
+   bm->numFree -= n;
+   bm->next = (start+n-1)/64;
+}
+
+void clearBit(struct minixBitmap *bm, int bit)
+{
+   bm->map[bit/8] &= ~(1<<(bit%8));
+   bm->numFree++;
+}
+
+/*-----------------------------------------------------------------
+Function: getFreeInodes   getFreeDataBlocks
+
+Returns: number of free inodes / data blocks.
+-----------------------------------------------------------------*/
+int getFreeInodes()
+{
+   return(inodeBitmap.numFree);
+}
+
+int getFreeDataBlocks()
+{
+   return(zoneBitmap.numFree);
+}
+
+/*-----------------------------------------------------------------
+Function: initBitmap
+
+Parameters: struct minixBitmap *bm - allocator to set up
+            unsigned char *map - bit map (imap or zmap)
+            int numBits - number of valid bits in the map
+
+Description: 
+        Sets up an allocator over a bit map and counts its free bits.
+-----------------------------------------------------------------*/
+void initBitmap(struct minixBitmap *bm, unsigned char *map, int numBits)
+{
+   bitmapWord *words = (bitmapWord *)map;
+   uint64_t used;
+   int w;
+   bm->map = map;
+   bm->numBits = numBits;
+   bm->numWords = (numBits+63)/64;
+   bm->next = 0;
+   bm->numFree = 0;
+   for(w=0 ; w<bm->numWords ; w++)
+   {
+      used = le64toh(words[w]);
+      if(w == bm->numWords-1 && numBits%64)  // bits past the end are not free
+         used |= ~0ULL << (numBits%64);
+      bm->numFree += 64 - __builtin_popcountll(used);
+   }
+}
+
+/*-----------------------------------------------------------------
+Function: allocBits
+
+Parameters: struct minixBitmap *bm - allocator
+            int n - number of bits wanted
+            int *bits - array of n elements for the bit numbers
+
+Returns: number of bits allocated (less than n when the map is full).
+
+Description: 
+        Finds clear bits, sets them and returns their numbers in
+	ascending order from the cursor.  The map is scanned 64 bits
+	at a time and the first clear bit of a word is found with
+	count-trailing-zeros.  The scan starts at the word of the
+	last allocation (next-fit) and wraps around once, so an
+	allocation costs amortized O(1) instead of a scan from bit 0.
+-----------------------------------------------------------------*/
+int allocBits(struct minixBitmap *bm, int n, int *bits)
+{
+   bitmapWord *words = (bitmapWord *)bm->map;
+   uint64_t freeBits;  // bits clear in the current word
+   int w = bm->next;  // current word
+   int scanned = 0;  // number of words scanned
+   int reads = 0;  // number of words read
+   int count = 0;  // number of bits allocated
+   int bit;
+
+   while(count < n && bm->numFree > 0 && scanned <= bm->numWords)
+   {
+      reads++;
+      freeBits = ~le64toh(words[w]);
+      if(w == bm->numWords-1 && bm->numBits%64)  // bits past the end are not free
+         freeBits &= ~(~0ULL << (bm->numBits%64));
+      if(freeBits == 0)  // full - go to next word
+      {
+         w = (w+1)%bm->numWords;
+         scanned++;
+         continue;
+      }
+      bit = __builtin_ctzll(freeBits);
+      words[w] |= htole64(1ULL << bit);
+      bits[count++] = w*64 + bit;
+      bm->numFree--;
+   }
+   bm->next = w;
+   STAT_ADD(stats.bitmapWords, reads);
+   return(count);
 }
 
 /*-----------------------------------------------------------------
@@ -659,12 +1437,13 @@ Returns: ERR1 - error encountered.
 -----------------------------------------------------------------*/
 int getDataBlock(int i, struct minix_inode *ino, char *datablk)
 {  
-    if(seekToDataBlock(i,ino) == ERR1) 
+    int zone = getZoneNum(i,ino);
+    if(zone == ERR1) 
     {
        perror("getDataBlock");
        return(ERR1);
     }
-    if(read(minixfd,datablk,BLOCK_SIZE) != BLOCK_SIZE) 
+    if(minixRead((off_t)zone*BLOCK_SIZE,datablk,BLOCK_SIZE) != BLOCK_SIZE) 
     {
        perror("getDataBlock");
        return(ERR1);
@@ -692,16 +1471,180 @@ Returns: ERR1 - error encountered.
 int writeDataBlock(int blockNum, char *datablk)
 {
     int retcd = OK; 
-    if(lseek(minixfd,(blockNum*BLOCK_SIZE),SEEK_SET) == -1) 
+    if(minixWrite((off_t)blockNum*BLOCK_SIZE,datablk,BLOCK_SIZE) != BLOCK_SIZE)
     {
        perror("writeDataBlock");
        retcd = ERR1;
     }
-    else if(write(minixfd,datablk,BLOCK_SIZE) != BLOCK_SIZE)
+    else updateIndirectCache(blockNum, datablk, 1);
+    return(retcd);
+}
+
+/*-----------------------------------------------------------------
+Function: writeDataBlocks
+
+Parameters: blockNum - number of the first block
+            datablks - pointer to buffer with n data blocks
+            n - number of consecutive blocks
+
+Global Variables:
+   int minixfd - file descriptor of open fs.
+
+Description: Saves n blocks into the consecutive data blocks starting at
+             blockNum.  Writes are combined: a write of up to
+	     COMBINE_HOLD bytes is copied and held by the thread, and
+	     following writes to the next data blocks are added to it,
+	     up to COMBINE_SIZE bytes.  The run held is written with a
+	     single write when a write is not to the next data block
+	     (gap), when it is full, before a read, and by
+	     flushDataBlocks.  A larger write that follows the run held
+	     is written together with it with a single pwritev.
+	     An error in writing blocks held is returned by the call
+	     that writes them.
+
+Returns: ERR1 - error encountered.
+         OK - Data blocks written (or held).
+-----------------------------------------------------------------*/
+int writeDataBlocks(int blockNum, char *datablks, int n)
+{
+    int retcd = OK; 
+    int size = n*BLOCK_SIZE;
+    if(minixMap != NULL)  // copied to the mapping, nothing to combine
+    {
+       if(minixWrite((off_t)blockNum*BLOCK_SIZE,datablks,size) != size) retcd = ERR1;
+    }
+    else if(pending.numBlocks > 0 && blockNum == pending.start+pending.numBlocks &&
+            (pending.numBlocks+n)*BLOCK_SIZE <= COMBINE_SIZE)  // add to the run held
     {
-       perror("writeDataBlock");
+       memcpy(pending.buffer+pending.numBlocks*BLOCK_SIZE, datablks, size);
+       pending.numBlocks += n;
+    }
+    else if(pending.numBlocks > 0 && blockNum == pending.start+pending.numBlocks &&
+            size > COMBINE_HOLD)  // written with the run held
+       retcd = flushPending(datablks, n);
+    else
+    {
+       if(pending.numBlocks > 0) retcd = flushPending(NULL, 0);  // gap
+       if(pending.buffer == NULL && size <= COMBINE_HOLD)
+          pending.buffer = allocIOBuffer(COMBINE_SIZE);
+       if(size > COMBINE_HOLD || pending.buffer == NULL)  // written at once
+       {
+          if(minixWrite((off_t)blockNum*BLOCK_SIZE,datablks,size) != size) retcd = ERR1;
+       }
+       else
+       {
+          memcpy(pending.buffer, datablks, size);
+          pending.start = blockNum;
+          pending.numBlocks = n;
+       }
+    }
+    if(retcd == ERR1) perror("writeDataBlocks");
+    else updateIndirectCache(blockNum, datablks, n);
+    return(retcd);
+}
+
+/*-----------------------------------------------------------------
+Function: zeroDataBlocks
+
+Parameters: blockNum - number of the first block
+            n - number of consecutive blocks
+
+Returns: ERR1 - error encountered.
+         OK - Data blocks cleared.
+
+Description: Fills n data blocks with zeros without writing them: the
+             blocks are deallocated from the file system image
+	     (fallocate punching a hole), so the image stays sparse.
+	     If the image cannot have holes, zeros are written with
+	     writeDataBlocks instead.
+-----------------------------------------------------------------*/
+int zeroDataBlocks(int blockNum, int n)
+{
+    static char zeros[16*BLOCK_SIZE];  // for writing zeros
+    int len;
+    if(punchHoles)
+    {
+       countIO(&stats.minix, 1, 0, 0);
+       if(fallocate(minixfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                    (off_t)blockNum*BLOCK_SIZE, (off_t)n*BLOCK_SIZE) == 0)
+          return(OK);
+       if(errno != EOPNOTSUPP && errno != ENOSYS && errno != ENODEV)
+       {
+          perror("zeroDataBlocks");
+          return(ERR1);
+       }
+       if(atomic_exchange(&punchHoles, FALSE))  // the first worker to find out
+          logPrintf(LOG_INFO, "The Minix file system cannot have holes - writing zeros\n");
+    }
+    for( ; n > 0 ; n -= len, blockNum += len)
+    {
+       len = n < 16 ? n : 16;
+       if(writeDataBlocks(blockNum, zeros, len) == ERR1) return(ERR1);
+    }
+    return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: flushDataBlocks
+
+Returns: ERR1 - error encountered.
+         OK - Data blocks written.
+
+Description: Writes the data blocks held by the thread (see
+             writeDataBlocks).  Each thread that writes data blocks
+	     calls it when done; closeMinixFS calls it.
+-----------------------------------------------------------------*/
+int flushDataBlocks()
+{
+    int retcd = OK;
+    if(pending.numBlocks > 0 && flushPending(NULL, 0) == ERR1)
+    {
+       perror("flushDataBlocks");
        retcd = ERR1;
     }
+    free(pending.buffer);
+    pending.buffer = NULL;
+    return(retcd);
+}
+
+/*-----------------------------------------------------------------
+Function: flushPending
+
+Parameters: datablks - n data blocks that follow the run held (or NULL)
+            n - number of data blocks
+
+Returns: ERR1 - error encountered.
+         OK - Data blocks written.
+
+Description: Writes the run of data blocks held by the thread, and the
+             n data blocks that follow it, with a single pwritev.  With
+	     O_DIRECT, each part is written with ioWrite (alignment).
+-----------------------------------------------------------------*/
+int flushPending(char *datablks, int n)
+{
+    struct iovec iov[2];
+    off_t offset = (off_t)pending.start*BLOCK_SIZE;
+    int size = pending.numBlocks*BLOCK_SIZE;
+    int retcd = OK;
+
+    pending.numBlocks = 0;  // even on error, not written again
+    countIO(&stats.minix, ioAlign != 0 && n > 0 ? 2 : 1, 0, size+n*BLOCK_SIZE);
+    TRACE_BEGIN("write data blocks", NULL);
+    if(ioAlign != 0)
+    {
+       if(ioWrite(minixfd, pending.buffer, size, offset) != size) retcd = ERR1;
+       if(n > 0 && ioWrite(minixfd, datablks, n*BLOCK_SIZE, offset+size) != n*BLOCK_SIZE)
+          retcd = ERR1;
+    }
+    else
+    {
+       iov[0].iov_base = pending.buffer;
+       iov[0].iov_len = size;
+       iov[1].iov_base = datablks;
+       iov[1].iov_len = n*BLOCK_SIZE;
+       if(pwritev(minixfd, iov, n > 0 ? 2 : 1, offset) != size+n*BLOCK_SIZE) retcd = ERR1;
+    }
+    TRACE_END("write data blocks");
     return(retcd);
 }
 
@@ -726,19 +1669,111 @@ Returns: ERR1 - error encountered.
 int saveDataBlock(int i, struct minix_inode *ino, char *datablk)
 {
     int retcd = OK; 
-    if(seekToDataBlock(i,ino) == ERR1)
+    int zone = getZoneNum(i,ino);
+    if(zone == ERR1)
     {
        perror("saveDataBlock");
        retcd = ERR1;
     }
-    else if(write(minixfd,datablk,BLOCK_SIZE) != BLOCK_SIZE)
+    else if(minixWrite((off_t)zone*BLOCK_SIZE,datablk,BLOCK_SIZE) != BLOCK_SIZE)
     {
        perror("saveDataBlock");
        retcd = ERR1;
     }
+    else updateIndirectCache(zone, datablk, 1);
     return(retcd);
 }
 
+/*-----------------------------------------------------------------
+Function: getZoneNum(i, ino)
+
+Parameters: i - number of data block in the file.
+            ino - inode structure
+
+Global Variables:
+   int minixfd - file descriptor of open fs.
+
+Description: Finds the zone (block number in the file system) of the
+             ith data block found in the file (directory) referenced
+	     by the inode "ino", using the indirect block for i >= 7.
+	     The indirect block is taken from the indirect block cache
+	     (see getIndirectBlock), so that sequential access to a
+	     file reads it only once.
+
+Returns: ERR1 - error encountered.
+         zone number of the data block.
+-----------------------------------------------------------------*/
+int getZoneNum(int i, struct minix_inode *ino)
+{
+    unsigned short *indexblock;  /* integer array - contained in single block */
+    int zone = ERR1;
+    if(i<7) zone = ino->i_zone[i];
+    else if(i<(7+BLOCK_SIZE/2))  /* use indirect block */
+    {
+       pthread_mutex_lock(&minixLock);
+       indexblock = getIndirectBlock(ino->i_zone[7]);
+       if(indexblock != NULL) zone = indexblock[i-7];  /* lets find data block in the array */ 
+       pthread_mutex_unlock(&minixLock);
+    }
+      /* double indirect block not implemented */
+    return(zone);
+}
+
+/*-----------------------------------------------------------------
+Function: getIndirectBlock(zone)
+
+Parameters: zone - zone of an indirect block
+
+Global Variables:
+   struct indirectCache indCache[] - cached indirect blocks
+
+Description: Returns the contents of the indirect block stored in
+             "zone", reading it only when it is not in the cache.
+	     The entries are replaced in turn.
+
+Returns: NULL - error encountered (or no indirect block).
+         address of the cached block (array of zone numbers).
+-----------------------------------------------------------------*/
+unsigned short *getIndirectBlock(int zone)
+{
+    struct indirectCache *entry;
+    int i;
+    if(zone == 0) return(NULL);  // no indirect block allocated
+    for(i=0 ; i<NUM_INDIRECT_CACHE ; i++)
+       if(indCache[i].zone == zone) return(indCache[i].index);
+    entry = indCache+indCacheNext;
+    indCacheNext = (indCacheNext+1)%NUM_INDIRECT_CACHE;
+    STAT_ADD(stats.indirectReads, 1);
+    if(minixRead((off_t)zone*BLOCK_SIZE,entry->index,BLOCK_SIZE) != BLOCK_SIZE)
+    {
+       perror("getIndirectBlock");
+       entry->zone = 0;
+       return(NULL);
+    }
+    entry->zone = zone;
+    return(entry->index);
+}
+
+/*-----------------------------------------------------------------
+Function: updateIndirectCache(zone, datablks, n)
+
+Parameters: zone - first zone that has been written
+            datablks - new contents of the zones
+            n - number of consecutive zones written
+
+Description: Keeps the indirect block cache consistent with the disk
+             when a cached indirect block is written.
+-----------------------------------------------------------------*/
+void updateIndirectCache(int zone, char *datablks, int n)
+{
+    int i;
+    pthread_mutex_lock(&minixLock);
+    for(i=0 ; i<NUM_INDIRECT_CACHE ; i++)
+       if(indCache[i].zone >= zone && indCache[i].zone < zone+n)
+          memcpy(indCache[i].index, datablks+(indCache[i].zone-zone)*BLOCK_SIZE, BLOCK_SIZE);
+    pthread_mutex_unlock(&minixLock);
+}
+
 /*-----------------------------------------------------------------
 Function: seekToDataBlock(i, ino)
 
@@ -757,36 +1792,19 @@ Returns: ERR1 - error encountered.
 -----------------------------------------------------------------*/
 int seekToDataBlock(int i, struct minix_inode *ino)
 {
-    short indexblock[BLOCK_SIZE/2];  /* integer array - contained in single block */
     int retcd = OK;
-    if(i<7)  
+    int zone = getZoneNum(i,ino);
+    if(zone != ERR1)
     {
-        if(lseek(minixfd,(ino->i_zone[i]*BLOCK_SIZE),SEEK_SET) == -1) 
-	{
-	   perror("seekToDataBlock");
-	   retcd = ERR1;
-	}
+       countIO(&stats.minix, 1, 0, 0);
+       STAT_ADD(stats.minix.seeks, 1);
     }
-    else if(i<(7+BLOCK_SIZE/2))  /* use indirect block */
+    if(zone == ERR1) retcd = ERR1;
+    else if(lseek(minixfd,((off_t)zone*BLOCK_SIZE),SEEK_SET) == -1) 
     {
-       if(lseek(minixfd,(ino->i_zone[7]*BLOCK_SIZE),SEEK_SET) == -1)
-       {
-	   perror("seekToDataBlock");
-	   retcd = ERR1;
-       }
-       else if(read(minixfd,indexblock,BLOCK_SIZE) != BLOCK_SIZE)
-       {
-	   perror("seekToDataBlock");
-	   retcd = ERR1;
-       }
-       /* lets find data block in the array */ 
-       else if(lseek(minixfd,(indexblock[i-7]*BLOCK_SIZE),SEEK_SET) == -1)
-       {
-	   perror("seekToDataBlock");
-	   retcd = ERR1;
-       }
+       perror("seekToDataBlock");
+       retcd = ERR1;
     }
-      /* double indirect block not implemented */
     return(retcd);
 }
 
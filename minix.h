@@ -18,6 +18,7 @@ Description: Contains definitions and include files for the
 #include <string.h>
 #include <unistd.h>
 #include <linux/types.h>
+#include <errno.h>
 #include <linux/minix_fs.h>
 
 /* Definitions */
@@ -40,6 +41,35 @@ Description: Contains definitions and include files for the
 #define FIRSTZONE (1+1+minixSB.s_imap_blocks+minixSB.s_zmap_blocks+NUMITABLEBLOCKS) 
 #define TOTALDATABLOCKS minixSB.s_nzones-FIRSTZONE /* Total number of zones (data blocks) - 64 K */
 
+#define NUM_INDIRECT_CACHE 4  /* number of indirect blocks kept in memory */
+#define COMBINE_SIZE (128*1024)  /* largest run of data blocks held for write combining */
+#define COMBINE_HOLD (16*1024)  /* largest write held (larger ones are written at once) */
+
+/* Cached indirect block */
+struct indirectCache
+{
+   unsigned short zone;  // zone of the indirect block (0 - entry not used)
+   unsigned short index[BLOCK_SIZE/2];  // zone numbers in the indirect block
+};
+
+/* Data blocks written but held for write combining (one per thread) */
+struct pendingWrites
+{
+   char *buffer;  // COMBINE_SIZE bytes (NULL until the first write held)
+   int start;  // first data block of the run held
+   int numBlocks;  // number of data blocks held
+};
+
+/* Allocator over a bit map (imap or zmap) */
+struct minixBitmap
+{
+   unsigned char *map;  // the bit map
+   int numBits;  // number of valid bits
+   int numWords;  // number of 64 bit words holding the valid bits
+   int next;  // word where the next search starts
+   int numFree;  // number of clear bits
+};
+
 /* Directory table */
 struct dentry
 {
@@ -47,10 +77,31 @@ struct dentry
    char name[30];
 };
 
+#define MAXDIRENTRIES (7*BLOCK_SIZE/DIRENTRYSIZE)  /* direct blocks only */
+#define DIRHASHSIZE 512  /* slots in a directory hash index (power of 2 > MAXDIRENTRIES) */
+
+/* Open Minix directory - carried from parent to child while copying */
+struct minixDirectory
+{
+   int inoNum;  // inode number of the directory
+   int parentInoNum;  // inode number of the parent directory
+   struct minix_inode ino;  // inode of the directory
+   struct dentry *table;  // directory table (MAXDIRENTRIES entries)
+   int numRecs;  // number of records in the table
+   short *hash;  // hash index: entry index+1 per slot, 0 if empty (NULL until used)
+   int numHashed;  // number of entries of the table in the hash index
+};
+typedef struct minixDirectory MINIXDIR;
+
+// Global data (see minix.c)
+extern int minixfd;  // file descriptor of open Minix file system
+extern char *minixMap;  // Minix file system mapped in memory (NULL if not mapped)
+
 /******************* Entry Point Prototypes **********************/
 // Minix File System
 int initMinixFS(int);
-void closeMinixFS(void);
+int closeMinixFS(void);
+int mapMinixImage(int);
 
 // Functions to manipulate Minix Directories
 struct dentry *openMinixDirectory(char *, int *, int *, int *, struct minix_inode *);
@@ -58,21 +109,37 @@ void closeMinixDirectory( struct dentry *, int, int, struct minix_inode *);
 int scanMinixSubDirectories(char *, struct dentry *, int, 
                             struct minix_inode *, int, int *);
 struct dentry *getMinixDirTable(struct minix_inode *, int *);
+MINIXDIR *openMinixDir(char *);
+MINIXDIR *openMinixSubDir(MINIXDIR *, char *);
+void closeMinixDir(MINIXDIR *);
+struct dentry *newMinixDirEntry(MINIXDIR *);
+void dropMinixDirEntry(MINIXDIR *);
+int findMinixDirEntry(MINIXDIR *, char *);
 void saveMinixDirTable(struct minix_inode *, struct dentry *, int);
 
 // Functions to manipulate Inodes
 int findInodeFromPath(char *, struct minix_inode *, int *);
 short findFreeInode(void);
+void freeInode(int);
+int getFreeInodes(void);
 int readInode(int, struct minix_inode *);
 int saveInode(int, struct minix_inode *);
 int seekToInode(int);
+off_t inodeOffset(int);
 
 // Functions to manipulate data blocks (zones)
 int findFreeDataBlock(void);
+int allocDataBlocks(int, int *);
+int allocFileBlocks(int, struct minix_inode *, unsigned short *);
+int writeDataBlocks(int, char *, int);
+int flushDataBlocks(void);
+int zeroDataBlocks(int, int);
+int getFreeDataBlocks(void);
 int getDataBlock(int, struct minix_inode *, char *);
 int writeDataBlock(int, char *);
 int saveDataBlock(int, struct minix_inode *, char *);
 int seekToDataBlock(int, struct minix_inode *);
+int getZoneNum(int, struct minix_inode *);
 
 // Functions to support debugging
 void printInode(struct minix_inode *);
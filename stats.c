@@ -0,0 +1,112 @@
+/*-----------------------------------------------------------------
+File: stats.c
+Description: This file contains the counters of the conversion: the
+             system calls and bytes of I/O on each file system, and
+	     the work done by the allocator, the inode table and the
+	     directories (updated in the fat and minix modules), and
+	     the wall time of each phase (see stats.h).  They are
+	     printed as JSON by fat2minix --stats=json.
+
+	     The counters are updated with relaxed atomic additions,
+	     so that the copy threads can count without a lock.
+------------------------------------------------------------------*/
+
+#include "stats.h"
+#include <time.h>
+
+// Global data
+struct convStats stats;  // all counters (zero at start)
+int currentPhase = -1;  // phase being timed (-1 - none)
+double phaseStart;  // when it started (seconds)
+
+//*************** Prototypes of local functions **********************
+double wallClock(void);
+void printIoStats(FILE *, char *, struct ioStats *);
+
+/*-----------------------------------------------------------------
+Function: countIO
+
+Parameters: struct ioStats *io - file system (&stats.fat or &stats.minix)
+            int calls - number of system calls
+            long bytesRead - bytes read
+            long bytesWritten - bytes written
+-----------------------------------------------------------------*/
+void countIO(struct ioStats *io, int calls, long bytesRead, long bytesWritten)
+{
+   if(calls) STAT_ADD(io->syscalls, calls);
+   if(bytesRead) STAT_ADD(io->bytesRead, bytesRead);
+   if(bytesWritten) STAT_ADD(io->bytesWritten, bytesWritten);
+}
+
+/*-----------------------------------------------------------------
+Function: enterPhase
+
+Parameters: int phase - phase starting (PHASE_...), NUM_PHASES when
+                        the conversion is over
+
+Description: Ends the phase being timed and starts the next.  Called
+             by the main thread only.
+-----------------------------------------------------------------*/
+void enterPhase(int phase)
+{
+   double now = wallClock();
+   if(currentPhase >= 0) stats.phaseSeconds[currentPhase] += now - phaseStart;
+   currentPhase = phase < NUM_PHASES ? phase : -1;
+   phaseStart = now;
+}
+
+/*-----------------------------------------------------------------
+Function: printStatsJson
+
+Parameters: FILE *out - where to print
+
+Description: Prints all counters as one JSON object.
+-----------------------------------------------------------------*/
+void printStatsJson(FILE *out)
+{
+   static char *phaseNames[NUM_PHASES] = {"load", "traverse", "copy", "flush"};
+   double total = 0;
+   int i;
+   fprintf(out, "{\n  \"phase_seconds\": {");
+   for(i=0 ; i<NUM_PHASES ; i++)
+   {
+      fprintf(out, "\"%s\": %.6f, ", phaseNames[i], stats.phaseSeconds[i]);
+      total += stats.phaseSeconds[i];
+   }
+   fprintf(out, "\"total\": %.6f},\n", total);
+   printIoStats(out, "fat", &stats.fat);
+   printIoStats(out, "minix", &stats.minix);
+   fprintf(out, "  \"io_uring_submits\": %ld,\n", (long)stats.uringSubmits);
+   fprintf(out, "  \"bitmap_words_scanned\": %ld,\n", (long)stats.bitmapWords);
+   fprintf(out, "  \"inode_reads\": %ld,\n", (long)stats.inodeReads);
+   fprintf(out, "  \"inode_writes\": %ld,\n", (long)stats.inodeWrites);
+   fprintf(out, "  \"indirect_block_reads\": %ld\n}\n", (long)stats.indirectReads);
+   fflush(out);
+}
+
+/*-----------------------------------------------------------------
+Function: printIoStats
+
+Parameters: FILE *out - where to print
+            char *name - name of the file system
+            struct ioStats *io - its counters
+-----------------------------------------------------------------*/
+void printIoStats(FILE *out, char *name, struct ioStats *io)
+{
+   fprintf(out, "  \"%s\": {\"syscalls\": %ld, \"bytes_read\": %ld, \"bytes_written\": %ld, "
+                "\"seeks\": %ld, \"directory_loads\": %ld},\n",
+           name, (long)io->syscalls, (long)io->bytesRead, (long)io->bytesWritten,
+           (long)io->seeks, (long)io->dirLoads);
+}
+
+/*-----------------------------------------------------------------
+Function: wallClock
+
+Returns: the monotonic clock in seconds.
+-----------------------------------------------------------------*/
+double wallClock()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec + ts.tv_nsec/1e9);
+}
@@ -0,0 +1,56 @@
+/*-----------------------------------------------------------------
+File: stats.h
+Description: Contains definitions for the stats module, the counters
+             kept by the fat and minix modules while converting and
+	     the wall time of each phase of the conversion, printed
+	     at exit by fat2minix --stats=json.
+------------------------------------------------------------------*/
+
+#ifndef STATS_H_DEF
+#define STATS_H_DEF
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* Phases of the conversion (in order) */
+#define PHASE_LOAD 0  /* boot sector, FAT table, Minix super block, maps, inode table */
+#define PHASE_TRAVERSE 1  /* directories converted (and contents copied meanwhile) */
+#define PHASE_COPY 2  /* contents left to copy (finishCopyJobs) */
+#define PHASE_FLUSH 3  /* Minix file system closed: maps, inode table, msync */
+#define NUM_PHASES 4
+
+/* Counters are updated by any thread, without ordering */
+#define STAT_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+
+/* I/O on one file system */
+struct ioStats
+{
+   _Atomic long syscalls;  // system calls (read, pread, pwrite, pwritev, lseek, madvise...)
+   _Atomic long bytesRead;  // by system calls or from the mapping
+   _Atomic long bytesWritten;  // by system calls or to the mapping
+   _Atomic long seeks;  // lseek
+   _Atomic long dirLoads;  // directory tables (FAT: clusters) loaded
+};
+
+/* All counters */
+struct convStats
+{
+   struct ioStats fat;  // FAT file system
+   struct ioStats minix;  // Minix file system
+   _Atomic long uringSubmits;  // io_uring_enter (reads and writes counted above)
+   _Atomic long bitmapWords;  // 64 bit words of imap and zmap scanned
+   _Atomic long inodeReads;  // readInode
+   _Atomic long inodeWrites;  // saveInode
+   _Atomic long indirectReads;  // indirect blocks read (not in the cache)
+   double phaseSeconds[NUM_PHASES];  // wall time of each phase
+};
+
+// Global data (see stats.c)
+extern struct convStats stats;
+
+// Prototypes of the entry points
+void countIO(struct ioStats *, int, long, long);
+void enterPhase(int);
+void printStatsJson(FILE *);
+
+#endif
@@ -0,0 +1,168 @@
+/*-----------------------------------------------------------------
+File: trace.c
+Description: This file contains the tracer (see trace.h).  Each
+             thread appends its events to a chunk of its own, so that
+	     an event costs a clock read and a copy, without a lock; a
+	     lock is taken only to chain a new chunk.  The chunks are
+	     written as one JSON file by endTrace, once all threads
+	     are done.
+
+	     Without TRACE nothing is compiled.
+------------------------------------------------------------------*/
+
+#ifdef TRACE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // gettid
+#endif
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define OK 0
+#define ERR1 -1
+
+// Global data
+FILE *traceFile = NULL;  // trace being recorded (NULL - not tracing)
+double traceStart;  // when the trace started (microseconds)
+struct traceChunk *traceChunks = NULL;  // all chunks, newest first
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct traceChunk *threadChunk = NULL;  // chunk filled by this thread
+__thread int threadId = 0;  // thread id of this thread (0 - not known yet)
+
+//*************** Prototypes of local functions **********************
+double traceClock(void);
+void writeTraceString(const char *);
+
+/*-----------------------------------------------------------------
+Function: startTrace
+
+Parameters: char *name - file for the trace
+
+Returns: OK, or ERR1 if the file cannot be created.
+-----------------------------------------------------------------*/
+int startTrace(char *name)
+{
+   traceFile = fopen(name, "w");
+   if(traceFile == NULL) { perror(name); return(ERR1); }
+   traceStart = traceClock();
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: traceEvent
+
+Parameters: char phase - 'B' (begin) or 'E' (end)
+            const char *name - what is done (a string constant)
+            const char *detail - file or directory name (or NULL)
+
+Description: Records an event of the calling thread.  Nothing is
+             done when not tracing.
+-----------------------------------------------------------------*/
+void traceEvent(char phase, const char *name, const char *detail)
+{
+   struct traceEvent *ev;
+   if(traceFile == NULL) return;
+   if(threadChunk == NULL || threadChunk->numEvents == TRACECHUNK)
+   {
+      threadChunk = malloc(sizeof(struct traceChunk));
+      if(threadChunk == NULL) return;  // events lost
+      threadChunk->numEvents = 0;
+      pthread_mutex_lock(&traceLock);
+      threadChunk->next = traceChunks;
+      traceChunks = threadChunk;
+      pthread_mutex_unlock(&traceLock);
+   }
+   ev = threadChunk->events + threadChunk->numEvents;
+   ev->ts = traceClock() - traceStart;
+   ev->name = name;
+   ev->phase = phase;
+   if(threadId == 0) threadId = gettid();
+   ev->tid = threadId;
+   ev->detail[0] = '\0';
+   if(detail != NULL)
+   {
+      strncpy(ev->detail, detail, sizeof(ev->detail)-1);
+      ev->detail[sizeof(ev->detail)-1] = '\0';
+   }
+   threadChunk->numEvents++;
+}
+
+/*-----------------------------------------------------------------
+Function: endTrace
+
+Description: Writes all events and closes the trace.  Called by the
+             main thread once the other threads are done.  The events
+	     of each thread are in order; the viewer sorts the threads
+	     by time.
+-----------------------------------------------------------------*/
+void endTrace()
+{
+   struct traceChunk *chunk, *next;
+   struct traceEvent *ev;
+   char *sep = "\n";
+   int i;
+   if(traceFile == NULL) return;
+   fprintf(traceFile, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+   for(chunk = traceChunks ; chunk != NULL ; chunk = next)
+   {
+      for(i=0 ; i<chunk->numEvents ; i++)
+      {
+         ev = chunk->events+i;
+         fprintf(traceFile, "%s{\"name\": ", sep);
+         writeTraceString(ev->name);
+         fprintf(traceFile, ", \"cat\": \"fat2minix\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+                 ev->phase, ev->ts, (int)getpid(), ev->tid);
+         if(ev->detail[0] != '\0')
+         {
+            fprintf(traceFile, ", \"args\": {\"name\": ");
+            writeTraceString(ev->detail);
+            fprintf(traceFile, "}");
+         }
+         fprintf(traceFile, "}");
+         sep = ",\n";
+      }
+      next = chunk->next;
+      free(chunk);
+   }
+   fprintf(traceFile, "\n]}\n");
+   fclose(traceFile);
+   traceFile = NULL;
+   traceChunks = NULL;
+   threadChunk = NULL;
+}
+
+/*-----------------------------------------------------------------
+Function: writeTraceString
+
+Parameters: const char *str - string to write as a JSON string
+-----------------------------------------------------------------*/
+void writeTraceString(const char *str)
+{
+   putc('"', traceFile);
+   for( ; *str != '\0' ; str++)
+   {
+      if(*str == '"' || *str == '\\') fprintf(traceFile, "\\%c", *str);
+      else if((unsigned char)*str < 0x20) fprintf(traceFile, "\\u%04x", *str);
+      else putc(*str, traceFile);
+   }
+   putc('"', traceFile);
+}
+
+/*-----------------------------------------------------------------
+Function: traceClock
+
+Returns: the monotonic clock in microseconds.
+-----------------------------------------------------------------*/
+double traceClock()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec*1e6 + ts.tv_nsec/1e3);
+}
+
+#endif
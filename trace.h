@@ -0,0 +1,55 @@
+/*-----------------------------------------------------------------
+File: trace.h
+Description: Contains definitions for the trace module, a timeline
+             of the conversion in the Chrome trace-event format
+	     (chrome://tracing, ui.perfetto.dev): begin and end
+	     events of each directory, file, I/O batch and map flush,
+	     with the thread that did the work.
+
+	     The tracer is built in only when TRACE is defined
+	     (make TRACE=-DTRACE, see makefile); otherwise the macros
+	     below compile to nothing.  The trace is written by
+	     fat2minix --trace=FILE.
+------------------------------------------------------------------*/
+
+#ifndef TRACE_H_DEF
+#define TRACE_H_DEF
+
+#ifdef TRACE
+
+#define TRACECHUNK 4096  /* events in a chunk (each thread fills its own) */
+
+/* A begin ('B') or end ('E') event */
+struct traceEvent
+{
+   const char *name;  // what is done (a string constant)
+   char detail[32];  // file or directory name ("" if none)
+   char phase;  // 'B' or 'E'
+   int tid;  // thread
+   double ts;  // microseconds since the start of the trace
+};
+
+/* Events of one thread, chained with all the others */
+struct traceChunk
+{
+   struct traceChunk *next;
+   int numEvents;
+   struct traceEvent events[TRACECHUNK];
+};
+
+#define TRACE_BEGIN(name, detail) traceEvent('B', (name), (detail))
+#define TRACE_END(name) traceEvent('E', (name), NULL)
+
+// Prototypes of the entry points
+int startTrace(char *);
+void traceEvent(char, const char *, const char *);
+void endTrace(void);
+
+#else
+
+#define TRACE_BEGIN(name, detail) ((void)0)
+#define TRACE_END(name) ((void)0)
+
+#endif
+
+#endif
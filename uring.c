@@ -0,0 +1,194 @@
+/*-----------------------------------------------------------------
+File: uring.c
+Description: This file contains a small interface to the Linux
+             io_uring system calls.  The rings are mapped and used
+	     directly, as liburing does, so that no library is needed.
+	     Only one thread uses an instance.
+------------------------------------------------------------------*/
+
+#include "uring.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define OK 0
+#define ERR1 -1
+
+/*-----------------------------------------------------------------
+Function: uringInit
+
+Parameters: struct uring *ring - instance to set up
+            unsigned entries - number of submission entries
+
+Returns: OK - io_uring ready
+         ERR1 - io_uring not available (errno is set).
+
+Description: Creates an io_uring instance and maps its rings.
+-----------------------------------------------------------------*/
+int uringInit(struct uring *ring, unsigned entries)
+{
+   struct io_uring_params p;
+   char *sq, *cq;
+
+   memset(ring, 0, sizeof(struct uring));
+   memset(&p, 0, sizeof(p));
+   ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+   if(ring->fd < 0) { ring->fd = -1; return(ERR1); }
+   ring->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+   ring->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP)  // one mapping for both rings
+   {
+      if(ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+      ring->cqRingSize = ring->sqRingSize;
+   }
+   ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if(ring->sqRing == MAP_FAILED) { ring->sqRing = NULL; uringExit(ring); return(ERR1); }
+   if(p.features & IORING_FEAT_SINGLE_MMAP) ring->cqRing = ring->sqRing;
+   else
+   {
+      ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if(ring->cqRing == MAP_FAILED) { ring->cqRing = NULL; uringExit(ring); return(ERR1); }
+   }
+   ring->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if(ring->sqes == MAP_FAILED) { ring->sqes = NULL; uringExit(ring); return(ERR1); }
+   sq = ring->sqRing;
+   ring->sqHead = (unsigned *)(sq + p.sq_off.head);
+   ring->sqTail = (unsigned *)(sq + p.sq_off.tail);
+   ring->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+   ring->sqArray = (unsigned *)(sq + p.sq_off.array);
+   ring->sqEntries = p.sq_entries;
+   cq = ring->cqRing;
+   ring->cqHead = (unsigned *)(cq + p.cq_off.head);
+   ring->cqTail = (unsigned *)(cq + p.cq_off.tail);
+   ring->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   ring->cqEntries = p.cq_entries;
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: uringExit
+
+Parameters: struct uring *ring - instance
+
+Description: Unmaps the rings and closes the instance (registered
+             files and buffers are released by the kernel).
+-----------------------------------------------------------------*/
+void uringExit(struct uring *ring)
+{
+   if(ring->sqes != NULL) munmap(ring->sqes, ring->sqesSize);
+   if(ring->cqRing != NULL && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+   if(ring->sqRing != NULL) munmap(ring->sqRing, ring->sqRingSize);
+   if(ring->fd >= 0) close(ring->fd);
+   memset(ring, 0, sizeof(struct uring));
+   ring->fd = -1;
+}
+
+/*-----------------------------------------------------------------
+Function: uringRegisterFiles / uringRegisterBuffers
+
+Parameters: struct uring *ring - instance
+            int *fds - files (IOSQE_FIXED_FILE uses their index)
+            struct iovec *iov - buffers (the READ_FIXED/WRITE_FIXED
+	                        operations use their index)
+            int n - number of files or buffers
+
+Returns: OK, or ERR1 (errno is set).
+
+Description: Registers files and buffers with the kernel once, so
+             that the operations do not look them up every time.
+-----------------------------------------------------------------*/
+int uringRegisterFiles(struct uring *ring, int *fds, int n)
+{
+   if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, n) < 0)
+      return(ERR1);
+   return(OK);
+}
+
+int uringRegisterBuffers(struct uring *ring, struct iovec *iov, int n)
+{
+   if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+      return(ERR1);
+   return(OK);
+}
+
+/*-----------------------------------------------------------------
+Function: uringGetSqe / uringSqSpace
+
+Parameters: struct uring *ring - instance
+
+Returns: uringGetSqe - a cleared submission entry, or NULL if the
+                       submission ring is full.
+         uringSqSpace - number of entries that can be filled.
+
+Description: The entries filled are submitted by uringSubmit.
+-----------------------------------------------------------------*/
+struct io_uring_sqe *uringGetSqe(struct uring *ring)
+{
+   struct io_uring_sqe *sqe;
+   unsigned tail = *ring->sqTail + ring->sqPending;
+   if(uringSqSpace(ring) == 0) return(NULL);
+   sqe = ring->sqes + (tail & *ring->sqMask);
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+   ring->sqPending++;
+   return(sqe);
+}
+
+unsigned uringSqSpace(struct uring *ring)
+{
+   unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+   return(ring->sqEntries - (*ring->sqTail + ring->sqPending - head));
+}
+
+/*-----------------------------------------------------------------
+Function: uringSubmit
+
+Parameters: struct uring *ring - instance
+            unsigned waitNr - number of completions to wait for
+
+Returns: number of entries submitted, or ERR1 (errno is set).
+
+Description: Passes the entries filled to the kernel with a single
+             io_uring_enter, and waits for completions if asked.
+-----------------------------------------------------------------*/
+int uringSubmit(struct uring *ring, unsigned waitNr)
+{
+   int n;
+   unsigned toSubmit = ring->sqPending;
+   __atomic_store_n(ring->sqTail, *ring->sqTail + toSubmit, __ATOMIC_RELEASE);
+   ring->sqPending = 0;
+   do
+      n = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+                  waitNr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   while(n < 0 && errno == EINTR);
+   return(n < 0 ? ERR1 : n);
+}
+
+/*-----------------------------------------------------------------
+Function: uringPeekCqe / uringCqeSeen
+
+Parameters: struct uring *ring - instance
+
+Returns: uringPeekCqe - the oldest completion, or NULL if none.
+
+Description: A completion stays in the ring until uringCqeSeen.
+-----------------------------------------------------------------*/
+struct io_uring_cqe *uringPeekCqe(struct uring *ring)
+{
+   unsigned head = *ring->cqHead;
+   if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return(NULL);
+   return(ring->cqes + (head & *ring->cqMask));
+}
+
+void uringCqeSeen(struct uring *ring)
+{
+   __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,45 @@
+/*-----------------------------------------------------------------
+File: uring.h
+Description: Contains definitions for the uring module, a small
+             interface to the Linux io_uring system calls (no
+	     library needed).
+------------------------------------------------------------------*/
+
+#ifndef URING_H_DEF
+#define URING_H_DEF
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* An io_uring instance: the submission and completion rings shared
+   with the kernel */
+struct uring
+{
+   int fd;  // io_uring file descriptor (-1 if not set up)
+   // submission ring
+   unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+   struct io_uring_sqe *sqes;
+   unsigned sqEntries;
+   unsigned sqPending;  // entries filled and not yet submitted
+   // completion ring
+   unsigned *cqHead, *cqTail, *cqMask;
+   struct io_uring_cqe *cqes;
+   unsigned cqEntries;
+   // mappings
+   void *sqRing, *cqRing;
+   size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+// Prototypes of the entry points
+int uringInit(struct uring *, unsigned);
+void uringExit(struct uring *);
+int uringRegisterFiles(struct uring *, int *, int);
+int uringRegisterBuffers(struct uring *, struct iovec *, int);
+struct io_uring_sqe *uringGetSqe(struct uring *);
+unsigned uringSqSpace(struct uring *);
+int uringSubmit(struct uring *, unsigned);
+struct io_uring_cqe *uringPeekCqe(struct uring *);
+void uringCqeSeen(struct uring *);
+
+#endif